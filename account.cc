@@ -0,0 +1,704 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "account.h"
+#include "body_cache.h"
+#include "part_sink.h"
+#include "search_index.h"
+#include "stats.h"
+#include "store.h"
+#include "thread_index.h"
+#include "tls.h"
+#include "utils.h"
+#include <algorithm>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+namespace {
+
+/* most servers limit the number of connections of a user to about 10 */
+const size_t MAX_CONNECTIONS = 8;
+/* number of UIDs a worker connection fetches with one command */
+const uint32_t RANGE_SIZE = 1000;
+/* larger text parts are not prefetched */
+const uint32_t PREFETCH_MAX = 1024 * 1024;
+/* how long a change to the store may wait for the next commit (ms) */
+const unsigned int COMMIT_INTERVAL = 500;
+const int INVALID_GTK_WATCH = -1;
+
+bool folder_less(const std::pair<unsigned int, std::string> &a,
+		 const std::pair<unsigned int, std::string> &b)
+{
+	/* the latest change first, then in the listed order */
+	return a.first > b.first;
+}
+
+}
+
+Account::Account(const std::string &server, const std::string &user,
+		 const std::string &pw) :
+	m_server(server),
+	m_user(user),
+	m_pw(pw),
+	m_connections(1),
+	m_prefetch(0),
+	m_folder("INBOX"),
+	m_changes(0),
+	m_primary(new IMAP(this, server, user, pw, false)),
+	m_store(NULL),
+	m_commit_timer(INVALID_GTK_WATCH),
+	m_body_cache(NULL),
+	m_index(NULL),
+	m_threads(new Thread_Index),
+	m_threads_loaded(false),
+	m_active_workers(0),
+	m_parallel_last(0),
+	m_parallel_tried(false)
+{
+}
+
+Account::~Account()
+{
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		delete m_workers[i];
+	}
+	delete m_primary;
+	close_folder_cache();
+	delete m_threads;
+}
+
+void Account::set_connections(size_t count)
+{
+	m_connections = std::max(std::min(count, MAX_CONNECTIONS), size_t(1));
+}
+
+void Account::open_cache(const std::string &path)
+{
+	m_path = path;
+	load_folders();
+	open_folder_cache();
+
+	/* all connections to the server resume the same session */
+	tls_set_session_file(m_server, path + "/tls-session");
+}
+
+/* The INBOX is where the account kept its only folder before */
+std::string Account::folder_path(const std::string &name) const
+{
+	if (name == "INBOX") {
+		return m_path;
+	}
+	std::string fname;
+	for (size_t i = 0; i < name.size(); ++i) {
+		unsigned char c = name[i];
+		if (isalnum(c) || c == '-' || c == '_') {
+			fname += c;
+		} else {
+			fname += strf("%%%02X", c);
+		}
+	}
+	return m_path + "/folders/" + fname;
+}
+
+void Account::open_folder_cache()
+{
+	uint64_t begin = stats_now();
+	std::string path = folder_path(m_folder);
+	if (path != m_path) {
+		mkdir((m_path + "/folders").c_str(), 0700);
+		mkdir(path.c_str(), 0700);
+	}
+	m_store = new Envelope_Store(path + "/envelopes");
+	m_store->open();
+	m_primary->set_folder(m_folder);
+	m_primary->set_sync_state(m_store->sync_state());
+
+	m_body_cache = new Body_Cache(path + "/bodies");
+	m_body_cache->set_uidvalidity(m_store->sync_state().uidvalidity);
+
+	m_index = new Search_Index(path + "/search");
+	m_index->open();
+	/* a cache from before the index, or a broken index */
+	if (m_index->empty() && m_store->size() > 0) {
+		for (size_t i = 0; i < m_store->size(); ++i) {
+			Envelope env;
+			if (m_store->get(m_store->uid_at(i), &env)) {
+				m_index->add(&env);
+			}
+		}
+		m_index->commit();
+		debug("%s: indexed %u messages\n", m_server.c_str(),
+		      (unsigned int) m_store->size());
+	}
+	stats_span(PHASE_CACHE_LOAD, begin);
+}
+
+void Account::close_folder_cache()
+{
+	if (m_commit_timer != INVALID_GTK_WATCH) {
+		g_source_remove(m_commit_timer);
+		m_commit_timer = INVALID_GTK_WATCH;
+	}
+	/* the store commits and is marked clean when closed */
+	delete m_store;
+	m_store = NULL;
+	delete m_body_cache;
+	m_body_cache = NULL;
+	delete m_index;
+	m_index = NULL;
+	m_threads->clear();
+	m_threads_loaded = false;
+}
+
+const Thread_Index *Account::threads()
+{
+	load_threads();
+	return m_threads;
+}
+
+/* Every envelope has to be read, which is slow with a large mailbox */
+void Account::load_threads()
+{
+	if (m_threads_loaded || m_store == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < m_store->size(); ++i) {
+		Envelope env;
+		if (m_store->get(m_store->uid_at(i), &env)) {
+			m_threads->add(&env);
+		}
+	}
+	m_threads_loaded = true;
+}
+
+void Account::open_folder(const std::string &name)
+{
+	if (name == m_folder) {
+		return;
+	}
+	/* the connections forget what they were doing in the old one */
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		delete m_workers[i];
+	}
+	m_workers.clear();
+	m_ranges.clear();
+	m_active_workers = 0;
+	m_parallel_tried = false;
+	m_primary->disconnect();
+
+	messages_cleared(this);
+	close_folder_cache();
+	m_folder = name;
+	open_folder_cache();
+	for (size_t i = 0; i < m_store->size(); ++i) {
+		message_added(this, m_store->uid_at(i));
+	}
+
+	m_folders[name].changed = false;
+	folders_changed(this);
+	m_primary->connect();
+}
+
+bool Account::folder_changed(const std::string &name) const
+{
+	std::map<std::string, Folder_Info>::const_iterator i =
+		m_folders.find(name);
+	return i != m_folders.end() && i->second.changed;
+}
+
+std::vector<std::string> Account::folders_listed(
+	const std::vector<std::string> &names)
+{
+	std::map<std::string, Folder_Info> folders;
+	std::vector<std::pair<unsigned int, std::string> > order;
+	for (size_t i = 0; i < names.size(); ++i) {
+		folders[names[i]] = m_folders[names[i]];
+		order.push_back(std::make_pair(folders[names[i]].last_change,
+					       names[i]));
+	}
+	/* the one that is shown is kept even if it is gone */
+	folders[m_folder] = m_folders[m_folder];
+	m_folders.swap(folders);
+	m_folder_names = names;
+	save_folders();
+	folders_changed(this);
+
+	std::stable_sort(order.begin(), order.end(), folder_less);
+	std::vector<std::string> out;
+	for (size_t i = 0; i < order.size(); ++i) {
+		out.push_back(order[i].second);
+	}
+	return out;
+}
+
+void Account::folder_status(const std::string &name,
+			    const Folder_Status &status)
+{
+	Folder_Info &info = m_folders[name];
+	bool moved = info.status != status;
+	info.status = status;
+	if (moved) {
+		info.last_change = ++m_changes;
+	}
+	/* a folder that has never been shown has nothing to compare to */
+	bool changed = info.synced.uidvalidity != 0 && status != info.synced;
+	if (changed != info.changed) {
+		info.changed = changed;
+		folders_changed(this);
+	}
+}
+
+void Account::folder_synced(const Folder_Status &status)
+{
+	Folder_Info &info = m_folders[m_folder];
+	info.synced = status;
+	info.status = status;
+	info.changed = false;
+	save_folders();
+}
+
+/* Each line is the counters of a folder when it was synchronized */
+void Account::load_folders()
+{
+	FILE *f = fopen((m_path + "/folder-status").c_str(), "r");
+	if (f == NULL) {
+		return;
+	}
+	char line[1024];
+	while (fgets(line, sizeof line, f) != NULL) {
+		unsigned long uidvalidity, uidnext, messages, modseq;
+		int pos = 0;
+		if (sscanf(line, "%lu %lu %lu %lu %n", &uidvalidity, &uidnext,
+			   &messages, &modseq, &pos) < 4 || pos == 0) {
+			continue;
+		}
+		std::string name = &line[pos];
+		if (!name.empty() && name[name.size() - 1] == '\n') {
+			name.erase(name.size() - 1);
+		}
+		Folder_Info &info = m_folders[name];
+		info.synced.uidvalidity = uidvalidity;
+		info.synced.uidnext = uidnext;
+		info.synced.messages = messages;
+		info.synced.highestmodseq = modseq;
+		info.status = info.synced;
+		m_folder_names.push_back(name);
+	}
+	fclose(f);
+}
+
+void Account::save_folders()
+{
+	std::string fname = m_path + "/folder-status";
+	std::string tmp = fname + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (f == NULL) {
+		debug("Can not open %s: %s\n", tmp.c_str(), strerror(errno));
+		return;
+	}
+	for (const_map_iter<std::string, Folder_Info> i(m_folders); i;
+	     i.next()) {
+		fprintf(f, "%lu %lu %lu %lu %s\n",
+			(unsigned long) i->synced.uidvalidity,
+			(unsigned long) i->synced.uidnext,
+			(unsigned long) i->synced.messages,
+			(unsigned long) i->synced.highestmodseq,
+			i.key().c_str());
+	}
+	if (fclose(f) != 0 || rename(tmp.c_str(), fname.c_str()) < 0) {
+		debug("Can not write %s\n", fname.c_str());
+		unlink(tmp.c_str());
+	}
+}
+
+void Account::connect()
+{
+	m_primary->connect();
+}
+
+/*
+ * Without a known body structure, the whole text of the message is
+ * fetched, with the MIME structure in it.
+ */
+Body_Part Account::text_part(uint32_t uid)
+{
+	Envelope env;
+	if (m_store->get(uid, &env)) {
+		const Body_Part *part = find_text_part(env.parts);
+		if (part != NULL) {
+			return *part;
+		}
+	}
+	Body_Part part;
+	part.section = "TEXT";
+	return part;
+}
+
+Body_Part Account::find_part(uint32_t uid, const std::string &section)
+{
+	Envelope env;
+	if (m_store->get(uid, &env)) {
+		for (size_t i = 0; i < env.parts.size(); ++i) {
+			if (env.parts[i].section == section) {
+				return env.parts[i];
+			}
+		}
+	}
+	Body_Part part;
+	part.section = section;
+	return part;
+}
+
+void Account::fetch_message(uint32_t uid)
+{
+	/* it is shown as it arrives */
+	m_primary->fetch_part(Part_Request(uid, text_part(uid).section));
+}
+
+bool Account::show_cached(uint32_t uid, Part_Sink *sink)
+{
+	/* the cache keeps the part as it is on the server */
+	Decoding_Sink decoder(text_part(uid), true, sink);
+	std::string body;
+	if (!m_body_cache->get(uid, &body)) {
+		return false;
+	}
+	decoder.write(body.data(), body.size());
+	decoder.finish();
+	return true;
+}
+
+std::vector<uint32_t> Account::search(const std::string &query)
+{
+	if (m_index == NULL) {
+		/* the caches are not open yet */
+		return std::vector<uint32_t>();
+	}
+	return m_index->search(query);
+}
+
+bool Account::search_server(const std::string &query)
+{
+	return m_primary->search(query);
+}
+
+void Account::search_done(const std::string &query,
+			  const std::vector<uint32_t> &uids)
+{
+	messages_found(this, query, uids);
+}
+
+void Account::set_threads(const std::vector<Thread_Link> &links)
+{
+	load_threads();
+	for (size_t i = 0; i < links.size(); ++i) {
+		m_threads->set_parent(links[i].first, links[i].second);
+	}
+	threads_changed(this);
+}
+
+void Account::fetch_part(uint32_t uid, const std::string &section)
+{
+	m_primary->fetch_part(Part_Request(uid, section));
+}
+
+void Account::add_message(const Envelope *env)
+{
+	/* the ranges of a failed worker may be fetched again */
+	bool known = m_store->contains(env->uid);
+	try {
+		m_store->add(env);
+	} catch (const store_error &e) {
+		debug("Unable to cache message %u: %s\n", env->uid, e.what());
+		return;
+	}
+	if (!known) {
+		m_index->add(env);
+		if (m_threads_loaded) {
+			m_threads->add(env);
+		}
+	}
+	schedule_commit();
+	if (!known) {
+		message_added(this, env->uid);
+	}
+}
+
+void Account::update_flags(uint32_t uid, unsigned int flags)
+{
+	try {
+		m_store->set_flags(uid, flags);
+	} catch (const store_error &e) {
+		debug("Unable to cache flags of %u: %s\n", uid, e.what());
+	}
+	schedule_commit();
+}
+
+void Account::remove_message(uint32_t uid)
+{
+	message_removed(this, uid);
+	forget_messages(std::vector<uint32_t>(1, uid));
+}
+
+/* Remove the messages from the caches, the list knows already */
+void Account::forget_messages(const std::vector<uint32_t> &uids)
+{
+	try {
+		m_store->remove(uids);
+	} catch (const store_error &e) {
+		debug("Unable to remove messages: %s\n", e.what());
+	}
+	for (size_t i = 0; i < uids.size(); ++i) {
+		m_index->remove(uids[i]);
+		m_threads->remove(uids[i]);
+	}
+	schedule_commit();
+}
+
+void Account::keep_messages(const std::vector<uint32_t> &uids)
+{
+	std::vector<uint32_t> sorted(uids);
+	std::sort(sorted.begin(), sorted.end());
+
+	/* both lists are sorted by UID */
+	std::vector<uint32_t> removed;
+	size_t j = 0;
+	for (size_t i = 0; i < m_store->size(); ++i) {
+		uint32_t uid = m_store->uid_at(i);
+		while (j < sorted.size() && sorted[j] < uid) {
+			j++;
+		}
+		if (j == sorted.size() || sorted[j] != uid) {
+			removed.push_back(uid);
+		}
+	}
+	if (removed.empty()) {
+		return;
+	}
+	messages_removed(this, removed);
+	forget_messages(removed);
+	debug("%s: %u messages were deleted\n", m_server.c_str(),
+	      (unsigned int) removed.size());
+}
+
+void Account::clear_messages()
+{
+	messages_cleared(this);
+
+	try {
+		m_store->clear();
+	} catch (const store_error &e) {
+		debug("Unable to clear the cache: %s\n", e.what());
+	}
+	m_body_cache->clear();
+	m_threads->clear();
+	try {
+		m_index->clear();
+	} catch (const store_error &e) {
+		debug("Unable to clear the index: %s\n", e.what());
+	}
+}
+
+void Account::save_sync_state(const Sync_State &state)
+{
+	m_body_cache->set_uidvalidity(state.uidvalidity);
+	try {
+		m_store->set_sync_state(state);
+	} catch (const store_error &e) {
+		debug("Unable to save the sync state: %s\n", e.what());
+	}
+	schedule_commit();
+}
+
+void Account::sync_finished()
+{
+	/* the most recent messages have the highest UIDs */
+	std::list<Part_Request> parts;
+	for (size_t i = m_store->size(); i-- > 0 && parts.size() < m_prefetch;) {
+		uint32_t uid = m_store->uid_at(i);
+		if (m_body_cache->has(uid)) {
+			continue;
+		}
+		Body_Part part = text_part(uid);
+		if (part.size <= PREFETCH_MAX) {
+			parts.push_back(Part_Request(uid, part.section));
+		}
+	}
+	if (!parts.empty()) {
+		debug("prefetching %u bodies\n", (unsigned int) parts.size());
+		m_primary->prefetch(parts);
+	}
+}
+
+void Account::part_begin(uint32_t uid, const std::string &section)
+{
+	assert(m_sinks.empty());
+	Body_Part text = text_part(uid);
+	Part_Sink *sink;
+	if (section != text.section) {
+		/* an attachment */
+		sink = open_part(this, uid, section);
+		if (sink != NULL) {
+			sink = new Decoding_Sink(find_part(uid, section), false,
+						 sink);
+		}
+	} else {
+		try {
+			Part_Sink *writer = m_body_cache->writer(uid);
+			if (writer != NULL) {
+				m_sinks.push_back(writer);
+			}
+			m_sinks.push_back(new Decoding_Sink(text, true,
+							    m_index->writer(uid)));
+		} catch (const store_error &e) {
+			debug("Unable to cache body of %u: %s\n", uid,
+			      e.what());
+		}
+		sink = open_text(this, uid);
+		if (sink != NULL) {
+			sink = new Decoding_Sink(text, true, sink);
+		}
+	}
+	if (sink != NULL) {
+		m_sinks.push_back(sink);
+	}
+}
+
+void Account::part_data(const char *data, size_t length)
+{
+	for (size_t i = 0; i < m_sinks.size(); ++i) {
+		m_sinks[i]->write(data, length);
+	}
+}
+
+void Account::part_end(bool ok)
+{
+	for (size_t i = 0; i < m_sinks.size(); ++i) {
+		if (ok) {
+			try {
+				m_sinks[i]->finish();
+			} catch (const store_error &e) {
+				debug("Unable to cache a body: %s\n", e.what());
+			}
+		}
+		delete m_sinks[i];
+	}
+	m_sinks.clear();
+}
+
+bool Account::start_parallel_sync(uint32_t first, uint32_t last)
+{
+	if (m_connections < 2 || m_parallel_tried) {
+		return false;
+	}
+	m_parallel_tried = true;
+	m_parallel_last = last;
+
+	/* the newest messages first */
+	m_ranges.clear();
+	for (uint32_t end = last; end >= first;) {
+		uint32_t begin = (end - first >= RANGE_SIZE) ?
+				 end - RANGE_SIZE + 1 : first;
+		m_ranges.push_back(Range(begin, end));
+		if (begin == first) {
+			break;
+		}
+		end = begin - 1;
+	}
+
+	size_t count = std::min(m_connections - 1, m_ranges.size());
+	while (m_workers.size() < count) {
+		m_workers.push_back(new IMAP(this, m_server, m_user, m_pw,
+					     true));
+		m_workers.back()->set_folder(m_folder);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		try {
+			m_workers[i]->connect();
+			m_active_workers++;
+		} catch (const std::runtime_error &e) {
+			debug("Unable to connect a worker: %s\n", e.what());
+		}
+	}
+	if (m_active_workers == 0) {
+		m_ranges.clear();
+		return false;
+	}
+	return true;
+}
+
+bool Account::next_range(uint32_t *first, uint32_t *last)
+{
+	if (m_ranges.empty()) {
+		return false;
+	}
+	*first = m_ranges.front().first;
+	*last = m_ranges.front().second;
+	m_ranges.pop_front();
+	return true;
+}
+
+void Account::range_done(uint32_t first, uint32_t last)
+{
+	debug("%s: fetched UIDs %u:%u\n", m_server.c_str(), first, last);
+}
+
+void Account::worker_failed(IMAP *conn, uint32_t first, uint32_t last)
+{
+	UNUSED(conn);
+	if (first != 0) {
+		/* somebody else has to fetch it */
+		m_ranges.push_front(Range(first, last));
+	}
+	m_active_workers--;
+	if (m_active_workers == 0) {
+		parallel_sync_done();
+	}
+}
+
+void Account::worker_finished(IMAP *conn)
+{
+	UNUSED(conn);
+	m_active_workers--;
+	if (m_active_workers == 0) {
+		parallel_sync_done();
+	}
+}
+
+void Account::parallel_sync_done()
+{
+	bool ok = m_ranges.empty();
+	m_ranges.clear();
+	m_primary->parallel_sync_done(ok, m_parallel_last);
+}
+
+void Account::schedule_commit()
+{
+	if (m_commit_timer == INVALID_GTK_WATCH &&
+	    (m_store->has_pending() || m_index->has_pending())) {
+		m_commit_timer = g_timeout_add(COMMIT_INTERVAL, commit_timeout,
+					       this);
+	}
+}
+
+int Account::commit_timeout(gpointer ptr)
+{
+	Account *self = (Account *) ptr;
+
+	self->m_commit_timer = INVALID_GTK_WATCH;
+	try {
+		self->m_store->commit();
+		self->m_index->commit();
+	} catch (const store_error &e) {
+		debug("Unable to commit the cache: %s\n", e.what());
+	}
+
+	return FALSE;
+}
@@ -0,0 +1,195 @@
+/*
+ * An IMAP account, with its connections and local caches
+ */
+#ifndef _ACCOUNT_H
+#define _ACCOUNT_H
+
+#include "imap.h"
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+class Envelope_Store;
+class Body_Cache;
+class Part_Sink;
+class Search_Index;
+class Thread_Index;
+
+/*
+ * The first sync of a large mailbox can be split between several
+ * connections. The primary connection selects the mailbox, and the others
+ * fetch the envelopes of UID ranges handed out by the account, so the
+ * primary connection stays available for fetching the bodies the user
+ * wants to see. All of them write into the same store.
+ *
+ * One folder of the account is shown and synchronized at a time, and each
+ * folder has caches of its own. The other folders are only polled for
+ * their counters, which tell when they have changed since they were last
+ * synchronized.
+ */
+class Account {
+public:
+	Account(const std::string &server, const std::string &user,
+		const std::string &pw);
+	~Account();
+
+	std::string server() const { return m_server; }
+	Envelope_Store *store() const { return m_store; }
+	Body_Cache *body_cache() const { return m_body_cache; }
+	/* the conversations are only built when they are first needed */
+	const Thread_Index *threads();
+	Sync_State sync_state() const { return m_primary->sync_state(); }
+
+	/* the total number of connections to the server */
+	void set_connections(size_t count);
+	/* number of the most recent bodies to prefetch */
+	void set_prefetch(size_t count) { m_prefetch = count; }
+
+	void open_cache(const std::string &path);
+	void connect();
+
+	/* the folder that is shown */
+	std::string folder() const { return m_folder; }
+	/* the folders on the server, in the order they were listed */
+	std::vector<std::string> folders() const { return m_folder_names; }
+	/* whether the folder has changed since it was synchronized */
+	bool folder_changed(const std::string &name) const;
+	/* Switch to another folder, the connections are made again */
+	void open_folder(const std::string &name);
+
+	/* fetch the text of a message, the rest of the parts stay on the server */
+	void fetch_message(uint32_t uid);
+	/* fetch any part of a message, such as an attachment */
+	void fetch_part(uint32_t uid, const std::string &section);
+	/*
+	 * Show the text of a message from the cache, if it is there. Takes
+	 * the ownership of the sink.
+	 */
+	bool show_cached(uint32_t uid, Part_Sink *sink);
+	/* the UIDs of the cached messages that contain the words, in order */
+	std::vector<uint32_t> search(const std::string &query);
+	/*
+	 * Search the messages on the server as well, including those whose
+	 * bodies are not cached. The results are given to messages_found().
+	 */
+	bool search_server(const std::string &query);
+
+	/* called by the connections */
+	void add_message(const Envelope *env);
+	void update_flags(uint32_t uid, unsigned int flags);
+	void remove_message(uint32_t uid);
+	/* remove the messages that are not in the given list */
+	void keep_messages(const std::vector<uint32_t> &uids);
+	void clear_messages();
+	void save_sync_state(const Sync_State &state);
+	void sync_finished();
+	/* the contents of a part, in pieces */
+	void part_begin(uint32_t uid, const std::string &section);
+	void part_data(const char *data, size_t length);
+	void part_end(bool ok);
+	void search_done(const std::string &query,
+			 const std::vector<uint32_t> &uids);
+	void set_threads(const std::vector<Thread_Link> &links);
+	/* returns the folders to poll, the most active ones first */
+	std::vector<std::string> folders_listed(
+		const std::vector<std::string> &names);
+	void folder_status(const std::string &name,
+			   const Folder_Status &status);
+	/* the folder that is shown has been synchronized */
+	void folder_synced(const Folder_Status &status);
+
+	/* the parallel sync */
+	bool start_parallel_sync(uint32_t first, uint32_t last);
+	bool next_range(uint32_t *first, uint32_t *last);
+	void range_done(uint32_t first, uint32_t last);
+	void worker_failed(IMAP *conn, uint32_t first, uint32_t last);
+	void worker_finished(IMAP *conn);
+
+private:
+	typedef std::pair<uint32_t, uint32_t> Range;
+
+	struct Folder_Info {
+		/* the counters when it was synchronized the last time */
+		Folder_Status synced;
+		Folder_Status status;
+		bool changed;
+		/* the latest change that was seen, to poll it earlier */
+		unsigned int last_change;
+
+		Folder_Info() :
+			changed(false),
+			last_change(0)
+		{}
+	};
+
+	std::string m_server;
+	std::string m_user;
+	std::string m_pw;
+	size_t m_connections;
+	size_t m_prefetch;
+	/* the cache directory of the account */
+	std::string m_path;
+
+	std::string m_folder;
+	std::vector<std::string> m_folder_names;
+	std::map<std::string, Folder_Info> m_folders;
+	/* the number of changes seen in the folders */
+	unsigned int m_changes;
+
+	IMAP *m_primary;
+	std::vector<IMAP *> m_workers;
+	Envelope_Store *m_store;
+	/* commits the changes to the store that are waiting */
+	int m_commit_timer;
+	Body_Cache *m_body_cache;
+	Search_Index *m_index;
+	Thread_Index *m_threads;
+	/* whether the envelopes in the store have been threaded */
+	bool m_threads_loaded;
+	/* where the part that is being received goes */
+	std::vector<Part_Sink *> m_sinks;
+
+	/* UID ranges that have not been fetched yet */
+	std::list<Range> m_ranges;
+	size_t m_active_workers;
+	uint32_t m_parallel_last;
+	bool m_parallel_tried;
+
+	void parallel_sync_done();
+	std::string folder_path(const std::string &name) const;
+	void open_folder_cache();
+	void close_folder_cache();
+	void forget_messages(const std::vector<uint32_t> &uids);
+	void load_threads();
+	void load_folders();
+	void save_folders();
+	void schedule_commit();
+	static int commit_timeout(gpointer ptr);
+	Body_Part text_part(uint32_t uid);
+	Body_Part find_part(uint32_t uid, const std::string &section);
+
+	DISABLE_COPY_AND_ASSIGN(Account);
+};
+
+/* implemented by the user interface */
+void message_added(Account *account, uint32_t uid);
+void message_removed(Account *account, uint32_t uid);
+void messages_removed(Account *account, const std::vector<uint32_t> &uids);
+void messages_cleared(Account *account);
+/* the results of a search on the server */
+void messages_found(Account *account, const std::string &query,
+		    const std::vector<uint32_t> &uids);
+/* the conversations have been threaded again */
+void threads_changed(Account *account);
+/* the list of folders, or whether they have changed */
+void folders_changed(Account *account);
+/*
+ * These return where to put the text of a message or some other part as it
+ * arrives, or NULL if the user does not want to see it.
+ */
+Part_Sink *open_text(Account *account, uint32_t uid);
+Part_Sink *open_part(Account *account, uint32_t uid,
+		     const std::string &section);
+
+#endif
@@ -0,0 +1,423 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "imap_parser.h"
+#include "ioutils.h"
+#include "json.h"
+#include "encoding.h"
+#include "store.h"
+#include "utils.h"
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+
+/*
+ * Measures the hot paths that do not need a connection or a display: the
+ * IMAP parser, JSON, the character set conversions and the envelope store.
+ * The IMAP responses are replayed from recorded transcripts, or from a
+ * generated sync of a large mailbox if none are given.
+ */
+
+namespace {
+
+/* each measurement is repeated for at least this long, in seconds */
+const double MIN_TIME = 0.5;
+const unsigned int SYNTH_MESSAGES = 20000;
+/* every this many messages has its text in the transcript */
+const unsigned int SYNTH_BODY_EVERY = 20;
+
+double now()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void report(const char *name, double bytes, double items, const char *unit,
+	    double elapsed)
+{
+	printf("%-28s", name);
+	if (bytes > 0) {
+		printf(" %9.1f MB/s", bytes / elapsed / 1e6);
+	} else {
+		printf(" %14s", "");
+	}
+	if (items > 0) {
+		printf(" %11.0f %s/s", items / elapsed, unit);
+	}
+	printf("\n");
+}
+
+std::string read_file(const char *fname)
+{
+	std::ifstream f(fname, std::ios::binary);
+	if (!f) {
+		fprintf(stderr, "Can not open %s\n", fname);
+		exit(1);
+	}
+	std::ostringstream ss;
+	ss << f.rdbuf();
+	return ss.str();
+}
+
+/* What the server sends during the first sync of a mailbox */
+std::string synth_transcript(unsigned int count)
+{
+	std::string out = "* OK [CAPABILITY IMAP4rev1 IDLE] ready\r\n";
+	out += "* FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)\r\n";
+	out += strf("* %u EXISTS\r\n", count);
+	out += "* OK [UIDVALIDITY 1300000000] UIDs valid\r\n";
+	out += strf("* OK [UIDNEXT %u] Predicted next UID\r\n", count + 1);
+	out += "2 OK [READ-WRITE] SELECT completed\r\n";
+
+	std::string text;
+	while (text.size() < 2000) {
+		text += "Lorem ipsum dolor sit amet, consectetur adipiscing "
+			"elit, sed do eiusmod tempor.\r\n";
+	}
+	for (unsigned int i = 1; i <= count; ++i) {
+		out += strf("* %u FETCH (UID %u FLAGS (%s) "
+			    "INTERNALDATE \"17-Jul-2011 02:44:25 +0300\" "
+			    "RFC822.SIZE %u ENVELOPE "
+			    "(\"Sun, 17 Jul 2011 02:44:25 +0300\" "
+			    "\"Re: Message number %u\" "
+			    "((\"Sender %u\" NIL \"sender%u\" \"example.org\")) "
+			    "((\"Sender %u\" NIL \"sender%u\" \"example.org\")) "
+			    "((\"Sender %u\" NIL \"sender%u\" \"example.org\")) "
+			    "((NIL NIL \"list\" \"example.org\")) NIL NIL "
+			    "\"<%u@example.org>\" \"<%u@example.org>\") "
+			    "BODY ((\"text\" \"plain\" (\"charset\" \"utf-8\") "
+			    "NIL NIL \"quoted-printable\" %u 40)"
+			    "(\"application\" \"pdf\" (\"name\" \"a.pdf\") "
+			    "NIL NIL \"base64\" 81234) \"mixed\"))\r\n",
+			    i, i, i % 3 ? "\\Seen" : "", 3000 + i, i,
+			    i % 97, i % 97, i % 97, i % 97, i % 97, i % 97,
+			    i - 1, i, (unsigned int) text.size());
+		if (i % SYNTH_BODY_EVERY == 0) {
+			out += strf("* %u FETCH (UID %u BODY[1] {%u}\r\n", i, i,
+				    (unsigned int) text.size());
+			out += text + ")\r\n";
+		}
+	}
+	out += "3 OK FETCH completed\r\n";
+	return out;
+}
+
+struct Replay_Stats {
+	size_t responses;
+	size_t envelopes;
+	size_t bodies;
+	size_t errors;
+
+	Replay_Stats() :
+		responses(0),
+		envelopes(0),
+		bodies(0),
+		errors(0)
+	{}
+
+	bool operator ==(const Replay_Stats &other) const
+	{
+		return responses == other.responses &&
+		       envelopes == other.envelopes &&
+		       bodies == other.bodies && errors == other.errors;
+	}
+};
+
+/* Like the receive thread does it, a FETCH response is parsed fully */
+void parse_response(const char *data, size_t length, Replay_Stats *stats,
+		    std::vector<Envelope> *envelopes)
+{
+	stats->responses++;
+	IMAP_Tokenizer parser(data, length);
+	try {
+		if (!parser.skip('*') || !parser.check_digit()) {
+			return;
+		}
+		parser.number();
+		if (parser.atom() != "FETCH") {
+			return;
+		}
+		Fetch_Reply reply;
+		parse_fetch_reply(parser, &reply);
+		if (reply.items & Fetch_Reply::F_ENVELOPE) {
+			stats->envelopes++;
+			if (envelopes != NULL) {
+				envelopes->push_back(reply.env);
+			}
+		}
+		if (reply.items & Fetch_Reply::F_BODY) {
+			stats->bodies++;
+		}
+	} catch (const imap_parse_error &e) {
+		stats->errors++;
+	}
+}
+
+/*
+ * Feed the transcript into a receive buffer in pieces of the given size,
+ * or of random sizes if zero, and split it into responses as they become
+ * complete.
+ */
+Replay_Stats replay(const std::string &transcript, size_t chunk,
+		    std::vector<Envelope> *envelopes = NULL)
+{
+	Replay_Stats stats;
+	IO_Buffer buf;
+	Response_Assembler assembler;
+	size_t pos = 0;
+	while (pos < transcript.size()) {
+		size_t length = chunk ? chunk : 1 + rand() % 8192;
+		length = std::min(length, transcript.size() - pos);
+		buf.append(&transcript[pos], length);
+		pos += length;
+
+		size_t begin = 0;
+		while (1) {
+			size_t end = assembler.find_end(&buf.data()[begin],
+							buf.size() - begin);
+			if (end == std::string::npos) {
+				break;
+			}
+			assembler.reset();
+			parse_response(&buf.data()[begin], end, &stats,
+				       envelopes);
+			begin += end + 2;
+		}
+		buf.consume(begin);
+	}
+	return stats;
+}
+
+bool bench_imap(const std::vector<std::string> &transcripts)
+{
+	static const size_t chunks[] = {1, 61, 1500, 16384, 0};
+	static const char *names[] = {
+		"imap replay, 1 B reads", "imap replay, 61 B reads",
+		"imap replay, 1500 B reads", "imap replay, 16 KB reads",
+		"imap replay, random reads"
+	};
+	size_t total = 0;
+	std::vector<Replay_Stats> expected;
+	for (size_t i = 0; i < transcripts.size(); ++i) {
+		total += transcripts[i].size();
+		/* all at once, to compare the pieces to */
+		expected.push_back(replay(transcripts[i],
+					  transcripts[i].size()));
+	}
+
+	bool ok = true;
+	for (size_t c = 0; c < sizeof chunks / sizeof chunks[0]; ++c) {
+		srand(1);
+		size_t rounds = 0, envelopes = 0;
+		double start = now(), elapsed;
+		do {
+			for (size_t i = 0; i < transcripts.size(); ++i) {
+				Replay_Stats stats = replay(transcripts[i],
+							    chunks[c]);
+				if (!(stats == expected[i])) {
+					printf("transcript %u split differently"
+					       " with %s\n", (unsigned int) i,
+					       names[c]);
+					ok = false;
+				}
+				envelopes += stats.envelopes;
+			}
+			rounds++;
+			elapsed = now() - start;
+		} while (elapsed < MIN_TIME);
+		report(names[c], double(total) * rounds, envelopes,
+		       "envelopes", elapsed);
+	}
+	return ok;
+}
+
+JSON_Value synth_json(const std::vector<Envelope> &envelopes)
+{
+	JSON_Value doc(JSON_Value::ARRAY);
+	for (size_t i = 0; i < envelopes.size(); ++i) {
+		const Envelope &env = envelopes[i];
+		JSON_Value obj(JSON_Value::OBJECT);
+		obj.insert("uid", JSON_Value(long(env.uid)));
+		obj.insert("seen", JSON_Value(bool(env.flags & FLAG_SEEN)));
+		obj.insert("subject", JSON_Value(env.subject));
+		obj.insert("date", JSON_Value(env.date));
+		obj.insert("score", JSON_Value(env.uid * 0.25));
+		JSON_Value from(JSON_Value::ARRAY);
+		for (size_t j = 0; j < env.from.size(); ++j) {
+			from.push_back(JSON_Value(env.from[j].name + " <" +
+						  env.from[j].email + ">"));
+		}
+		obj.insert("from", from);
+		doc.push_back(obj);
+	}
+	return doc;
+}
+
+void bench_json(const std::vector<Envelope> &envelopes)
+{
+	JSON_Value doc = synth_json(envelopes);
+	std::string text;
+
+	size_t rounds = 0;
+	double start = now(), elapsed;
+	do {
+		text.clear();
+		doc.write(text, 0);
+		rounds++;
+		elapsed = now() - start;
+	} while (elapsed < MIN_TIME);
+	report("json write", double(text.size()) * rounds,
+	       double(envelopes.size()) * rounds, "objects", elapsed);
+
+	rounds = 0;
+	start = now();
+	do {
+		JSON_Value value;
+		value.load_all(text.data(), text.size());
+		rounds++;
+		elapsed = now() - start;
+	} while (elapsed < MIN_TIME);
+	report("json load", double(text.size()) * rounds,
+	       double(envelopes.size()) * rounds, "objects", elapsed);
+
+	rounds = 0;
+	start = now();
+	do {
+		JSON_Arena arena;
+		JSON_Value value;
+		value.load_all(text.data(), text.size(), &arena);
+		rounds++;
+		elapsed = now() - start;
+	} while (elapsed < MIN_TIME);
+	report("json load, arena", double(text.size()) * rounds,
+	       double(envelopes.size()) * rounds, "objects", elapsed);
+}
+
+void bench_encoding()
+{
+	static const char *encodings[] = {"UTF-8", "ISO-8859-1",
+					  "WINDOWS-1252"};
+	ustring text;
+	/* mostly ASCII, like the text of most mail */
+	while (text.size() < 256 * 1024) {
+		text += to_unicode("H\xc3\xa4m\xc3\xa4l\xc3\xa4inen ja "
+				   "k\xc3\xa4rp\xc3\xa4nen, plain text "
+				   "that is mostly ASCII.\n");
+	}
+	for (size_t e = 0; e < sizeof encodings / sizeof encodings[0]; ++e) {
+		std::string encoded;
+		size_t rounds = 0;
+		double start = now(), elapsed;
+		do {
+			encoded = encode(text, encodings[e]);
+			rounds++;
+			elapsed = now() - start;
+		} while (elapsed < MIN_TIME);
+		report(strf("encode %s", encodings[e]).c_str(),
+		       double(encoded.size()) * rounds, 0, "", elapsed);
+
+		rounds = 0;
+		start = now();
+		do {
+			ustring decoded = decode(encoded, encodings[e]);
+			rounds++;
+			elapsed = now() - start;
+		} while (elapsed < MIN_TIME);
+		report(strf("decode %s", encodings[e]).c_str(),
+		       double(encoded.size()) * rounds, 0, "", elapsed);
+	}
+}
+
+void remove_dir(const std::string &path)
+{
+	DIR *dir = opendir(path.c_str());
+	if (dir == NULL) {
+		return;
+	}
+	while (struct dirent *ent = readdir(dir)) {
+		std::string name = ent->d_name;
+		if (name != "." && name != "..") {
+			unlink((path + "/" + name).c_str());
+		}
+	}
+	closedir(dir);
+	rmdir(path.c_str());
+}
+
+void bench_store(const std::vector<Envelope> &envelopes)
+{
+	char tmpl[] = "/tmp/jamail-bench-XXXXXX";
+	if (mkdtemp(tmpl) == NULL) {
+		printf("Can not create a temporary directory\n");
+		return;
+	}
+	std::string dir = tmpl;
+	std::string path = dir + "/envelopes";
+
+	double start = now();
+	{
+		Envelope_Store store(path);
+		store.open();
+		for (size_t i = 0; i < envelopes.size(); ++i) {
+			store.add(&envelopes[i]);
+		}
+		store.commit();
+	}
+	report("store write", 0, envelopes.size(), "envelopes",
+	       now() - start);
+
+	size_t rounds = 0, count = 0;
+	double elapsed;
+	start = now();
+	do {
+		Envelope_Store store(path);
+		store.open();
+		Envelope env;
+		for (size_t i = 0; i < store.size(); ++i) {
+			store.get_at(i, &env);
+		}
+		count += store.size();
+		rounds++;
+		elapsed = now() - start;
+	} while (elapsed < MIN_TIME);
+	report("store load", 0, count, "envelopes", elapsed);
+
+	remove_dir(dir);
+}
+
+}
+
+bool debug_enabled = false;
+
+int main(int argc, char **argv)
+{
+	std::vector<std::string> transcripts;
+	for (int i = 1; i < argc; ++i) {
+		transcripts.push_back(read_file(argv[i]));
+	}
+	if (transcripts.empty()) {
+		transcripts.push_back(synth_transcript(SYNTH_MESSAGES));
+	}
+
+	std::vector<Envelope> envelopes;
+	for (size_t i = 0; i < transcripts.size(); ++i) {
+		replay(transcripts[i], transcripts[i].size(), &envelopes);
+	}
+	printf("%u envelopes in %u transcripts\n",
+	       (unsigned int) envelopes.size(),
+	       (unsigned int) transcripts.size());
+
+	bool ok = bench_imap(transcripts);
+	bench_json(envelopes);
+	bench_encoding();
+	bench_store(envelopes);
+	return ok ? 0 : 1;
+}
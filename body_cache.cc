@@ -0,0 +1,192 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "body_cache.h"
+#include "part_sink.h"
+#include "utils.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+void remove_dir(const std::string &path)
+{
+	DIR *dir = opendir(path.c_str());
+	if (dir == NULL)
+		return;
+	while (1) {
+		dirent *de = readdir(dir);
+		if (de == NULL)
+			break;
+		std::string name = de->d_name;
+		if (name != "." && name != "..") {
+			unlink((path + '/' + name).c_str());
+		}
+	}
+	closedir(dir);
+	rmdir(path.c_str());
+}
+
+}
+
+/* a partially written file is never seen under the real name */
+class Body_Cache::Writer: public Part_Sink {
+public:
+	Writer(const std::string &fname) :
+		m_fname(fname),
+		m_tmp(fname + ".tmp"),
+		m_failed(false)
+	{
+		m_file = fopen(m_tmp.c_str(), "wb");
+		if (m_file == NULL) {
+			throw store_error(strf("Can not create %s: %s",
+					       m_tmp.c_str(), strerror(errno)));
+		}
+	}
+
+	~Writer()
+	{
+		if (m_file != NULL) {
+			fclose(m_file);
+			unlink(m_tmp.c_str());
+		}
+	}
+
+	void write(const char *data, size_t length)
+	{
+		if (fwrite(data, 1, length, m_file) != length) {
+			m_failed = true;
+		}
+	}
+
+	void finish()
+	{
+		int ret = fclose(m_file);
+		m_file = NULL;
+		if (ret != 0 || m_failed) {
+			unlink(m_tmp.c_str());
+			throw store_error("Unable to write " + m_tmp);
+		}
+		if (rename(m_tmp.c_str(), m_fname.c_str()) < 0) {
+			unlink(m_tmp.c_str());
+			throw store_error(strf("Can not rename %s: %s",
+					       m_tmp.c_str(), strerror(errno)));
+		}
+	}
+
+private:
+	std::string m_fname;
+	std::string m_tmp;
+	FILE *m_file;
+	bool m_failed;
+
+	DISABLE_COPY_AND_ASSIGN(Writer);
+};
+
+Body_Cache::Body_Cache(const std::string &path) :
+	m_path(path),
+	m_uidvalidity(0)
+{
+	mkdir(m_path.c_str(), 0700);
+}
+
+void Body_Cache::set_uidvalidity(uint32_t uidvalidity)
+{
+	if (uidvalidity == m_uidvalidity) {
+		return;
+	}
+	m_uidvalidity = uidvalidity;
+
+	/* remove the bodies of any other UIDVALIDITY */
+	DIR *dir = opendir(m_path.c_str());
+	if (dir != NULL) {
+		while (1) {
+			dirent *de = readdir(dir);
+			if (de == NULL)
+				break;
+			std::string name = de->d_name;
+			if (isdigit(name[0]) &&
+			    m_path + '/' + name != dir_name(uidvalidity)) {
+				remove_dir(m_path + '/' + name);
+			}
+		}
+		closedir(dir);
+	}
+	if (m_uidvalidity != 0) {
+		mkdir(dir_name(m_uidvalidity).c_str(), 0700);
+	}
+}
+
+bool Body_Cache::has(uint32_t uid) const
+{
+	if (m_uidvalidity == 0) {
+		return false;
+	}
+	return access(file_name(uid).c_str(), F_OK) == 0;
+}
+
+bool Body_Cache::get(uint32_t uid, std::string *body) const
+{
+	if (m_uidvalidity == 0) {
+		return false;
+	}
+	FILE *f = fopen(file_name(uid).c_str(), "rb");
+	if (f == NULL) {
+		return false;
+	}
+	body->clear();
+	char buf[4096];
+	while (1) {
+		size_t got = fread(buf, 1, sizeof buf, f);
+		if (got == 0)
+			break;
+		body->append(buf, got);
+	}
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+void Body_Cache::put(uint32_t uid, const std::string &body)
+{
+	if (m_uidvalidity == 0) {
+		return;
+	}
+	Writer writer(file_name(uid));
+	writer.write(body.data(), body.size());
+	writer.finish();
+}
+
+Part_Sink *Body_Cache::writer(uint32_t uid)
+{
+	if (m_uidvalidity == 0) {
+		return NULL;
+	}
+	return new Writer(file_name(uid));
+}
+
+void Body_Cache::clear()
+{
+	if (m_uidvalidity != 0) {
+		remove_dir(dir_name(m_uidvalidity));
+		mkdir(dir_name(m_uidvalidity).c_str(), 0700);
+	}
+}
+
+std::string Body_Cache::dir_name(uint32_t uidvalidity) const
+{
+	return m_path + strf("/%u", uidvalidity);
+}
+
+std::string Body_Cache::file_name(uint32_t uid) const
+{
+	return dir_name(m_uidvalidity) + strf("/%u", uid);
+}
@@ -0,0 +1,47 @@
+/*
+ * Local cache of message bodies
+ */
+#ifndef _BODY_CACHE_H
+#define _BODY_CACHE_H
+
+#include "store.h"
+#include <string>
+
+class Part_Sink;
+
+/*
+ * The bodies of one account are kept as files named by their UID, inside a
+ * directory named by the UIDVALIDITY of the mailbox. When the UIDVALIDITY
+ * changes, the UIDs no longer refer to the same messages and the old
+ * directory is removed.
+ */
+class Body_Cache {
+public:
+	Body_Cache(const std::string &path);
+
+	uint32_t uidvalidity() const { return m_uidvalidity; }
+	void set_uidvalidity(uint32_t uidvalidity);
+
+	bool has(uint32_t uid) const;
+	bool get(uint32_t uid, std::string *body) const;
+	void put(uint32_t uid, const std::string &body);
+	/*
+	 * Write a body as it arrives. It appears in the cache when the sink
+	 * is finished. Returns NULL if there is no mailbox to cache for.
+	 */
+	Part_Sink *writer(uint32_t uid);
+	void clear();
+
+private:
+	class Writer;
+
+	std::string m_path;
+	uint32_t m_uidvalidity;
+
+	std::string dir_name(uint32_t uidvalidity) const;
+	std::string file_name(uint32_t uid) const;
+
+	DISABLE_COPY_AND_ASSIGN(Body_Cache);
+};
+
+#endif
@@ -7,60 +7,300 @@
  *
  */
 #include "encoding.h"
+#include "utils.h"
 #include <stdio.h>
 #include <assert.h>
 #include <iconv.h>
 #include <sstream>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
+#include <endian.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-std::string encode(const ustring &in, const char *enc)
+namespace {
+
+/*
+ * iconv likes to write an UTF-32 BOM to the beginning of the output
+ * if the used byte order is not specified.
+ */
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+const char UNICODE_ENC[] = "UTF-32LE";
+#else
+const char UNICODE_ENC[] = "UTF-32BE";
+#endif
+
+typedef std::pair<std::string, std::string> Conv_Key;
+
+std::multimap<Conv_Key, iconv_t> iconv_pool;
+
+/*
+ * Check whether ASCII text is the same in the given encoding, so that the
+ * conversion of pure ASCII text can be skipped. Note that this is not true
+ * for every encoding that contains ASCII, such as ISO-2022-JP.
+ */
+bool ascii_compatible(const char *enc)
 {
-	std::ostringstream sink;
+	const char *prefixes[] = {
+		"UTF-8", "UTF8", "US-ASCII", "ASCII", "ISO-8859-", "ISO8859-",
+		"LATIN", "WINDOWS-125", "CP125", "KOI8-", NULL
+	};
+	for (int i = 0; prefixes[i]; ++i) {
+		if (strncasecmp(enc, prefixes[i], strlen(prefixes[i])) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* the values of the base64 chars, -1 for the others */
+struct Base64_Table {
+	signed char value[256];
+
+	Base64_Table()
 	{
-		enc_streambuf sb(sink, enc);
-		std::basic_ostream<uint32_t> os(&sb);
-		os << in;
+		const char chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+			"abcdefghijklmnopqrstuvwxyz0123456789+/";
+		memset(value, -1, sizeof value);
+		for (int i = 0; i < 64; ++i) {
+			value[(unsigned char) chars[i]] = i;
+		}
+	}
+};
+
+const Base64_Table base64_table;
+
+int hex_value(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
 	}
-	return sink.str();
+	return -1;
+}
+
+#ifdef __SSE2__
+/* a mask of the bytes that are within [lo, hi] */
+inline __m128i in_range(__m128i v, char lo, char hi)
+{
+	return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+			     _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+#endif
+
+/*
+ * Decode whole blocks of 16 base64 chars into 12 bytes each, until a char
+ * that is not in the alphabet (such as a line break or padding). Returns
+ * the number of chars decoded.
+ */
+size_t decode_base64_blocks(const char *in, size_t length, std::string &out)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	for (; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) &in[i]);
+
+		/* map the chars to their values, range by range */
+		__m128i upper = in_range(v, 'A', 'Z');
+		__m128i lower = in_range(v, 'a', 'z');
+		__m128i digit = in_range(v, '0', '9');
+		__m128i plus = _mm_cmpeq_epi8(v, _mm_set1_epi8('+'));
+		__m128i slash = _mm_cmpeq_epi8(v, _mm_set1_epi8('/'));
+		__m128i valid = _mm_or_si128(_mm_or_si128(upper, lower),
+				_mm_or_si128(digit, _mm_or_si128(plus, slash)));
+		if (_mm_movemask_epi8(valid) != 0xffff) {
+			break;
+		}
+		__m128i value = _mm_or_si128(
+			_mm_or_si128(
+				_mm_and_si128(upper,
+					_mm_sub_epi8(v, _mm_set1_epi8('A'))),
+				_mm_and_si128(lower,
+					_mm_sub_epi8(v, _mm_set1_epi8('a' - 26)))),
+			_mm_or_si128(
+				_mm_and_si128(digit,
+					_mm_add_epi8(v, _mm_set1_epi8(52 - '0'))),
+				_mm_or_si128(
+					_mm_and_si128(plus, _mm_set1_epi8(62)),
+					_mm_and_si128(slash, _mm_set1_epi8(63)))));
+
+		/* pairs of 6 bits to 12 bits, and pairs of those to 24 bits */
+		__m128i pairs = _mm_or_si128(
+			_mm_slli_epi16(_mm_and_si128(value,
+					_mm_set1_epi16(0xff)), 6),
+			_mm_srli_epi16(value, 8));
+		__m128i quads = _mm_madd_epi16(pairs,
+					       _mm_set1_epi32(0x00011000));
+		uint32_t words[4];
+		_mm_storeu_si128((__m128i *) words, quads);
+
+		char bytes[12];
+		for (int j = 0; j < 4; ++j) {
+			bytes[j * 3] = words[j] >> 16;
+			bytes[j * 3 + 1] = words[j] >> 8;
+			bytes[j * 3 + 2] = words[j];
+		}
+		out.append(bytes, sizeof bytes);
+	}
+#else
+	UNUSED(in);
+	UNUSED(length);
+	UNUSED(out);
+#endif
+	return i;
+}
+
+}
+
+iconv_t acquire_iconv(const std::string &to, const std::string &from)
+{
+	std::multimap<Conv_Key, iconv_t>::iterator i =
+		iconv_pool.find(Conv_Key(to, from));
+	if (i != iconv_pool.end()) {
+		iconv_t conv = i->second;
+		iconv_pool.erase(i);
+		/* back to the initial shift state */
+		iconv(conv, NULL, NULL, NULL, NULL);
+		return conv;
+	}
+	iconv_t conv = iconv_open(to.c_str(), from.c_str());
+	if (conv == iconv_t(-1)) {
+		throw conv_error("Unable to initialize iconv for " + from +
+				 " to " + to);
+	}
+	return conv;
+}
+
+void release_iconv(const std::string &to, const std::string &from,
+		   iconv_t conv)
+{
+	iconv_pool.insert(std::make_pair(Conv_Key(to, from), conv));
+}
+
+std::string encode(const ustring &in, const char *enc)
+{
+	std::string out;
+	if (ascii_compatible(enc) && to_ascii(in, &out)) {
+		return out;
+	}
+
+	iconv_t conv = acquire_iconv(enc, UNICODE_ENC);
+
+	/* iconv will advance the input and output pointers for us */
+	out.assign(in.size() + 16, 0);
+	char *in_ptr = (char *) in.data();
+	size_t in_left = in.size() * sizeof(uint32_t);
+	size_t pos = 0;
+	while (1) {
+		char *out_ptr = &out[pos];
+		size_t out_left = out.size() - pos;
+		size_t ret = iconv(conv, &in_ptr, &in_left, &out_ptr, &out_left);
+		pos = out.size() - out_left;
+		if (ret != size_t(-1)) {
+			/* write the final shift sequence, if any */
+			out_left = out.size() - pos;
+			ret = iconv(conv, NULL, NULL, &out_ptr, &out_left);
+			if (ret != size_t(-1)) {
+				pos = out.size() - out_left;
+				break;
+			}
+		}
+		if (errno != E2BIG) {
+			release_iconv(enc, UNICODE_ENC, conv);
+			if (errno == EILSEQ) {
+				throw conv_error("Invalid char sequence");
+			}
+			throw conv_error("Conversion failed");
+		}
+		out.resize(out.size() * 2);
+	}
+	release_iconv(enc, UNICODE_ENC, conv);
+	out.resize(pos);
+	return out;
 }
 
 ustring decode(const std::string &in, const char *enc)
 {
-	std::istringstream source(in);
-	dec_streambuf sb(source, enc);
-	std::basic_istream<uint32_t> is(&sb);
+	if (ascii_compatible(enc) &&
+	    ascii_prefix(in.data(), in.size()) == in.size()) {
+		return to_unicode(in);
+	}
+
+	iconv_t conv = acquire_iconv(UNICODE_ENC, enc);
 
-	ustring out;
+	ustring out(in.size(), 0);
+	char *in_ptr = (char *) in.data();
+	size_t in_left = in.size();
+	size_t pos = 0;
 	while (1) {
-		size_t pos = out.size();
-		out.resize(pos + 256, 0);
-		if (!is.read(&out[pos], 256)) {
-			out.resize(pos + is.gcount());
+		char *out_ptr = (char *) &out[pos];
+		size_t out_left = (out.size() - pos) * sizeof(uint32_t);
+		size_t ret = iconv(conv, &in_ptr, &in_left, &out_ptr, &out_left);
+		pos = out.size() - out_left / sizeof(uint32_t);
+		if (ret != size_t(-1)) {
 			break;
 		}
+		if (errno != E2BIG) {
+			release_iconv(UNICODE_ENC, enc, conv);
+			if (errno == EILSEQ) {
+				throw conv_error("Invalid char sequence");
+			} else if (errno == EINVAL) {
+				throw conv_error("Incomplete char sequence");
+			}
+			throw conv_error("Conversion failed");
+		}
+		out.resize(out.size() * 2 + 16);
 	}
+	release_iconv(UNICODE_ENC, enc, conv);
+	out.resize(pos);
 	return out;
 }
 
 enc_streambuf::enc_streambuf(std::ostream &sink, const std::string &enc) :
 	m_sink(sink), m_enc(enc)
 {
+	m_conv = acquire_iconv(m_enc, UNICODE_ENC);
 	setp(m_buf, &m_buf[sizeof m_buf / sizeof(uint32_t)]);
 }
 
 enc_streambuf::~enc_streambuf()
 {
-	overflow();
+	if (flush()) {
+		/* return to the initial shift state at the end */
+		char writebuf[16];
+		char *out_ptr = writebuf;
+		size_t out_left = sizeof writebuf;
+		if (iconv(m_conv, NULL, NULL, &out_ptr, &out_left) != size_t(-1)) {
+			m_sink.write(writebuf, sizeof writebuf - out_left);
+		}
+	}
+	release_iconv(m_enc, UNICODE_ENC, m_conv);
 }
 
 enc_streambuf::int_type enc_streambuf::overflow(int_type c)
 {
-	iconv_t conv = iconv_open(m_enc.c_str(), "UTF-32");
-	if (conv == iconv_t(-1)) {
-		throw conv_error("Unable to initialize iconv");
+	if (!flush()) {
+		return traits_type::eof();
+	}
+	if (!traits_type::eq_int_type(c, traits_type::eof())) {
+		*pptr() = c;
+		pbump(1);
 	}
+	return traits_type::not_eof(c);
+}
+
+int enc_streambuf::sync()
+{
+	return flush() ? 0 : -1;
+}
 
+bool enc_streambuf::flush()
+{
 	char writebuf[1024];
 
 	/* iconv will advance the input pointer for us */
@@ -71,7 +311,7 @@ enc_streambuf::int_type enc_streambuf::overflow(int_type c)
 		size_t out_left = sizeof writebuf;
 
 		size_t ret =
-			iconv(conv, &in_ptr, &in_left, &out_ptr, &out_left);
+			iconv(m_conv, &in_ptr, &in_left, &out_ptr, &out_left);
 		if (ret == size_t(-1)) {
 			if (errno == EILSEQ) {
 				throw conv_error("Invalid char sequence");
@@ -80,19 +320,22 @@ enc_streambuf::int_type enc_streambuf::overflow(int_type c)
 			}
 		}
 		if (!m_sink.write(writebuf, sizeof writebuf - out_left)) {
-			iconv_close(conv);
-			return traits_type::eof();
+			return false;
 		}
 	}
-	iconv_close(conv);
-	m_buf[0] = c;
-	setp(&m_buf[1], &m_buf[sizeof m_buf / sizeof(uint32_t)]);
-	return 0;
+	setp(m_buf, &m_buf[sizeof m_buf / sizeof(uint32_t)]);
+	return true;
 }
 
 dec_streambuf::dec_streambuf(std::istream &source, const std::string &enc) :
 	m_source(source), m_enc(enc), m_input(NULL), m_left(0)
 {
+	m_conv = acquire_iconv(UNICODE_ENC, m_enc);
+}
+
+dec_streambuf::~dec_streambuf()
+{
+	release_iconv(UNICODE_ENC, m_enc, m_conv);
 }
 
 dec_streambuf::int_type dec_streambuf::underflow()
@@ -102,35 +345,31 @@ dec_streambuf::int_type dec_streambuf::underflow()
 		return traits_type::eof();
 	}
 
-	/*
-	 * iconv likes to write an UTF-32 BOM to the beginning of the output
-	 * if the used byte order is not specified.
-	 */
-#if (BYTE_ORDER == LITTLE_ENDIAN)
-	iconv_t conv = iconv_open("UTF-32LE", m_enc.c_str());
-#else
-	iconv_t conv = iconv_open("UTF-32BE", m_enc.c_str());
-#endif
-	if (conv == iconv_t(-1)) {
-		throw conv_error("Unable to initialize iconv");
-	}
-
 	/* iconv will advance the input and output pointers for us */
 	char *out_ptr = (char *) m_buf;
 	size_t out_left = sizeof m_buf;
 	while (out_left > 0 && m_left > 0) {
 		size_t ret =
-			iconv(conv, &m_input, &m_left, &out_ptr, &out_left);
+			iconv(m_conv, &m_input, &m_left, &out_ptr, &out_left);
+		size_t left = m_left;
+		fillbuf();
 		if (ret == size_t(-1)) {
 			if (errno == EILSEQ) {
 				throw conv_error("Invalid char sequence");
+			} else if (errno == EINVAL) {
+				/*
+				 * The input ends in the middle of a multibyte
+				 * sequence. The rest of it may still come with
+				 * the next read.
+				 */
+				if (m_left == left) {
+					throw conv_error("Incomplete char sequence");
+				}
 			} else if (errno != E2BIG) {
 				throw conv_error("Conversion failed");
 			}
 		}
-		fillbuf();
 	}
-	iconv_close(conv);
 	setg(m_buf, m_buf, (uint32_t *) out_ptr);
 	return m_buf[0];
 }
@@ -143,3 +382,188 @@ void dec_streambuf::fillbuf()
 	m_source.read(&m_readbuf[m_left], sizeof m_readbuf - m_left);
 	m_left += m_source.gcount();
 }
+
+Transfer_Decoder *Transfer_Decoder::create(const std::string &encoding)
+{
+	if (strcasecmp(encoding.c_str(), "quoted-printable") == 0) {
+		return new QP_Decoder;
+	} else if (strcasecmp(encoding.c_str(), "base64") == 0) {
+		return new Base64_Decoder;
+	}
+	return NULL;
+}
+
+void QP_Decoder::decode(const char *data, size_t length, std::string &out)
+{
+	const char *end = data + length;
+	while (data < end) {
+		if (m_pending.empty()) {
+			/* copy everything up to the next escape */
+			const char *eq = (const char *) memchr(data, '=',
+							       end - data);
+			if (eq == NULL) {
+				out.append(data, end);
+				return;
+			}
+			out.append(data, eq);
+			data = eq;
+		}
+		m_pending += *data++;
+		if (m_pending.size() < 3 &&
+		    !(m_pending.size() == 2 && m_pending[1] == '\n')) {
+			continue;
+		}
+
+		int high = hex_value(m_pending[1]);
+		int low = m_pending.size() > 2 ? hex_value(m_pending[2]) : -1;
+		if (high >= 0 && low >= 0) {
+			out += char(high * 16 + low);
+		} else if (m_pending[1] == '\n' ||
+			   (m_pending[1] == '\r' && m_pending[2] == '\n')) {
+			/* a soft line break */
+		} else {
+			/* not an escape after all */
+			out += m_pending;
+		}
+		m_pending.clear();
+	}
+}
+
+void QP_Decoder::finish(std::string &out)
+{
+	/* "=" at the very end is a soft line break without the line break */
+	if (m_pending.size() > 1) {
+		out += m_pending;
+	}
+	m_pending.clear();
+}
+
+Base64_Decoder::Base64_Decoder() :
+	m_bits(0),
+	m_count(0)
+{
+}
+
+void Base64_Decoder::decode(const char *data, size_t length, std::string &out)
+{
+	size_t i = 0;
+	while (i < length) {
+		if (m_count == 0) {
+			i += decode_base64_blocks(&data[i], length - i, out);
+			if (i == length) {
+				break;
+			}
+		}
+		char c = data[i++];
+		int value = base64_table.value[(unsigned char) c];
+		if (value < 0) {
+			/* the line breaks are skipped, padding ends a group */
+			if (c == '=') {
+				flush(out);
+			}
+			continue;
+		}
+		m_bits = (m_bits << 6) | value;
+		m_count++;
+		if (m_count == 4) {
+			char bytes[3] = {char(m_bits >> 16), char(m_bits >> 8),
+					 char(m_bits)};
+			out.append(bytes, sizeof bytes);
+			m_bits = 0;
+			m_count = 0;
+		}
+	}
+}
+
+void Base64_Decoder::finish(std::string &out)
+{
+	flush(out);
+}
+
+/* the bytes of an incomplete group */
+void Base64_Decoder::flush(std::string &out)
+{
+	if (m_count >= 2) {
+		uint32_t bits = m_bits << (6 * (4 - m_count));
+		out += char(bits >> 16);
+		if (m_count == 3) {
+			out += char(bits >> 8);
+		}
+	}
+	m_bits = 0;
+	m_count = 0;
+}
+
+Charset_Decoder::Charset_Decoder(const std::string &charset) :
+	m_charset(charset.empty() ? "UTF-8" : charset)
+{
+	try {
+		m_conv = acquire_iconv("UTF-8", m_charset);
+	} catch (const conv_error &) {
+		m_charset = "UTF-8";
+		m_conv = acquire_iconv("UTF-8", m_charset);
+	}
+}
+
+Charset_Decoder::~Charset_Decoder()
+{
+	release_iconv("UTF-8", m_charset, m_conv);
+}
+
+void Charset_Decoder::decode(const char *data, size_t length, std::string &out)
+{
+	if (!m_pending.empty()) {
+		m_pending.append(data, length);
+		std::string input;
+		input.swap(m_pending);
+		convert(input.data(), input.size(), out);
+		return;
+	}
+	/* most text is ASCII, which is the same in UTF-8 */
+	if (ascii_compatible(m_charset.c_str())) {
+		size_t ascii = ascii_prefix(data, length);
+		out.append(data, ascii);
+		data += ascii;
+		length -= ascii;
+	}
+	convert(data, length, out);
+}
+
+void Charset_Decoder::finish(std::string &out)
+{
+	/* a truncated char */
+	if (!m_pending.empty()) {
+		out += '?';
+		m_pending.clear();
+	}
+}
+
+void Charset_Decoder::convert(const char *data, size_t length, std::string &out)
+{
+	/* iconv will advance the input and output pointers for us */
+	char *in_ptr = (char *) data;
+	size_t in_left = length;
+	while (in_left > 0) {
+		size_t pos = out.size();
+		out.resize(pos + in_left * 2 + 16);
+		char *out_ptr = &out[pos];
+		size_t out_left = out.size() - pos;
+		size_t ret = iconv(m_conv, &in_ptr, &in_left, &out_ptr, &out_left);
+		out.resize(out.size() - out_left);
+		if (ret != size_t(-1)) {
+			break;
+		}
+		if (errno == EILSEQ) {
+			out += '?';
+			in_ptr++;
+			in_left--;
+		} else if (errno == EINVAL) {
+			/* the rest may come with the next piece */
+			m_pending.assign(in_ptr, in_left);
+			break;
+		} else if (errno != E2BIG) {
+			out += '?';
+			break;
+		}
+	}
+}
@@ -4,8 +4,11 @@
 #include <stdexcept>
 #include <stdint.h>
 #include <streambuf>
+#include <string>
 #include <istream>
 #include <ostream>
+#include <map>
+#include <iconv.h>
 
 /* An unicode string (UTF-32) */
 typedef std::basic_string<uint32_t> ustring;
@@ -20,13 +23,90 @@ public:
 std::string encode(const ustring &in, const char *enc);
 ustring decode(const std::string &in, const char *enc);
 
+/*
+ * A process-wide pool of iconv descriptors, keyed by the (to, from)
+ * encodings. Setting up a conversion is expensive, so the descriptors are
+ * reused. A descriptor is owned by the caller until it is released back
+ * to the pool, and its conversion state is reset when it is acquired.
+ */
+iconv_t acquire_iconv(const std::string &to, const std::string &from);
+void release_iconv(const std::string &to, const std::string &from,
+		   iconv_t conv);
+
+/*
+ * Streaming decoders of the content transfer encodings. The input may be
+ * split at any point, and the decoded data is appended to the output, so
+ * a large body is decoded in one pass without keeping all of it.
+ */
+class Transfer_Decoder {
+public:
+	virtual ~Transfer_Decoder() {}
+
+	virtual void decode(const char *data, size_t length,
+			    std::string &out) = 0;
+	/* the end of the input */
+	virtual void finish(std::string &out) = 0;
+
+	/* Returns NULL if the encoding (such as "7bit") needs no decoding */
+	static Transfer_Decoder *create(const std::string &encoding);
+};
+
+class QP_Decoder: public Transfer_Decoder {
+public:
+	void decode(const char *data, size_t length, std::string &out);
+	void finish(std::string &out);
+
+private:
+	/* an escape that has been cut between the pieces */
+	std::string m_pending;
+};
+
+class Base64_Decoder: public Transfer_Decoder {
+public:
+	Base64_Decoder();
+
+	void decode(const char *data, size_t length, std::string &out);
+	void finish(std::string &out);
+
+private:
+	/* the bits of an incomplete group of four chars */
+	uint32_t m_bits;
+	int m_count;
+
+	void flush(std::string &out);
+};
+
+/*
+ * Converts text in the given charset to UTF-8 in pieces. Invalid chars are
+ * replaced with '?', and an unknown charset is taken to be UTF-8.
+ */
+class Charset_Decoder {
+public:
+	Charset_Decoder(const std::string &charset);
+	~Charset_Decoder();
+
+	void decode(const char *data, size_t length, std::string &out);
+	void finish(std::string &out);
+
+private:
+	std::string m_charset;
+	iconv_t m_conv;
+	/* a char that has been cut between the pieces */
+	std::string m_pending;
+
+	void convert(const char *data, size_t length, std::string &out);
+};
+
 class dec_streambuf: public std::basic_streambuf<uint32_t> {
 public:
 	dec_streambuf(std::istream &source, const std::string &enc);
+	~dec_streambuf();
 
 private:
 	std::istream &m_source;
 	std::string m_enc;
+	/* kept for the whole lifetime to preserve the conversion state */
+	iconv_t m_conv;
 	char m_readbuf[4096];
 	char *m_input;
 	size_t m_left;
@@ -44,9 +124,12 @@ public:
 private:
 	std::ostream &m_sink;
 	std::string m_enc;
+	iconv_t m_conv;
 	uint32_t m_buf[1024];
 
 	int_type overflow(int_type c = traits_type::eof());
+	int sync();
+	bool flush();
 };
 
 #endif
@@ -6,619 +6,1267 @@
  * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
  */
 #include "imap.h"
+#include "account.h"
 #include "ioutils.h"
+#include "net_thread.h"
+#include "stats.h"
+#include "tls.h"
 #include "utils.h"
+#include <algorithm>
+#include <gio/gio.h>
 #include <netinet/in.h>
-#include <netdb.h>
+#include <ctype.h>
 #include <errno.h>
 
 namespace {
 
 const int PORT = 993;
 const int INVALID_GTK_WATCH = -1;
-
-/* check whether the next token is the given one */
-bool check(std::istream &is, char token)
+/* number of parts to prefetch at a time */
+const size_t PREFETCH_BATCH = 5;
+/*
+ * IDLE is restarted this often, so that NATs and firewalls do not drop the
+ * connection (servers allow up to 29 minutes). Without IDLE, the mailbox is
+ * polled with NOOP.
+ */
+const unsigned int IDLE_INTERVAL = 9 * 60;
+const unsigned int POLL_INTERVAL = 2 * 60;
+/* batches of events to process at a time, before letting the UI run */
+const size_t MAX_BATCHES = 4;
+/* milliseconds to wait for a connection attempt before starting the next */
+const unsigned int ATTEMPT_DELAY = 250;
+/* a first sync smaller than this is not split between connections */
+const uint32_t PARALLEL_SYNC_MIN = 2000;
+/* seconds between polling the status of the other folders */
+const unsigned int STATUS_INTERVAL = 5 * 60;
+
+/* a mailbox name as a quoted string */
+std::string quote(const std::string &s)
 {
-	/* skip leading space */
-	char c = is.peek();
-	while (!is.eof() && isspace(c)) {
-		is.get();
-		c = is.peek();
+	std::string out = "\"";
+	for (size_t i = 0; i < s.size(); ++i) {
+		if (s[i] == '"' || s[i] == '\\') {
+			out += '\\';
+		}
+		out += s[i];
 	}
-	return (!is.eof() && c == token);
+	out += '"';
+	return out;
 }
 
-bool skip(std::istream &is, char token)
+/* an atom or a string */
+std::string astring(IMAP_Tokenizer &parser)
 {
-	if (check(is, token)) {
-		is.get();
-		return true;
+	if (parser.check('"') || parser.check('{')) {
+		return parser.string().str();
 	}
-	return false;
+	return parser.atom().str();
+}
+
+}
+
+IMAP::IMAP(Account *account, const std::string &server,
+	   const std::string &user, const std::string &pw, bool worker) :
+	m_state(S_IDLE),
+	m_account(account),
+	m_worker(worker),
+	m_server(server),
+	m_user(user),
+	m_pw(pw),
+	m_lookup(NULL),
+	m_attempt_timer(INVALID_GTK_WATCH),
+	m_phase_begin(0),
+	m_net(NULL),
+	m_streaming(false),
+	m_stream_known(false),
+	m_logged_in(false),
+	m_next_cmd_id(1),
+	m_folder("INBOX"),
+	m_status_timer(INVALID_GTK_WATCH),
+	m_uidnext(0),
+	m_exists(0),
+	m_known_uid(0),
+	m_prefetching(0),
+	m_range_first(0),
+	m_range_last(0),
+	m_idle(IDLE_OFF),
+	m_idle_timer(INVALID_GTK_WATCH),
+	m_fetching_new(false),
+	m_exists_changed(false)
+{
 }
 
-void expect(std::istream &is, char token)
+IMAP::~IMAP()
 {
-	/* skips leading space */
-	char c;
-	is >> c;
-	if (is.eof() || c != token) {
-		throw imap_parse_error(strf("Expected token %c", token));
-	}
+	disconnect();
 }
 
-bool is_atom(int c)
+/* an address lookup in progress, it may outlive the connection */
+struct IMAP::Lookup {
+	IMAP *conn;
+	GCancellable *cancellable;
+};
+
+/*
+ * Connecting does not block: the addresses are looked up in the background
+ * and the connection attempts run in parallel, each one starting shortly
+ * after the previous one (RFC 6555). The first to connect is used.
+ */
+void IMAP::connect()
 {
-	return !isspace(c) && c != '(' && c != ')' && c != '{' && c != '['
-		&& c != ']';
+	disconnect();
+	m_phase_begin = stats_now();
+
+	m_lookup = new Lookup;
+	m_lookup->conn = this;
+	m_lookup->cancellable = g_cancellable_new();
+	m_state = S_RESOLVING;
+
+	GResolver *resolver = g_resolver_get_default();
+	g_resolver_lookup_by_name_async(resolver, m_server.c_str(),
+					m_lookup->cancellable, lookup_ready,
+					m_lookup);
+	g_object_unref(resolver);
 }
 
-/* read an IMAP string (consisting of atom characters) */
-std::string parse_astring(std::istream &is)
+void IMAP::lookup_ready(GObject *source, GAsyncResult *result, gpointer ptr)
 {
-	/* skips leading space */
-	char c;
-	is >> c;
-	if (is.eof() || !is_atom(c)) {
-		throw imap_parse_error("Expected an atom string");
+	Lookup *lookup = (Lookup *) ptr;
+
+	GError *error = NULL;
+	GList *addresses = g_resolver_lookup_by_name_finish(
+				G_RESOLVER(source), result, &error);
+	if (lookup->conn != NULL) {
+		lookup->conn->m_lookup = NULL;
+		if (addresses != NULL) {
+			lookup->conn->resolved(addresses);
+		} else {
+			debug("%s: %s\n", lookup->conn->m_server.c_str(),
+			      error->message);
+			lookup->conn->connect_failed("unable to resolve");
+		}
 	}
-	std::string out;
-	out += c;
-	c = is.peek();
-	while (!is.eof() && is_atom(c)) {
-		out += c;
-		is.get();
-		c = is.peek();
+	if (addresses != NULL) {
+		g_resolver_free_addresses(addresses);
 	}
-	return out;
+	if (error != NULL) {
+		g_error_free(error);
+	}
+	g_object_unref(lookup->cancellable);
+	delete lookup;
 }
 
-/* read a quoted or a literal IMAP string */
-std::string parse_string(std::istream &is)
+void IMAP::resolved(GList *addresses)
 {
-	std::string out;
+	std::list<sockaddr_storage> families[2];
+	GSocketFamily first = G_SOCKET_FAMILY_INVALID;
+
+	for (GList *i = addresses; i != NULL; i = i->next) {
+		GInetAddress *addr = G_INET_ADDRESS(i->data);
+		GSocketFamily family = g_inet_address_get_family(addr);
+		if (first == G_SOCKET_FAMILY_INVALID) {
+			first = family;
+		}
 
-	if (skip(is, '{')) {
-		/* a literal string, with length of the string as a prefix */
-		size_t length;
-		is >> length;
-		if (!is) {
-			throw imap_parse_error("Invalid literal length");
+		sockaddr_storage ss;
+		memset(&ss, 0, sizeof ss);
+		if (family == G_SOCKET_FAMILY_IPV6) {
+			sockaddr_in6 *sin6 = (sockaddr_in6 *) &ss;
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_port = htons(PORT);
+			memcpy(&sin6->sin6_addr, g_inet_address_to_bytes(addr),
+			       sizeof sin6->sin6_addr);
+		} else if (family == G_SOCKET_FAMILY_IPV4) {
+			sockaddr_in *sin = (sockaddr_in *) &ss;
+			sin->sin_family = AF_INET;
+			sin->sin_port = htons(PORT);
+			memcpy(&sin->sin_addr, g_inet_address_to_bytes(addr),
+			       sizeof sin->sin_addr);
+		} else {
+			continue;
 		}
-		expect(is, '}');
+		families[family == first ? 0 : 1].push_back(ss);
+	}
 
-		/* skip leading space (and the CRLF) */
-		char c = is.get();
-		while (!is.eof() && c != '\r') {
-			if (!isspace(c)) {
-				throw imap_parse_error("Junk before CRLF");
+	/* the family the resolver preferred goes first */
+	m_addresses.clear();
+	while (!families[0].empty() || !families[1].empty()) {
+		for (int f = 0; f < 2; ++f) {
+			if (!families[f].empty()) {
+				m_addresses.push_back(families[f].front());
+				families[f].pop_front();
 			}
-			c = is.get();
-		}
-		/*
-		 * One CRLF-terminated line is read at a time from the server.
-		 * The content of the string is after a CRLF, and we need to
-		 * signal that the caller needs to give us another line.
-		 */
-		if (is.eof()) {
-			throw imap_need_more();
 		}
+	}
+	start_attempt();
+}
 
-		/* skip the LF */
-		c = is.get();
-		if (is.eof() || c != '\n') {
-			throw imap_parse_error("Expected an LF");
+void IMAP::start_attempt()
+{
+	while (!m_addresses.empty()) {
+		sockaddr_storage ss = m_addresses.front();
+		m_addresses.pop_front();
+
+		socklen_t len = ss.ss_family == AF_INET6 ?
+				sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+		int fd = socket(ss.ss_family, SOCK_STREAM, 0);
+		if (fd < 0) {
+			/* no IPv6 on this host, for example */
+			continue;
 		}
-
-		out.resize(length, 0);
-		if (!is.read(&out[0], length)) {
-			throw imap_need_more();
+		set_nonblock(fd, true);
+		if (::connect(fd, (sockaddr *) &ss, len) &&
+		    errno != EINPROGRESS) {
+			close(fd);
+			continue;
 		}
 
-	} else if (skip(is, '"')) {
-		/* a quoted string */
-		char c = is.get();
-		while (!is.eof() && c != '"') {
-			if (c == '\\') {
-				/* Escaped char, used by Gmail's IMAP server */
-				c = is.get();
-				if (is.eof() || !(c == '"' || c == '\\')) {
-					throw imap_parse_error("Invalid escaped char");
-				}
-			}
-			out += c;
-			c = is.get();
+		Attempt attempt;
+		attempt.fd = fd;
+		attempt.channel = g_io_channel_unix_new(fd);
+		attempt.watch = g_io_add_watch(attempt.channel,
+				GIOCondition(G_IO_OUT | G_IO_ERR | G_IO_HUP),
+				attempt_ready, this);
+		m_attempts.push_back(attempt);
+
+		if (!m_addresses.empty()) {
+			m_attempt_timer = g_timeout_add(ATTEMPT_DELAY,
+							attempt_timeout, this);
 		}
-		if (is.eof()) {
-			throw imap_parse_error("Unterminated string");
+		return;
+	}
+	if (m_attempts.empty()) {
+		connect_failed("unable to connect");
+	}
+}
+
+void IMAP::attempt_done(int fd)
+{
+	std::list<Attempt>::iterator i = m_attempts.begin();
+	while (i != m_attempts.end() && i->fd != fd) {
+		++i;
+	}
+	if (i == m_attempts.end()) {
+		return;
+	}
+	Attempt attempt = *i;
+	m_attempts.erase(i);
+	g_source_remove(attempt.watch);
+
+	int error = 0;
+	socklen_t len = sizeof error;
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+		error = errno;
+	}
+	if (error != 0) {
+		debug("%s: connect failed (%s)\n", m_server.c_str(),
+		      strerror(error));
+		g_io_channel_unref(attempt.channel);
+		close(fd);
+		/* no need to wait for the timer */
+		if (m_attempt_timer != INVALID_GTK_WATCH) {
+			g_source_remove(m_attempt_timer);
+			m_attempt_timer = INVALID_GTK_WATCH;
 		}
+		start_attempt();
+		return;
+	}
+
+	g_io_channel_unref(attempt.channel);
+	cancel_connect();
+	start_tls(fd);
+}
 
+void IMAP::connect_failed(const char *reason)
+{
+	if (m_worker) {
+		worker_failed(reason);
 	} else {
-		/* handle NIL */
-		std::string nil = parse_astring(is);
-		if (nil != "NIL") {
-			throw imap_parse_error("Not a string or a NIL");
-		}
+		printf("%s: %s\n", m_server.c_str(), reason);
+		disconnect();
 	}
-	return out;
 }
 
-std::list<Header_Address> parse_address_list(std::istream &parser)
-{
-	std::list<Header_Address> addresses;
-	if (skip(parser, '(')) {
-		while (!skip(parser, ')')) {
-			expect(parser, '(');
-			Header_Address addr;
-			addr.name = to_unicode(parse_string(parser));
-			parse_string(parser); /* ignored */
-			std::string mailbox = parse_string(parser);
-			std::string host = parse_string(parser);
-			addr.email = to_unicode(mailbox + "@" + host);
-			addresses.push_back(addr);
-			expect(parser, ')');
+/* Forget the lookup and the connection attempts still in progress */
+void IMAP::cancel_connect()
+{
+	if (m_lookup != NULL) {
+		m_lookup->conn = NULL;
+		g_cancellable_cancel(m_lookup->cancellable);
+		m_lookup = NULL;
+	}
+	for (const_list_iter<Attempt> i(m_attempts); i; i.next()) {
+		g_source_remove(i->watch);
+		g_io_channel_unref(i->channel);
+		close(i->fd);
+	}
+	m_attempts.clear();
+	m_addresses.clear();
+	if (m_attempt_timer != INVALID_GTK_WATCH) {
+		g_source_remove(m_attempt_timer);
+		m_attempt_timer = INVALID_GTK_WATCH;
+	}
+}
+
+/* the handshake and everything after it happen on the network thread */
+void IMAP::start_tls(int fd)
+{
+	SSL *ssl = SSL_new(tls_context());
+	if (ssl == NULL) {
+		close(fd);
+		connect_failed("can not create SSL object");
+		return;
+	}
+	SSL_set_fd(ssl, fd);
+	tls_prepare(ssl, m_server);
+	stats_span(PHASE_CONNECT, m_phase_begin);
+
+	m_net = new Net_Thread(ssl, m_server, net_ready, this);
+	m_state = S_CONNECTING;
+	m_net->start();
+}
+
+/*
+ * The object stays usable after this, so it is safe to call from within
+ * the handlers of the connection.
+ */
+void IMAP::disconnect()
+{
+	remove_idle_timer();
+	cancel_connect();
+	end_stream(false);
+	delete m_net;
+	m_net = NULL;
+	m_pending.clear();
+	m_queued.clear();
+	m_searches.clear();
+	m_found.clear();
+	m_threads.clear();
+	m_listed.clear();
+	if (m_status_timer != INVALID_GTK_WATCH) {
+		g_source_remove(m_status_timer);
+		m_status_timer = INVALID_GTK_WATCH;
+	}
+	m_prefetching = 0;
+	m_idle = IDLE_OFF;
+	m_logged_in = false;
+	m_state = S_IDLE;
+}
+
+bool IMAP::search(const std::string &query)
+{
+	if (m_state != S_READY || query.empty()) {
+		return false;
+	}
+	/* a quoted string can only contain plain ASCII */
+	std::string quoted;
+	for (size_t i = 0; i < query.size(); ++i) {
+		unsigned char c = query[i];
+		if (c < 0x20 || c >= 0x7f) {
+			return false;
 		}
-	} else {
-		/* handle NIL */
-		std::string nil = parse_astring(parser);
-		if (nil != "NIL") {
-			throw imap_parse_error("Not an address list or a NIL");
+		if (c == '"' || c == '\\') {
+			quoted += '\\';
 		}
+		quoted += c;
 	}
-	return addresses;
+	send_command(strf("UID SEARCH TEXT \"%s\"", quoted.c_str()),
+		     &IMAP::text_search_done);
+	m_searches.push_back(query);
+	return true;
 }
 
-Envelope parse_envelope(std::istream &parser)
+void IMAP::fetch_part(const Part_Request &req)
 {
-	Envelope env;
-	expect(parser, '(');
-	env.date = to_unicode(parse_string(parser));
-	env.subject = to_unicode(parse_string(parser));
-	env.from = parse_address_list(parser);
-	env.sender = parse_address_list(parser);
-	env.reply_to = parse_address_list(parser);
-	env.to = parse_address_list(parser);
-	env.cc = parse_address_list(parser);
-	env.bcc = parse_address_list(parser);
-	env.parent_id = to_unicode(parse_string(parser));
-	env.message_id = to_unicode(parse_string(parser));
-	expect(parser, ')');
-	return env;
+	if (m_state != S_READY && m_state != S_SYNC) {
+		/* sent as soon as the mailbox has been selected */
+		m_wanted.push_back(req);
+		return;
+	}
+	/* pipelined with whatever is in flight, the replies carry the UID */
+	send_command(fetch_command(req, "BODY"), &IMAP::body_done);
 }
 
-void parse_body_struct(std::istream &parser)
+void IMAP::prefetch(const std::list<Part_Request> &parts)
 {
-	expect(parser, '(');
+	m_prefetch = parts;
+	send_prefetch();
+}
 
-	if (check(parser, '(')) {
-		/* a sequence of nested body structures */
-		while (check(parser, '(')) {
-			parse_body_struct(parser);
-		}
-		std::string subtype = parse_string(parser);
+std::string IMAP::fetch_command(const Part_Request &req, const char *item)
+{
+	return strf("UID FETCH %u %s[%s]", req.uid, item, req.section.c_str());
+}
+
+void IMAP::send_command(const std::string &cmd, Completion done)
+{
+	if (m_idle != IDLE_OFF) {
+		/* sent when the server has ended the IDLE */
+		m_queued.push_back(Queued_Command(cmd, done));
+		stop_idle();
+		return;
+	}
+	ins(m_pending, m_next_cmd_id, done);
+	m_net->send(strf("%d ", m_next_cmd_id) + cmd + "\r\n");
+	m_next_cmd_id++;
+}
 
+/* wait for changes in the mailbox when there is nothing else to do */
+void IMAP::maybe_idle()
+{
+	if (m_worker || m_state != S_READY || !m_pending.empty() ||
+	    m_idle_timer != INVALID_GTK_WATCH) {
+		return;
+	}
+	if (m_capabilities.count("IDLE")) {
+		send_command("IDLE", &IMAP::idle_done);
+		m_idle = IDLE_STARTING;
+		m_idle_timer = g_timeout_add_seconds(IDLE_INTERVAL,
+						     idle_timeout, this);
 	} else {
-		std::string type = parse_string(parser);
-		std::string subtype = parse_string(parser);
-
-		/* parameter list */
-		if (skip(parser, '(')) {
-			while (!skip(parser, ')')) {
-				std::string key = parse_string(parser);
-				std::string val = parse_string(parser);
-			}
-		} else {
-			/* handle NIL */
-			std::string nil = parse_astring(parser);
-			if (nil != "NIL") {
-				throw imap_parse_error("Not a param list or a NIL");
-			}
-		}
+		m_idle_timer = g_timeout_add_seconds(POLL_INTERVAL,
+						     idle_timeout, this);
+	}
+}
 
-		std::string id = parse_string(parser);
-		std::string descr = parse_string(parser);
-		std::string encoding = parse_string(parser);
+void IMAP::stop_idle()
+{
+	if (m_idle == IDLE_ON) {
+		m_net->send("DONE\r\n");
+		m_idle = IDLE_STOPPING;
+	}
+	/* when IDLE_STARTING, DONE is sent after the continuation */
+}
 
-		size_t size;
-		parser >> size; /* ignored */
-		if (!parser) {
-			throw imap_parse_error("Invalid body part size");
-		}
+void IMAP::idle_done(bool ok)
+{
+	if (!ok) {
+		/* do not try again */
+		m_capabilities.erase("IDLE");
+	}
+	m_idle = IDLE_OFF;
+	remove_idle_timer();
 
-		if (type == "TEXT") {
-			size_t nlines;
-			parser >> nlines; /* ignored */
-			if (!parser) {
-				throw imap_parse_error("Invalid number of lines");
-			}
+	std::list<Queued_Command> queued;
+	queued.swap(m_queued);
+	for (const_list_iter<Queued_Command> i(queued); i; i.next()) {
+		send_command(i->first, i->second);
+	}
+}
+
+void IMAP::remove_idle_timer()
+{
+	if (m_idle_timer != INVALID_GTK_WATCH) {
+		g_source_remove(m_idle_timer);
+		m_idle_timer = INVALID_GTK_WATCH;
+	}
+}
 
-		} else if (type == "MESSAGE" && subtype == "RFC822") {
-			parse_envelope(parser); /* ignored */
-			parse_body_struct(parser); /* ignored */
+void IMAP::fetch_new()
+{
+	if (m_fetching_new) {
+		m_exists_changed = true;
+		return;
+	}
+	m_known_uid = m_sync.last_uid;
+	send_command(strf("UID FETCH %u:* FULL", m_known_uid + 1),
+		     &IMAP::new_done);
+	m_phase_begin = stats_now();
+	m_fetching_new = true;
+	m_exists_changed = false;
+}
 
-			size_t nlines;
-			parser >> nlines; /* ignored */
-			if (!parser) {
-				throw imap_parse_error("Invalid number of lines");
-			}
-		}
+void IMAP::new_done(bool ok)
+{
+	m_fetching_new = false;
+	if (!ok) {
+		printf("IMAP: Unable to fetch new messages\n");
+		return;
+	}
+	stats_span(PHASE_FETCH, m_phase_begin);
+	m_account->save_sync_state(m_sync);
+	m_account->folder_synced(selected_status());
+	if (m_exists_changed) {
+		fetch_new();
+	}
+}
+
+void IMAP::search_done(bool ok)
+{
+	m_searches.pop_front();
+	if (ok) {
+		/* forget the messages that were deleted while offline */
+		m_account->keep_messages(m_seq_uids);
+	}
+}
+
+void IMAP::text_search_done(bool ok)
+{
+	std::string query = m_searches.front();
+	m_searches.pop_front();
+	std::vector<uint32_t> found;
+	found.swap(m_found);
+	if (!ok) {
+		printf("IMAP: Unable to search\n");
+		return;
+	}
+	m_account->search_done(query, found);
+}
+
+void IMAP::thread_done(bool ok)
+{
+	std::vector<Thread_Link> threads;
+	threads.swap(m_threads);
+	if (!ok) {
+		printf("IMAP: Unable to get the threads\n");
+		return;
 	}
-	expect(parser, ')');
+	m_account->set_threads(threads);
 }
 
-std::string parse_body_reply(std::istream &parser)
+/*
+ * The other folders are not selected to find out whether they have
+ * changed. Their counters are asked for with one LIST-STATUS command, or
+ * with STATUS commands pipelined after LIST.
+ */
+void IMAP::poll_folders()
 {
-	expect(parser, '(');
+	if (m_status_timer == INVALID_GTK_WATCH) {
+		m_status_timer = g_timeout_add_seconds(STATUS_INTERVAL,
+						       status_timeout, this);
+	}
+	if (m_capabilities.count("LIST-STATUS")) {
+		send_command("LIST \"\" \"*\" RETURN (STATUS (" +
+			     status_items() + "))", &IMAP::list_done);
+	} else {
+		send_command("LIST \"\" \"*\"", &IMAP::list_done);
+	}
+}
 
-	std::string body = parse_astring(parser);
-	if (body != "BODY") {
-		throw imap_parse_error("Expected BODY");
+void IMAP::list_done(bool ok)
+{
+	std::vector<std::string> listed;
+	listed.swap(m_listed);
+	if (!ok) {
+		printf("IMAP: Unable to list the folders\n");
+		return;
 	}
+	std::vector<std::string> order = m_account->folders_listed(listed);
+	if (m_capabilities.count("LIST-STATUS")) {
+		return;
+	}
+	for (size_t i = 0; i < order.size(); ++i) {
+		/* the selected one is known already */
+		if (order[i] != m_folder) {
+			send_command("STATUS " + quote(order[i]) + " (" +
+				     status_items() + ")", &IMAP::status_done);
+		}
+	}
+}
 
-	expect(parser, '[');
-	std::string text = parse_astring(parser);
-	if (text != "TEXT") {
-		throw imap_parse_error("Expected TEXT");
+std::string IMAP::status_items() const
+{
+	std::string items = "MESSAGES UIDNEXT UIDVALIDITY";
+	if (m_capabilities.count("CONDSTORE")) {
+		items += " HIGHESTMODSEQ";
 	}
-	expect(parser, ']');
+	return items;
+}
 
-	return parse_string(parser);
+void IMAP::status_done(bool ok)
+{
+	UNUSED(ok);
 }
 
-Envelope parse_fetch_reply(std::istream &parser)
+void IMAP::handle_list(IMAP_Tokenizer &parser)
 {
-	Envelope envelope;
-	expect(parser, '(');
-	while (!skip(parser, ')')) {
-		std::string type = parse_astring(parser);
+	bool selectable = true;
+	parser.expect('(');
+	while (!parser.skip(')')) {
+		std::string flag = parser.atom().str();
+		for (size_t i = 0; i < flag.size(); ++i) {
+			flag[i] = tolower(flag[i]);
+		}
+		if (flag == "\\noselect" || flag == "\\nonexistent") {
+			selectable = false;
+		}
+	}
+	/* the hierarchy delimiter */
+	parser.string();
+	std::string name = astring(parser);
+	if (selectable) {
+		m_listed.push_back(name);
+	}
+}
 
-		if (type == "INTERNALDATE") {
-			std::string date = parse_string(parser);
+void IMAP::handle_status(IMAP_Tokenizer &parser)
+{
+	std::string name = astring(parser);
+	Folder_Status status;
+	parser.expect('(');
+	while (!parser.skip(')')) {
+		Str_View item = parser.atom();
+		uint64_t value = parser.number();
+		if (item == "MESSAGES") {
+			status.messages = value;
+		} else if (item == "UIDNEXT") {
+			status.uidnext = value;
+		} else if (item == "UIDVALIDITY") {
+			status.uidvalidity = value;
+		} else if (item == "HIGHESTMODSEQ") {
+			status.highestmodseq = value;
+		}
+	}
+	if (name != m_folder) {
+		m_account->folder_status(name, status);
+	}
+}
 
-		} else if (type == "RFC822.SIZE") {
-			size_t size;
-			parser >> size; /* ignored */
-			if (!parser) {
-				throw imap_parse_error("Invalid msg size");
-			}
+void IMAP::login_done(bool ok)
+{
+	if (!ok) {
+		/* a worker probably has too many connections */
+		connection_lost("unable to log in");
+		return;
+	}
+	stats_span(PHASE_LOGIN, m_phase_begin);
+	debug("logged in\n");
+	m_logged_in = true;
+	send_command("CAPABILITY", &IMAP::capability_done);
+}
 
-		} else if (type == "FLAGS") {
-			expect(parser, '(');
-			while (!skip(parser, ')')) {
-				std::string flag = parse_astring(parser);
-			}
+void IMAP::capability_done(bool ok)
+{
+	if (!ok) {
+		connection_lost("unable to get capabilities");
+		return;
+	}
+	if (m_capabilities.count("COMPRESS=DEFLATE")) {
+		/* nothing else may be in flight */
+		m_net->compress_after(m_next_cmd_id);
+		send_command("COMPRESS DEFLATE", &IMAP::compress_done);
+		return;
+	}
+	select_mailbox();
+}
 
-		} else if (type == "ENVELOPE") {
-			envelope = parse_envelope(parser);
+void IMAP::compress_done(bool ok)
+{
+	if (!ok) {
+		debug("%s: compression refused\n", m_server.c_str());
+	}
+	select_mailbox();
+}
 
-		} else if (type == "BODY") {
-			parse_body_struct(parser); /* ignored */
+void IMAP::select_mailbox()
+{
+	m_selected = Sync_State();
+	m_uidnext = 0;
+	m_exists = 0;
+	m_phase_begin = stats_now();
+	if (m_worker) {
+		/* read-only, the primary connection owns the mailbox */
+		send_command("EXAMINE " + quote(m_folder), &IMAP::select_done);
+	} else if (m_capabilities.count("CONDSTORE")) {
+		send_command("SELECT " + quote(m_folder) + " (CONDSTORE)",
+			     &IMAP::select_done);
+	} else {
+		send_command("SELECT " + quote(m_folder), &IMAP::select_done);
+	}
+}
 
+void IMAP::select_done(bool ok)
+{
+	if (ok) {
+		stats_span(PHASE_SELECT, m_phase_begin);
+	}
+	if (m_worker) {
+		if (!ok) {
+			worker_failed("unable to examine");
+		} else if (m_selected.uidvalidity !=
+			   m_account->sync_state().uidvalidity) {
+			worker_failed("UIDVALIDITY changed");
 		} else {
-			debug("unknown fetch field: %s\n", type.c_str());
+			m_state = S_SYNC;
+			fetch_next_range();
 		}
+		return;
+	}
+	if (!ok) {
+		connection_lost("unable to select");
+		return;
+	}
+	m_state = S_SYNC;
+	start_sync();
+
+	/* the messages that were clicked while connecting */
+	while (!m_wanted.empty()) {
+		fetch_part(m_wanted.front());
+		m_wanted.pop_front();
 	}
-	return envelope;
 }
 
+void IMAP::start_sync()
+{
+	if (m_selected.uidvalidity != m_sync.uidvalidity) {
+		/* None of the cached UIDs refer to the same messages anymore */
+		debug("UIDVALIDITY changed, full resync\n");
+		m_account->clear_messages();
+		m_sync = Sync_State();
+		m_sync.uidvalidity = m_selected.uidvalidity;
+		m_account->save_sync_state(m_sync);
+	}
+	m_known_uid = m_sync.last_uid;
+
+	if (m_known_uid == 0 && m_uidnext > PARALLEL_SYNC_MIN &&
+	    m_account->start_parallel_sync(1, m_uidnext - 1)) {
+		/* the other connections fetch the envelopes */
+		debug("%s: parallel sync of UIDs 1:%u\n", m_server.c_str(),
+		      m_uidnext - 1);
+		return;
+	}
+
+	if (m_exists == 0 || (m_uidnext != 0 && m_uidnext <= m_known_uid + 1)) {
+		/* no new messages */
+		sync_flags();
+		return;
+	}
+	send_command(strf("UID FETCH %u:* FULL", m_known_uid + 1),
+		     &IMAP::envelopes_done);
+	m_phase_begin = stats_now();
 }
 
-IMAP::IMAP(const std::string &server, const std::string &user,
-	   const std::string &pw) :
-	m_state(S_IDLE),
-	m_server(server),
-	m_user(user),
-	m_pw(pw),
-	m_conn(NULL),
-	m_watch(INVALID_GTK_WATCH),
-	m_write_watch(INVALID_GTK_WATCH),
-	m_logged_in(false),
-	m_next_cmd_id(1),
-	m_next_reply_id(1)
+void IMAP::envelopes_done(bool ok)
 {
+	if (!ok) {
+		connection_lost("unable to fetch");
+		return;
+	}
+	stats_span(PHASE_FETCH, m_phase_begin);
+	/* save the progress before the flags */
+	m_account->save_sync_state(m_sync);
+	sync_flags();
 }
 
-IMAP::~IMAP()
+void IMAP::parallel_sync_done(bool ok, uint32_t last_uid)
+{
+	if (ok) {
+		/* the envelopes came with up-to-date flags */
+		m_sync.last_uid = last_uid;
+		m_sync.highestmodseq = m_selected.highestmodseq;
+		m_account->save_sync_state(m_sync);
+	} else {
+		debug("%s: parallel sync failed\n", m_server.c_str());
+	}
+	/* fetch what arrived meanwhile, or everything if it failed */
+	start_sync();
+}
+
+void IMAP::sync_flags()
 {
-	if (m_watch != INVALID_GTK_WATCH) {
-		g_source_remove(m_watch);
+	if (m_known_uid == 0) {
+		/* everything was just fetched, the flags are up to date */
+		finish_sync();
+		return;
 	}
-	remove_write_watch();
-	if (m_conn != NULL) {
-		SSL_free(m_conn);
+	if (m_capabilities.count("CONDSTORE") && m_selected.highestmodseq) {
+		if (m_sync.highestmodseq == m_selected.highestmodseq) {
+			finish_sync();
+			return;
+		}
+		/* only the messages whose flags have changed */
+		send_command(strf("UID FETCH 1:%u (UID FLAGS) (CHANGEDSINCE %lu)",
+				  m_known_uid,
+				  (unsigned long) m_sync.highestmodseq),
+			     &IMAP::flags_done);
+	} else {
+		send_command(strf("UID FETCH 1:%u (UID FLAGS)", m_known_uid),
+			     &IMAP::flags_done);
 	}
 }
 
-void IMAP::connect()
+void IMAP::flags_done(bool ok)
 {
-	hostent *hp = gethostbyname(m_server.c_str());
-	if (hp == NULL) {
-		throw std::runtime_error("Can not to resolve host " + m_server);
+	if (!ok) {
+		connection_lost("unable to fetch");
+		return;
 	}
+	finish_sync();
+}
 
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (fd < 0) {
-		throw std::runtime_error("Can not to create socket");
+void IMAP::finish_sync()
+{
+	m_sync.highestmodseq = m_selected.highestmodseq;
+	m_account->save_sync_state(m_sync);
+	debug("%s synchronized, last UID %u\n", m_server.c_str(),
+	      m_sync.last_uid);
+	m_state = S_READY;
+
+	/* maps the sequence numbers to UIDs */
+	send_command("UID SEARCH ALL", &IMAP::search_done);
+	m_searches.push_back(std::string());
+	if (m_capabilities.count("THREAD=REFERENCES")) {
+		/* uses the References headers, which the envelopes lack */
+		send_command("UID THREAD REFERENCES UTF-8 ALL",
+			     &IMAP::thread_done);
 	}
 
-	sockaddr_in sin;
-	sin.sin_family = AF_INET;
-	sin.sin_addr = *(in_addr *) hp->h_addr_list[0];
-	sin.sin_port = htons(PORT);
+	m_account->folder_synced(selected_status());
+	poll_folders();
 
-	set_nonblock(fd, true);
+	m_account->sync_finished();
+}
 
-	if (::connect(fd, (sockaddr *) &sin, sizeof sin)) {
-		if (errno != EINPROGRESS) {
-			close(fd);
-			throw std::runtime_error("Can not to connect to " +
-						 m_server);
-		}
+/* what STATUS would tell about the mailbox now */
+Folder_Status IMAP::selected_status() const
+{
+	Folder_Status status;
+	status.uidvalidity = m_selected.uidvalidity;
+	status.uidnext = std::max(m_uidnext, m_sync.last_uid + 1);
+	status.messages = m_exists;
+	status.highestmodseq = m_selected.highestmodseq;
+	return status;
+}
+
+void IMAP::body_done(bool ok)
+{
+	if (!ok) {
+		printf("IMAP: Unable to fetch a message\n");
 	}
+}
 
-	m_iochannel = g_io_channel_unix_new(fd);
-	m_watch = g_io_add_watch(m_iochannel, G_IO_IN, data_available, this);
-	m_state = S_CONNECTING;
+/*
+ * Keep one batch of background fetches in flight. The parts of different
+ * messages have different sections, so each needs its own command.
+ */
+void IMAP::send_prefetch()
+{
+	if (m_state != S_READY || m_prefetching > 0 || m_prefetch.empty()) {
+		return;
+	}
+	for (size_t i = 0; i < PREFETCH_BATCH && !m_prefetch.empty(); ++i) {
+		/* PEEK does not mark the messages as seen */
+		send_command(fetch_command(m_prefetch.front(), "BODY.PEEK"),
+			     &IMAP::prefetch_done);
+		m_prefetch.pop_front();
+		m_prefetching++;
+	}
+}
 
-	SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
-	SSL_CTX_set_options(ctx, SSL_OP_ALL);
-	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE|
-			 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+void IMAP::prefetch_done(bool ok)
+{
+	if (!ok) {
+		printf("IMAP: Unable to prefetch a message\n");
+	}
+	m_prefetching--;
+	send_prefetch();
+}
 
-	m_conn = SSL_new(ctx);
-	if (m_conn == NULL) {
-		throw std::runtime_error("Can not create SSL object");
+void IMAP::fetch_next_range()
+{
+	if (!m_account->next_range(&m_range_first, &m_range_last)) {
+		m_range_first = m_range_last = 0;
+		send_command("LOGOUT", &IMAP::logout_done);
+		return;
 	}
-	SSL_set_fd(m_conn, fd);
+	send_command(strf("UID FETCH %u:%u FULL", m_range_first, m_range_last),
+		     &IMAP::range_done);
+	m_phase_begin = stats_now();
+}
 
-	/* begin SSL handshake */
-	int ret = SSL_connect(m_conn);
-	if (ret < 0) {
-		ssl_handle_error(ret);
+void IMAP::range_done(bool ok)
+{
+	if (!ok) {
+		worker_failed("unable to fetch");
+		return;
 	}
+	stats_span(PHASE_FETCH, m_phase_begin);
+	m_account->range_done(m_range_first, m_range_last);
+	fetch_next_range();
 }
 
-void IMAP::fetch_message(int id)
+void IMAP::worker_failed(const char *reason)
 {
-	send_command(strf("FETCH %d BODY[TEXT]", id));
-	m_state = S_FETCH_BODY;
+	debug("%s: worker connection failed: %s\n", m_server.c_str(), reason);
+	disconnect();
+	m_account->worker_failed(this, m_range_first, m_range_last);
+	m_range_first = m_range_last = 0;
 }
 
-void IMAP::send_command(const std::string &cmd)
+void IMAP::logout_done(bool ok)
 {
-	m_send_buf += strf("%d ", m_next_cmd_id) + cmd + "\r\n";
-	m_next_cmd_id++;
-	try_write();
+	UNUSED(ok);
+	disconnect();
+	m_account->worker_finished(this);
 }
 
-size_t IMAP::process_recv(const std::string &buf)
+/*
+ * Untagged FETCH data is not tied to any command, so it is routed by what
+ * it contains.
+ */
+void IMAP::handle_fetch(uint32_t seq, IMAP_Tokenizer &parser)
 {
-	size_t begin = 0;
-	size_t i = 0, j;
-	/* TODO: fix the indentation */
-	while (1)
+	Fetch_Reply reply;
 	try {
-		j = buf.find("\r\n", i);
-		if (j == std::string::npos)
-			break;
-
-		std::string line = buf.substr(begin, j - begin);
-		/* debug("RECV: %s\n", line.c_str()); */
-
-		std::istringstream parser(line);
-		bool untagged = true;
-		if (!skip(parser, '*')) {
-			untagged = false;
-			int id;
-			parser >> id;
-			if (!parser || id != m_next_reply_id) {
-				throw imap_parse_error("Invalid reply ID");
-			}
-			m_next_reply_id++;
-		}
+		parse_fetch_reply(parser, &reply);
+	} catch (const imap_parse_error &e) {
+		stats_add(STAT_PARSE_ERRORS);
+		printf("IMAP parse error: %s\n", e.what());
+		printf("\"%s\"\n", parser.response().str().c_str());
+		return;
+	}
+	handle_fetch(seq, reply);
+}
 
-		switch (m_state) {
-		case S_IDLE:
-			break;
-
-		case S_CONNECTING:
-			/* send credentials */
-			send_command(strf("LOGIN %s %s",
-				     m_user.c_str(), m_pw.c_str()));
-			m_state = S_LOGIN;
-			break;
-
-		case S_LOGIN:
-			if (!untagged) {
-				std::string status;
-				parser >> status;
-				if (status != "OK") {
-					throw std::runtime_error("Unable to log in");
-				}
-				debug("logged in\n");
-				send_command("SELECT INBOX");
-				m_state = S_SELECT;
-			}
-			break;
-
-		case S_SELECT:
-			if (!untagged) {
-				std::string status;
-				parser >> status;
-				if (status != "OK") {
-					throw std::runtime_error("Unable to select");
-				}
-				send_command("FETCH 1:* full");
-				m_state = S_FETCH;
+/* usually parsed on the network thread already */
+void IMAP::handle_fetch(uint32_t seq, Fetch_Reply &reply)
+{
+	uint32_t uid = reply.env.uid;
+	if (seq > m_seq_uids.size()) {
+		m_seq_uids.resize(seq);
+	}
+	if (uid == 0) {
+		/* unsolicited FETCH, such as changed flags */
+		uid = m_seq_uids[seq - 1];
+		reply.env.uid = uid;
+	} else {
+		m_seq_uids[seq - 1] = uid;
+	}
+	if (uid == 0) {
+		printf("IMAP: FETCH reply without UID\n");
+		return;
+	}
+
+	if (reply.items & Fetch_Reply::F_ENVELOPE) {
+		/*
+		 * "UID n:*" always matches the last message, even if it was
+		 * already known.
+		 */
+		if (uid > m_known_uid) {
+			m_account->add_message(&reply.env);
+			if (uid > m_sync.last_uid) {
+				m_sync.last_uid = uid;
 			}
-			break;
-
-		case S_FETCH:
-			if (!untagged) {
-				std::string status;
-				parser >> status;
-				if (status != "OK") {
-					throw std::runtime_error("Unable to fetch");
-				}
-				m_state = S_IDLE;
+		}
+	} else if (reply.items & Fetch_Reply::F_FLAGS) {
+		m_account->update_flags(uid, reply.env.flags);
+	}
+	if (m_streaming && !m_stream_known) {
+		/* now we know what the part belongs to */
+		reply.body.swap(m_stream_body);
+		m_streaming = false;
+	}
+	if (reply.items & Fetch_Reply::F_BODY) {
+		if (m_streaming) {
+			/* the contents have already been handed on */
+			end_stream(true);
+		} else {
+			m_account->part_begin(uid, reply.section);
+			m_account->part_data(reply.body.data(),
+					     reply.body.size());
+			m_account->part_end(true);
+		}
+	}
+}
 
-			} else {
-				int id;
-				parser >> id;
-				if (!parser) {
-					throw imap_parse_error("Invalid message ID");
-				}
-				std::string status = parse_astring(parser);
+void IMAP::handle_untagged(IMAP_Tokenizer &parser)
+{
+	if (m_state == S_CONNECTING) {
+		/* the greeting, send credentials */
+		if (parser.atom() == "BYE") {
+			/* a worker is over the connection limit of the server */
+			connection_lost("connection refused");
+			return;
+		}
+		send_command(strf("LOGIN %s %s", m_user.c_str(), m_pw.c_str()),
+			     &IMAP::login_done);
+		m_phase_begin = stats_now();
+		m_state = S_LOGIN;
+		return;
+	}
 
-				Envelope env;
-				/* TODO: write a proper parser */
-				try {
-					env = parse_fetch_reply(parser);
-					env.id = id;
+	if (parser.check_digit()) {
+		uint32_t num = parser.number();
+		Str_View type = parser.atom();
+		if (type == "EXISTS") {
+			bool grown = num > m_exists;
+			m_exists = num;
+			m_seq_uids.resize(num);
+			if (grown && m_state == S_READY && !m_worker) {
+				fetch_new();
+			}
+		} else if (type == "EXPUNGE") {
+			expunged(num);
+		} else if (type == "FETCH" && num > 0) {
+			handle_fetch(num, parser);
+		}
+		return;
+	}
 
-					add_message(this, &env);
-				} catch (const imap_parse_error &e) {
-					printf("IMAP parse error: %s\n",
-						e.what());
-					printf("\"%s\"\n", line.c_str());
-				}
+	Str_View type = parser.atom();
+	if (type == "BYE" && m_worker && m_range_first != 0) {
+		/* the server closes the connection */
+		worker_failed("disconnected by the server");
+
+	} else if (type == "SEARCH" && !m_searches.empty()) {
+		/* the replies come in the order of the commands */
+		if (m_searches.front().empty()) {
+			/* UID SEARCH ALL, in the order of the sequence numbers */
+			m_seq_uids.clear();
+			while (parser.check_digit()) {
+				m_seq_uids.push_back(parser.number());
 			}
-			break;
-
-		case S_FETCH_BODY:
-			if (!untagged) {
-				std::string status;
-				parser >> status;
-				if (status != "OK") {
-					throw std::runtime_error("Unable to fetch");
-				}
-				m_state = S_IDLE;
-			} else {
-				int id;
-				parser >> id;
-				if (!parser) {
-					throw imap_parse_error("Invalid message ID");
-				}
-				std::string status = parse_astring(parser);
+		} else {
+			while (parser.check_digit()) {
+				m_found.push_back(parser.number());
+			}
+		}
 
-				std::string body = parse_body_reply(parser);
+	} else if (type == "THREAD") {
+		parse_threads(parser, &m_threads);
 
-				show_message(body);
-			}
-			break;
+	} else if (type == "LIST") {
+		handle_list(parser);
 
-		default:
-			break;
+	} else if (type == "STATUS") {
+		handle_status(parser);
+
+	} else if (type == "CAPABILITY") {
+		m_capabilities.clear();
+		while (!parser.at_end()) {
+			m_capabilities.insert(parser.atom().str());
 		}
 
-		i = j + 2;
-		begin = i;
-	} catch (const imap_need_more &) {
-		i = j + 2;
+	} else if (type == "OK" && parser.skip('[')) {
+		/* response codes describing the mailbox */
+		Str_View code = parser.atom();
+		if (code == "UIDVALIDITY") {
+			m_selected.uidvalidity = parser.number();
+		} else if (code == "UIDNEXT") {
+			m_uidnext = parser.number();
+		} else if (code == "HIGHESTMODSEQ") {
+			m_selected.highestmodseq = parser.number();
+		}
 	}
-	return begin;
 }
 
-void IMAP::ssl_handle_error(int ret)
+void IMAP::handle_response(IMAP_Tokenizer &parser)
 {
-	int error = SSL_get_error(m_conn, ret);
-	switch (error) {
-	case SSL_ERROR_WANT_READ:
-		/*
-		 * We don't care if SSL wants to read, because we always do.
-		 * SSL also uses this to signal that it no longer needs to send.
-		 */
-		if (m_send_buf.empty()) {
-			remove_write_watch();
+	if (parser.skip('*')) {
+		handle_untagged(parser);
+		return;
+	}
+	if (parser.skip('+')) {
+		/* only IDLE waits for a continuation */
+		if (m_idle == IDLE_STARTING) {
+			m_idle = IDLE_ON;
+			if (!m_queued.empty() ||
+			    m_idle_timer == INVALID_GTK_WATCH) {
+				stop_idle();
+			}
 		}
-		break;
-	case SSL_ERROR_WANT_WRITE:
-		/* SSL wants to send something */
-		install_write_watch();
-		break;
-	case SSL_ERROR_SYSCALL:
-		throw std::runtime_error(strf("SSL: syscall error (%s)",
-					 strerror(errno)));
-	default:
-		throw std::runtime_error("SSL: an error occured");
+		return;
+	}
+
+	/* completion of a command, find out which one */
+	if (!parser.check_digit()) {
+		throw imap_parse_error("Invalid reply ID");
+	}
+	int id = parser.number();
+	std::map<int, Completion>::iterator i = m_pending.find(id);
+	if (i == m_pending.end()) {
+		throw imap_parse_error(strf("Unknown reply ID %d", id));
+	}
+	Completion done = i->second;
+	m_pending.erase(i);
+
+	Str_View status = parser.atom();
+	if (status != "OK") {
+		debug("command %d failed: %s\n", id,
+		      parser.response().str().c_str());
+	}
+	(this->*done)(status == "OK");
+	if (m_net != NULL) {
+		maybe_idle();
 	}
 }
 
-void IMAP::install_write_watch()
+/*
+ * Act on what the network thread has received. Only a few batches are
+ * processed at a time, and the rest after the main loop has had its turn.
+ */
+bool IMAP::process_events()
 {
-	if (m_write_watch == INVALID_GTK_WATCH) {
-		m_write_watch = g_io_add_watch(m_iochannel, G_IO_OUT,
-					       write_ready, this);
+	Net_Thread *net = m_net;
+	for (size_t n = 0; n < MAX_BATCHES; ++n) {
+		Net_Batch *batch = net->receive();
+		if (batch == NULL) {
+			return false;
+		}
+		for (std::list<Net_Event>::iterator i = batch->begin();
+		     i != batch->end() && m_net == net; ++i) {
+			switch (i->type) {
+			case Net_Event::E_RESPONSE: {
+				IMAP_Tokenizer parser(i->data.data(),
+						      i->data.size());
+				try {
+					handle_response(parser);
+				} catch (const imap_parse_error &e) {
+					stats_add(STAT_PARSE_ERRORS);
+					printf("IMAP parse error: %s\n",
+					       e.what());
+					printf("\"%s\"\n",
+					       parser.response().str().c_str());
+				}
+				/* in case the part was not understood */
+				end_stream(false);
+				break;
+			}
+			case Net_Event::E_FETCH:
+				handle_fetch(i->seq, i->reply);
+				end_stream(false);
+				break;
+			case Net_Event::E_PART_BEGIN:
+				begin_stream(i->seq, i->reply.env.uid,
+					     i->reply.section);
+				break;
+			case Net_Event::E_PART_DATA:
+				stream_data(i->data);
+				break;
+			case Net_Event::E_ERROR:
+				connection_lost(i->data);
+				break;
+			}
+		}
+		delete batch;
+		if (m_net != net) {
+			/* disconnected by a handler */
+			return false;
+		}
 	}
+	return true;
 }
 
-void IMAP::remove_write_watch()
+void IMAP::connection_lost(const std::string &reason)
 {
-	if (m_write_watch != INVALID_GTK_WATCH) {
-		g_source_remove(m_write_watch);
-		m_write_watch = INVALID_GTK_WATCH;
+	if (m_worker) {
+		worker_failed(reason.c_str());
+		return;
 	}
+	/* called from the main loop, so nothing may be thrown */
+	printf("%s: %s\n", m_server.c_str(), reason.c_str());
+	disconnect();
 }
 
-void IMAP::try_read()
+void IMAP::begin_stream(uint32_t seq, uint32_t uid, const std::string &section)
 {
-	while (1) {
-		size_t pos = m_recv_buf.size();
-		m_recv_buf.resize(pos + 4096);
-		int got = SSL_read(m_conn, &m_recv_buf[pos], 4096);
-		if (got <= 0) {
-			m_recv_buf.resize(pos);
-			ssl_handle_error(got);
-			return;
-		}
-		m_recv_buf.resize(pos + got);
-		size_t i = process_recv(m_recv_buf);
-		m_recv_buf.erase(m_recv_buf.begin(), m_recv_buf.begin() + i);
+	if (uid == 0 && seq > 0 && seq <= m_seq_uids.size()) {
+		uid = m_seq_uids[seq - 1];
+	}
+	m_streaming = true;
+	m_stream_known = uid != 0;
+	m_stream_body.clear();
+	if (m_stream_known) {
+		m_account->part_begin(uid, section);
 	}
 }
 
-void IMAP::try_write()
+void IMAP::stream_data(const std::string &data)
 {
-	int written = SSL_write(m_conn, m_send_buf.data(), m_send_buf.size());
-	if (written <= 0) {
-		ssl_handle_error(written);
+	if (!m_streaming) {
 		return;
 	}
-	m_send_buf.erase(m_send_buf.begin(), m_send_buf.begin() + written);
-
-	/*
-	 * Install a write watch if there is more data to send, as SSL might
-	 * able to send more data when the socket becomes writable.
-	  */
-	if (!m_send_buf.empty()) {
-		install_write_watch();
+	if (m_stream_known) {
+		m_account->part_data(data.data(), data.size());
 	} else {
-		remove_write_watch();
+		/* until the rest of the response tells the UID */
+		m_stream_body += data;
 	}
 }
 
-int IMAP::data_available(GIOChannel *io, GIOCondition cond, gpointer ptr)
+void IMAP::end_stream(bool ok)
+{
+	if (m_streaming) {
+		m_streaming = false;
+		m_stream_body.clear();
+		if (m_stream_known) {
+			m_account->part_end(ok);
+		}
+	}
+}
+
+int IMAP::net_ready(gpointer ptr)
+{
+	IMAP *self = (IMAP *) ptr;
+
+	return self->process_events();
+}
+
+int IMAP::attempt_ready(GIOChannel *io, GIOCondition cond, gpointer ptr)
 {
-	UNUSED(io);
 	UNUSED(cond);
 
 	IMAP *self = (IMAP *) ptr;
 
-	self->try_read();
+	/* the attempt removes its watch */
+	self->attempt_done(g_io_channel_unix_get_fd(io));
 
 	return TRUE;
 }
 
-int IMAP::write_ready(GIOChannel *io, GIOCondition cond, gpointer ptr)
+int IMAP::attempt_timeout(gpointer ptr)
 {
-	UNUSED(io);
-	UNUSED(cond);
+	IMAP *self = (IMAP *) ptr;
+
+	self->m_attempt_timer = INVALID_GTK_WATCH;
+	self->start_attempt();
+
+	return FALSE;
+}
+
+void IMAP::expunged(uint32_t seq)
+{
+	if (seq == 0 || seq > m_seq_uids.size()) {
+		printf("IMAP: EXPUNGE of an unknown message %u\n", seq);
+		return;
+	}
+	uint32_t uid = m_seq_uids[seq - 1];
+	m_seq_uids.erase(m_seq_uids.begin() + seq - 1);
+	if (m_exists > 0) {
+		m_exists--;
+	}
+	if (uid != 0) {
+		m_account->remove_message(uid);
+	}
+}
 
+int IMAP::idle_timeout(gpointer ptr)
+{
 	IMAP *self = (IMAP *) ptr;
+	self->m_idle_timer = INVALID_GTK_WATCH;
 
-	self->try_write();
+	if (self->m_idle != IDLE_OFF) {
+		/* restarted when the server has ended it */
+		self->stop_idle();
+	} else if (self->m_state == S_READY) {
+		self->send_command("NOOP", &IMAP::noop_done);
+	}
+	return FALSE;
+}
 
-	return TRUE;
+int IMAP::status_timeout(gpointer ptr)
+{
+	IMAP *self = (IMAP *) ptr;
+	self->m_status_timer = INVALID_GTK_WATCH;
+
+	if (self->m_state == S_READY) {
+		self->poll_folders();
+	}
+	return FALSE;
+}
+
+void IMAP::noop_done(bool ok)
+{
+	UNUSED(ok);
 }
 
@@ -5,92 +5,257 @@
 #include <stdexcept>
 #include <gtk/gtk.h>
 #include <list>
+#include <map>
+#include <sys/socket.h>
+#include <set>
+#include <vector>
 
 #include "common.h"
+#include "imap_parser.h"
 
-class imap_parse_error: public std::runtime_error {
-public:
-	imap_parse_error(const std::string &what) :
-		std::runtime_error(what)
+/* the counters of a mailbox, from STATUS or SELECT */
+struct Folder_Status {
+	uint32_t uidvalidity;
+	uint32_t uidnext;
+	uint32_t messages;
+	uint64_t highestmodseq;
+
+	Folder_Status() :
+		uidvalidity(0),
+		uidnext(0),
+		messages(0),
+		highestmodseq(0)
 	{}
-};
 
-class imap_need_more: public std::exception {
-public:
-	imap_need_more() {}
+	bool operator ==(const Folder_Status &other) const
+	{
+		return uidvalidity == other.uidvalidity &&
+		       uidnext == other.uidnext &&
+		       messages == other.messages &&
+		       highestmodseq == other.highestmodseq;
+	}
+	bool operator !=(const Folder_Status &other) const
+	{
+		return !(*this == other);
+	}
 };
 
-struct Header_Address {
-	ustring name;
-	ustring email;
-};
+/* a request for one body part */
+struct Part_Request {
+	uint32_t uid;
+	std::string section;
 
-struct Envelope {
-	int id;
-	ustring date;
-	ustring subject;
-	std::list<Header_Address> from;
-	std::list<Header_Address> sender;
-	std::list<Header_Address> reply_to;
-	std::list<Header_Address> to;
-	std::list<Header_Address> cc;
-	std::list<Header_Address> bcc;
-	ustring parent_id;
-	ustring message_id;
+	Part_Request(uint32_t u, const std::string &s) :
+		uid(u),
+		section(s)
+	{}
 };
 
+class Account;
+class Net_Thread;
+
+/*
+ * One connection to an IMAP server. The primary connection of an account
+ * synchronizes the mailbox and fetches bodies. A worker connection only
+ * fetches the envelopes of the UID ranges its account hands out.
+ */
 class IMAP {
 public:
-	IMAP(const std::string &server, const std::string &user,
-	     const std::string &pw);
+	IMAP(Account *account, const std::string &server,
+	     const std::string &user, const std::string &pw, bool worker);
 	~IMAP();
 
 	std::string server() const { return m_server; }
 
+	Sync_State sync_state() const { return m_sync; }
+	void set_sync_state(const Sync_State &state) { m_sync = state; }
+	/* the mailbox to synchronize, INBOX by default */
+	void set_folder(const std::string &name) { m_folder = name; }
+
 	void connect();
-	void fetch_message(int id);
+	void disconnect();
+
+	/* The other connections have fetched the envelopes up to last_uid */
+	void parallel_sync_done(bool ok, uint32_t last_uid);
+
+	/* Fetch a part that the user wants to see, before anything else */
+	void fetch_part(const Part_Request &req);
+	/* Fetch parts in the background when there is nothing else to do */
+	void prefetch(const std::list<Part_Request> &parts);
+	/*
+	 * Search the text of the messages on the server. The UIDs are given
+	 * to the account when they arrive. Returns false if the query can
+	 * not be sent.
+	 */
+	bool search(const std::string &query);
 
 private:
+	/* called when the tagged reply of a command arrives */
+	typedef void (IMAP::*Completion)(bool ok);
+	typedef std::pair<std::string, Completion> Queued_Command;
+
+	/* a connection attempt to one address of the server */
+	struct Attempt {
+		int fd;
+		GIOChannel *channel;
+		int watch;
+	};
+	struct Lookup;
+
 	enum {
 		S_IDLE,
+		/* looking up the addresses and connecting to them */
+		S_RESOLVING,
+		/* the TLS handshake */
 		S_CONNECTING,
 		S_LOGIN,
-		S_SELECT,
-		S_FETCH,
-		S_FETCH_BODY
+		/* the mailbox is selected */
+		S_SYNC,
+		S_READY
 	} m_state;
 
+	Account *m_account;
+	bool m_worker;
 	std::string m_server;
 	std::string m_user;
 	std::string m_pw;
 
-	SSL *m_conn;
-	int m_watch;
-	int m_write_watch;
-	std::string m_send_buf;
-	std::string m_recv_buf;
-	GIOChannel *m_iochannel;
+	Lookup *m_lookup;
+	/* the addresses not tried yet, alternating between the families */
+	std::list<sockaddr_storage> m_addresses;
+	std::list<Attempt> m_attempts;
+	/* the next attempt begins when this fires */
+	int m_attempt_timer;
+	/* when the current step of connecting or syncing began, for stats */
+	uint64_t m_phase_begin;
+
+	/* the TLS stream, NULL when disconnected */
+	Net_Thread *m_net;
+	/* a body part is being handed on while its literal arrives */
+	bool m_streaming;
+	/*
+	 * The part is kept here if the UID is not known before the rest of
+	 * the response.
+	 */
+	bool m_stream_known;
+	std::string m_stream_body;
 	bool m_logged_in;
 	int m_next_cmd_id;
-	int m_next_reply_id;
+	/* the commands in flight, by tag */
+	std::map<int, Completion> m_pending;
+	std::set<std::string> m_capabilities;
+
+	std::string m_folder;
+	/* the folders in the reply to LIST */
+	std::vector<std::string> m_listed;
+	/* the other folders are polled when this fires */
+	int m_status_timer;
+
+	Sync_State m_sync;
+	/* state of the selected mailbox, as reported by the server */
+	Sync_State m_selected;
+	uint32_t m_uidnext;
+	uint32_t m_exists;
+	/* highest UID that was known before the current sync began */
+	uint32_t m_known_uid;
 
-	void send_command(const std::string &cmd);
-	size_t process_recv(const std::string &buf);
-	void ssl_handle_error(int ret);
-	void install_write_watch();
-	void remove_write_watch();
-	void try_read();
-	void try_write();
+	/* parts requested by the user before the mailbox was selected */
+	std::list<Part_Request> m_wanted;
+	std::list<Part_Request> m_prefetch;
+	/* the number of prefetch commands in flight */
+	size_t m_prefetching;
 
-	/* I/O watch callback */
-	static int data_available(GIOChannel *io, GIOCondition cond,
-				  gpointer ptr);
-	static int write_ready(GIOChannel *io, GIOCondition cond, gpointer ptr);
+	/* the UID range a worker is fetching */
+	uint32_t m_range_first;
+	uint32_t m_range_last;
+
+	enum {
+		IDLE_OFF,
+		/* waiting for the continuation */
+		IDLE_STARTING,
+		IDLE_ON,
+		/* DONE has been sent */
+		IDLE_STOPPING
+	} m_idle;
+	int m_idle_timer;
+	/* commands sent while idling */
+	std::list<Queued_Command> m_queued;
+	/* UIDs of the messages by their sequence number, zero if unknown */
+	std::vector<uint32_t> m_seq_uids;
+	/* the queries of the searches in flight, empty for UID SEARCH ALL */
+	std::list<std::string> m_searches;
+	/* UIDs found by the first search in flight */
+	std::vector<uint32_t> m_found;
+	/* the conversations, as threaded by the server */
+	std::vector<Thread_Link> m_threads;
+	bool m_fetching_new;
+	bool m_exists_changed;
+
+	void resolved(GList *addresses);
+	void start_attempt();
+	void attempt_done(int fd);
+	void connect_failed(const char *reason);
+	void cancel_connect();
+	void start_tls(int fd);
+	void send_command(const std::string &cmd, Completion done);
+	static std::string fetch_command(const Part_Request &req,
+					 const char *item);
+	void login_done(bool ok);
+	void capability_done(bool ok);
+	void compress_done(bool ok);
+	void select_mailbox();
+	void select_done(bool ok);
+	void start_sync();
+	void envelopes_done(bool ok);
+	void sync_flags();
+	void flags_done(bool ok);
+	void finish_sync();
+	Folder_Status selected_status() const;
+	void body_done(bool ok);
+	void send_prefetch();
+	void prefetch_done(bool ok);
+	void fetch_next_range();
+	void range_done(bool ok);
+	void worker_failed(const char *reason);
+	void logout_done(bool ok);
+	void maybe_idle();
+	void stop_idle();
+	void idle_done(bool ok);
+	void remove_idle_timer();
+	void fetch_new();
+	void new_done(bool ok);
+	void search_done(bool ok);
+	void text_search_done(bool ok);
+	void thread_done(bool ok);
+	void poll_folders();
+	void list_done(bool ok);
+	void status_done(bool ok);
+	std::string status_items() const;
+	void handle_list(IMAP_Tokenizer &parser);
+	void handle_status(IMAP_Tokenizer &parser);
+	void noop_done(bool ok);
+	void expunged(uint32_t seq);
+	void handle_fetch(uint32_t seq, IMAP_Tokenizer &parser);
+	void handle_fetch(uint32_t seq, Fetch_Reply &reply);
+	void handle_untagged(IMAP_Tokenizer &parser);
+	void handle_response(IMAP_Tokenizer &parser);
+	bool process_events();
+	void begin_stream(uint32_t seq, uint32_t uid, const std::string &section);
+	void stream_data(const std::string &data);
+	void end_stream(bool ok);
+	void connection_lost(const std::string &reason);
+
+	/* called in the main loop when the TLS stream has events */
+	static int net_ready(gpointer ptr);
+	static int idle_timeout(gpointer ptr);
+	static int status_timeout(gpointer ptr);
+	static void lookup_ready(GObject *source, GAsyncResult *result,
+				 gpointer ptr);
+	static int attempt_ready(GIOChannel *io, GIOCondition cond,
+				 gpointer ptr);
+	static int attempt_timeout(gpointer ptr);
 
 	DISABLE_COPY_AND_ASSIGN(IMAP);
 };
 
-void add_message(IMAP *account, const Envelope *env);
-void show_message(const std::string &body);
-
 #endif
@@ -0,0 +1,590 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "imap_parser.h"
+#include "utils.h"
+#include <ctype.h>
+#include <strings.h>
+
+namespace {
+
+bool is_atom(char c)
+{
+	return c != ' ' && c != '\r' && c != '\n' && c != '(' && c != ')' &&
+		c != '{' && c != '[' && c != ']';
+}
+
+bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/* find the next CRLF, starting from the given position */
+size_t find_crlf(const char *data, size_t length, size_t pos)
+{
+	while (pos + 1 < length) {
+		const char *p = (const char *) memchr(&data[pos], '\r',
+						       length - pos - 1);
+		if (p == NULL) {
+			break;
+		}
+		pos = p - data;
+		if (data[pos + 1] == '\n') {
+			return pos;
+		}
+		pos++;
+	}
+	return std::string::npos;
+}
+
+/*
+ * Check whether the line ending at the given position ends with a literal
+ * prefix {N} (or {N+} of LITERAL+), and get N.
+ */
+bool literal_prefix(const char *data, size_t end, size_t *length)
+{
+	if (end == 0 || data[end - 1] != '}') {
+		return false;
+	}
+	size_t i = end - 1;
+	if (i > 0 && data[i - 1] == '+') {
+		i--;
+	}
+	size_t digits_end = i;
+	while (i > 0 && is_digit(data[i - 1])) {
+		i--;
+	}
+	if (i == digits_end || digits_end - i > 9 || i == 0 ||
+	    data[i - 1] != '{') {
+		return false;
+	}
+	*length = 0;
+	for (; i < digits_end; ++i) {
+		*length = *length * 10 + (data[i] - '0');
+	}
+	return true;
+}
+
+/*
+ * The header fields should be ASCII, as non-ASCII text is sent as RFC 2047
+ * encoded words, but some servers pass raw UTF-8 through. Anything else is
+ * replaced with '?', which keeps the text valid UTF-8.
+ */
+std::string to_text(const Str_View &s)
+{
+	size_t i = ascii_prefix(s.data, s.size);
+	std::string out(s.data, s.size);
+	if (i == s.size || is_utf8(&s.data[i], s.size - i)) {
+		return out;
+	}
+	for (; i < out.size(); ++i) {
+		if ((unsigned char) out[i] >= 0x80) {
+			out[i] = '?';
+		}
+	}
+	return out;
+}
+
+Address_List parse_address_list(IMAP_Tokenizer &parser)
+{
+	Address_List addresses;
+	if (parser.skip('(')) {
+		while (!parser.skip(')')) {
+			parser.expect('(');
+			Header_Address addr;
+			addr.name = to_text(parser.string());
+			parser.string(); /* ignored */
+			Str_View mailbox = parser.string();
+			Str_View host = parser.string();
+			addr.email = to_text(mailbox) + '@' + to_text(host);
+			addresses.push_back(addr);
+			parser.expect(')');
+		}
+	} else {
+		/* handle NIL */
+		if (parser.atom() != "NIL") {
+			throw imap_parse_error("Not an address list or a NIL");
+		}
+	}
+	return addresses;
+}
+
+void parse_envelope(IMAP_Tokenizer &parser, Envelope *env)
+{
+	parser.expect('(');
+	env->date = to_text(parser.string());
+	env->subject = to_text(parser.string());
+	env->from = parse_address_list(parser);
+	env->sender = parse_address_list(parser);
+	env->reply_to = parse_address_list(parser);
+	env->to = parse_address_list(parser);
+	env->cc = parse_address_list(parser);
+	env->bcc = parse_address_list(parser);
+	env->parent_id = to_text(parser.string());
+	env->message_id = to_text(parser.string());
+	parser.expect(')');
+}
+
+std::string to_lower(const Str_View &s)
+{
+	std::string out = to_text(s);
+	for (size_t i = 0; i < out.size(); ++i) {
+		out[i] = tolower(out[i]);
+	}
+	return out;
+}
+
+/* skip over any value, used for the extension data of BODYSTRUCTURE */
+void skip_value(IMAP_Tokenizer &parser)
+{
+	if (parser.skip('(')) {
+		while (!parser.skip(')')) {
+			skip_value(parser);
+		}
+	} else if (parser.check('"') || parser.check('{')) {
+		parser.string();
+	} else {
+		parser.atom();
+	}
+}
+
+/*
+ * The parts of a multipart are numbered from 1, and a single part body
+ * is part 1 of the message.
+ */
+void parse_body_struct(IMAP_Tokenizer &parser, Body_Structure *parts,
+		       const std::string &section, unsigned int depth)
+{
+	parser.expect('(');
+	size_t index = parts->size();
+	parts->push_back(Body_Part());
+	(*parts)[index].depth = depth;
+
+	if (parser.check('(')) {
+		/* a sequence of nested body structures */
+		(*parts)[index].section = section;
+		(*parts)[index].type = "multipart";
+		int num = 1;
+		while (parser.check('(')) {
+			std::string sub = strf("%d", num++);
+			if (!section.empty()) {
+				sub = section + '.' + sub;
+			}
+			parse_body_struct(parser, parts, sub, depth + 1);
+		}
+		(*parts)[index].subtype = to_lower(parser.string());
+
+	} else {
+		Body_Part part;
+		part.section = section.empty() ? "1" : section;
+		part.depth = depth;
+		Str_View type = parser.string();
+		Str_View subtype = parser.string();
+		part.type = to_lower(type);
+		part.subtype = to_lower(subtype);
+
+		/* parameter list */
+		if (parser.skip('(')) {
+			while (!parser.skip(')')) {
+				std::string key = to_lower(parser.string());
+				std::string value = to_text(parser.string());
+				if (key == "charset") {
+					part.charset = value;
+				} else if (key == "name") {
+					part.name = value;
+				}
+			}
+		} else {
+			/* handle NIL */
+			if (parser.atom() != "NIL") {
+				throw imap_parse_error("Not a param list or a NIL");
+			}
+		}
+
+		parser.string(); /* id, ignored */
+		parser.string(); /* description, ignored */
+		part.encoding = to_lower(parser.string());
+		part.size = parser.number();
+
+		if (part.type == "text") {
+			parser.number(); /* number of lines, ignored */
+
+		} else if (part.type == "message" && part.subtype == "rfc822") {
+			/* the parts of an attached message are not shown */
+			Envelope env;
+			parse_envelope(parser, &env); /* ignored */
+			parse_body_struct(parser, &env.parts, part.section,
+					  0); /* ignored */
+			parser.number(); /* number of lines, ignored */
+		}
+		(*parts)[index] = part;
+	}
+
+	/* extension data of BODYSTRUCTURE, ignored */
+	while (!parser.skip(')')) {
+		skip_value(parser);
+	}
+}
+
+}
+
+Response_Assembler::Response_Assembler() :
+	m_pos(0),
+	m_literal(0)
+{
+}
+
+size_t Response_Assembler::find_end(const char *data, size_t length)
+{
+	while (m_pos < length) {
+		size_t end = find_crlf(data, length, m_pos);
+		if (end == std::string::npos) {
+			/* the CR might be the last byte we have */
+			m_pos = length > m_pos + 1 ? length - 1 : m_pos;
+			break;
+		}
+		size_t literal;
+		if (!literal_prefix(data, end, &literal)) {
+			return end;
+		}
+		/* skip over the literal, it may contain anything */
+		m_literal = end + 2;
+		m_pos = end + 2 + literal;
+	}
+	return std::string::npos;
+}
+
+bool Response_Assembler::in_literal(size_t length, size_t *begin,
+				    size_t *left) const
+{
+	if (m_literal == 0 || length < m_literal || length >= m_pos) {
+		return false;
+	}
+	*begin = m_literal;
+	*left = m_pos - m_literal;
+	return true;
+}
+
+IMAP_Tokenizer::IMAP_Tokenizer(const char *data, size_t length) :
+	m_begin(data),
+	m_pos(data),
+	m_end(data + length)
+{
+}
+
+void IMAP_Tokenizer::skip_space()
+{
+	while (m_pos < m_end && *m_pos == ' ') {
+		m_pos++;
+	}
+}
+
+bool IMAP_Tokenizer::check(char token)
+{
+	skip_space();
+	return m_pos < m_end && *m_pos == token;
+}
+
+bool IMAP_Tokenizer::skip(char token)
+{
+	if (check(token)) {
+		m_pos++;
+		return true;
+	}
+	return false;
+}
+
+void IMAP_Tokenizer::expect(char token)
+{
+	if (!skip(token)) {
+		throw imap_parse_error(strf("Expected token %c", token));
+	}
+}
+
+bool IMAP_Tokenizer::check_digit()
+{
+	skip_space();
+	return m_pos < m_end && is_digit(*m_pos);
+}
+
+bool IMAP_Tokenizer::at_end()
+{
+	skip_space();
+	return m_pos == m_end;
+}
+
+uint64_t IMAP_Tokenizer::number()
+{
+	if (!check_digit()) {
+		throw imap_parse_error("Expected a number");
+	}
+	uint64_t value = 0;
+	while (m_pos < m_end && is_digit(*m_pos)) {
+		uint64_t next = value * 10 + (*m_pos - '0');
+		if (next / 10 != value) {
+			throw imap_parse_error("Too large number");
+		}
+		value = next;
+		m_pos++;
+	}
+	return value;
+}
+
+Str_View IMAP_Tokenizer::atom()
+{
+	skip_space();
+	const char *begin = m_pos;
+	while (m_pos < m_end && is_atom(*m_pos)) {
+		m_pos++;
+	}
+	if (m_pos == begin) {
+		throw imap_parse_error("Expected an atom string");
+	}
+	return Str_View(begin, m_pos - begin);
+}
+
+Str_View IMAP_Tokenizer::string()
+{
+	if (skip('{')) {
+		/* a literal string, with length of the string as a prefix */
+		if (!check_digit()) {
+			throw imap_parse_error("Invalid literal length");
+		}
+		uint64_t length = number();
+		expect('}');
+
+		/*
+		 * The content of the string is after a CRLF. The response is
+		 * complete, so a short literal means a broken response.
+		 */
+		if (m_end - m_pos < 2 || m_pos[0] != '\r' || m_pos[1] != '\n') {
+			throw imap_parse_error("Expected a CRLF");
+		}
+		m_pos += 2;
+
+		if (uint64_t(m_end - m_pos) < length) {
+			throw imap_parse_error("Truncated literal");
+		}
+		Str_View out(m_pos, length);
+		m_pos += length;
+		return out;
+
+	} else if (skip('"')) {
+		/* a quoted string */
+		const char *begin = m_pos;
+		bool escaped = false;
+		while (m_pos < m_end && *m_pos != '"') {
+			if (*m_pos == '\\') {
+				/* Escaped char, used by Gmail's IMAP server */
+				escaped = true;
+				m_pos++;
+				if (m_pos == m_end ||
+				    !(*m_pos == '"' || *m_pos == '\\')) {
+					throw imap_parse_error("Invalid escaped char");
+				}
+			}
+			m_pos++;
+		}
+		if (m_pos == m_end) {
+			throw imap_parse_error("Unterminated string");
+		}
+		Str_View out(begin, m_pos - begin);
+		m_pos++;
+
+		if (escaped) {
+			std::string unescaped;
+			for (size_t i = 0; i < out.size; ++i) {
+				if (out.data[i] == '\\') {
+					i++;
+				}
+				unescaped += out.data[i];
+			}
+			m_unescaped.push_back(unescaped);
+			out = Str_View(m_unescaped.back().data(), unescaped.size());
+		}
+		return out;
+
+	} else {
+		/* handle NIL */
+		if (atom() != "NIL") {
+			throw imap_parse_error("Not a string or a NIL");
+		}
+		return Str_View();
+	}
+}
+
+unsigned int parse_flags(IMAP_Tokenizer &parser)
+{
+	const struct {
+		const char *name;
+		unsigned int flag;
+	} flag_names[] = {
+		{"\\Seen", FLAG_SEEN},
+		{"\\Answered", FLAG_ANSWERED},
+		{"\\Flagged", FLAG_FLAGGED},
+		{"\\Deleted", FLAG_DELETED},
+		{"\\Draft", FLAG_DRAFT},
+		{NULL, 0}
+	};
+
+	unsigned int flags = 0;
+	parser.expect('(');
+	while (!parser.skip(')')) {
+		Str_View flag = parser.atom();
+		for (int i = 0; flag_names[i].name; ++i) {
+			if (strlen(flag_names[i].name) == flag.size &&
+			    strncasecmp(flag.data, flag_names[i].name,
+					flag.size) == 0) {
+				flags |= flag_names[i].flag;
+			}
+		}
+	}
+	return flags;
+}
+
+namespace {
+
+void parse_thread(IMAP_Tokenizer &parser, uint32_t parent,
+		  std::vector<Thread_Link> *links)
+{
+	parser.expect('(');
+	/* each message replies to the previous one */
+	while (parser.check_digit()) {
+		uint32_t uid = parser.number();
+		links->push_back(Thread_Link(uid, parent));
+		parent = uid;
+	}
+	/* and the rest branch from the last one */
+	while (parser.check('(')) {
+		parse_thread(parser, parent, links);
+	}
+	parser.expect(')');
+}
+
+}
+
+void parse_threads(IMAP_Tokenizer &parser, std::vector<Thread_Link> *links)
+{
+	while (parser.check('(')) {
+		parse_thread(parser, 0, links);
+	}
+}
+
+void parse_fetch_reply(IMAP_Tokenizer &parser, Fetch_Reply *reply)
+{
+	Envelope *env = &reply->env;
+	reply->items = 0;
+	env->uid = 0;
+	env->flags = 0;
+	parser.expect('(');
+	while (!parser.skip(')')) {
+		Str_View type = parser.atom();
+
+		if (type == "UID") {
+			env->uid = parser.number();
+
+		} else if (type == "MODSEQ") {
+			parser.expect('(');
+			parser.number(); /* ignored */
+			parser.expect(')');
+
+		} else if (type == "INTERNALDATE") {
+			parser.string(); /* ignored */
+
+		} else if (type == "RFC822.SIZE") {
+			parser.number(); /* ignored */
+
+		} else if (type == "FLAGS") {
+			env->flags = parse_flags(parser);
+			reply->items |= Fetch_Reply::F_FLAGS;
+
+		} else if (type == "ENVELOPE") {
+			parse_envelope(parser, env);
+			reply->items |= Fetch_Reply::F_ENVELOPE;
+
+		} else if (type == "BODY" && parser.skip('[')) {
+			reply->section.clear();
+			if (!parser.check(']')) {
+				reply->section = parser.atom().str();
+			}
+			parser.expect(']');
+			reply->body = parser.string().str();
+			reply->items |= Fetch_Reply::F_BODY;
+
+		} else if (type == "BODY" || type == "BODYSTRUCTURE") {
+			env->parts.clear();
+			parse_body_struct(parser, &env->parts, "", 0);
+
+		} else {
+			debug("unknown fetch field: %s\n", type.str().c_str());
+		}
+	}
+}
+
+const Body_Part *find_text_part(const Body_Structure &parts)
+{
+	const Body_Part *html = NULL;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		const Body_Part *part = &parts[i];
+		if (part->type != "text" || !part->name.empty()) {
+			continue;
+		}
+		if (part->subtype == "plain") {
+			return part;
+		}
+		if (part->subtype == "html" && html == NULL) {
+			html = part;
+		}
+	}
+	return html;
+}
+
+bool parse_part_prefix(const char *data, size_t length, uint32_t *seq,
+		       uint32_t *uid, std::string *section)
+{
+	/* leave out the literal prefix */
+	while (length > 0 && data[length - 1] != '{') {
+		length--;
+	}
+	if (length == 0) {
+		return false;
+	}
+	IMAP_Tokenizer parser(data, length - 1);
+	*uid = 0;
+	try {
+		parser.expect('*');
+		*seq = parser.number();
+		if (parser.atom() != "FETCH") {
+			return false;
+		}
+		parser.expect('(');
+		while (1) {
+			Str_View type = parser.atom();
+			if (type == "UID") {
+				*uid = parser.number();
+			} else if (type == "FLAGS") {
+				parse_flags(parser);
+			} else if (type == "MODSEQ") {
+				parser.expect('(');
+				parser.number();
+				parser.expect(')');
+			} else if (type == "BODY" && parser.skip('[')) {
+				section->clear();
+				if (!parser.check(']')) {
+					*section = parser.atom().str();
+				}
+				parser.expect(']');
+				/* the literal must come right after */
+				return parser.at_end();
+			} else {
+				return false;
+			}
+		}
+	} catch (const imap_parse_error &) {
+		return false;
+	}
+}
@@ -0,0 +1,249 @@
+/*
+ * Parser for IMAP server responses
+ */
+#ifndef _IMAP_PARSER_H
+#define _IMAP_PARSER_H
+
+#include "common.h"
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <string.h>
+
+class imap_parse_error: public std::runtime_error {
+public:
+	imap_parse_error(const std::string &what) :
+		std::runtime_error(what)
+	{}
+};
+
+/* the text fields are UTF-8 */
+struct Header_Address {
+	std::string name;
+	std::string email;
+};
+
+typedef std::vector<Header_Address> Address_List;
+
+/* message flags */
+enum {
+	FLAG_SEEN = 1 << 0,
+	FLAG_ANSWERED = 1 << 1,
+	FLAG_FLAGGED = 1 << 2,
+	FLAG_DELETED = 1 << 3,
+	FLAG_DRAFT = 1 << 4
+};
+
+/* one part in the MIME structure of a message */
+struct Body_Part {
+	/* the part specifier to fetch it with, such as "1.2" */
+	std::string section;
+	/* in lower case, such as "text" and "plain" */
+	std::string type;
+	std::string subtype;
+	std::string charset;
+	/* the content transfer encoding, in lower case */
+	std::string encoding;
+	/* the name parameter of the type, usually the name of an attachment */
+	std::string name;
+	uint32_t size;
+	/* the number of multiparts this part is nested in */
+	unsigned int depth;
+
+	Body_Part() :
+		size(0),
+		depth(0)
+	{}
+};
+
+/*
+ * The parts of a message in depth-first order, each multipart followed by
+ * its parts. Empty if the structure is not known.
+ */
+typedef std::vector<Body_Part> Body_Structure;
+
+struct Envelope {
+	uint32_t uid;
+	unsigned int flags;
+	std::string date;
+	std::string subject;
+	Address_List from;
+	Address_List sender;
+	Address_List reply_to;
+	Address_List to;
+	Address_List cc;
+	Address_List bcc;
+	std::string parent_id;
+	std::string message_id;
+	Body_Structure parts;
+};
+
+/*
+ * What we know about the mailbox since the last synchronization. The UIDs
+ * are only valid as long as the UIDVALIDITY of the mailbox stays the same.
+ */
+struct Sync_State {
+	uint32_t uidvalidity;
+	uint32_t last_uid;
+	uint64_t highestmodseq;
+
+	Sync_State() :
+		uidvalidity(0),
+		last_uid(0),
+		highestmodseq(0)
+	{}
+};
+
+/* the data items of one FETCH response */
+struct Fetch_Reply {
+	enum {
+		F_ENVELOPE = 1 << 0,
+		F_FLAGS = 1 << 1,
+		F_BODY = 1 << 2
+	};
+	/* which of the items below were present */
+	unsigned int items;
+	Envelope env;
+	/* BODY[section] */
+	std::string section;
+	std::string body;
+
+	Fetch_Reply() :
+		items(0)
+	{}
+};
+
+/*
+ * A reference to a part of a buffer. The referenced buffer must stay alive
+ * and unmodified as long as the view is used.
+ */
+struct Str_View {
+	const char *data;
+	size_t size;
+
+	Str_View() :
+		data(NULL),
+		size(0)
+	{}
+	Str_View(const char *d, size_t s) :
+		data(d),
+		size(s)
+	{}
+
+	bool empty() const { return size == 0; }
+	std::string str() const { return std::string(data, size); }
+
+	bool operator ==(const char *s) const
+	{
+		return strlen(s) == size && memcmp(data, s, size) == 0;
+	}
+	bool operator !=(const char *s) const { return !(*this == s); }
+};
+
+/*
+ * Splits one complete IMAP response into tokens. The returned views point
+ * directly to the response data, so nothing is copied unless a quoted
+ * string contains escaped characters.
+ */
+class IMAP_Tokenizer {
+public:
+	IMAP_Tokenizer(const char *data, size_t length);
+
+	/* check whether the next token is the given one */
+	bool check(char token);
+	bool skip(char token);
+	void expect(char token);
+	/* check whether the next token is a number */
+	bool check_digit();
+	/* check whether there are no more tokens */
+	bool at_end();
+
+	uint64_t number();
+	/* an IMAP string consisting of atom characters */
+	Str_View atom();
+	/* a quoted or a literal IMAP string, or a NIL */
+	Str_View string();
+
+	/* the whole response, for error messages */
+	Str_View response() const { return Str_View(m_begin, m_end - m_begin); }
+
+private:
+	const char *m_begin;
+	const char *m_pos;
+	const char *m_end;
+	/* storage for unescaped quoted strings */
+	std::list<std::string> m_unescaped;
+
+	void skip_space();
+
+	DISABLE_COPY_AND_ASSIGN(IMAP_Tokenizer);
+};
+
+/*
+ * Finds the boundaries of IMAP responses in a receive buffer. A response
+ * ends at a CRLF, unless the line ends with a literal prefix {N}, in which
+ * case the next N bytes belong to the response no matter what they
+ * contain. The scan position is remembered between calls, so data that
+ * arrives in small chunks is only looked at once.
+ */
+class Response_Assembler {
+public:
+	Response_Assembler();
+
+	/*
+	 * Returns the length of the response that begins at the start of the
+	 * data (excluding the final CRLF), or std::string::npos if it has not
+	 * been received completely yet.
+	 */
+	size_t find_end(const char *data, size_t length);
+
+	/* Called when the response has been consumed from the buffer */
+	void reset() { m_pos = 0; m_literal = 0; }
+
+	/*
+	 * If the data received so far ends inside a literal, get where the
+	 * literal begins and how many bytes of it are left, counting the
+	 * ones already in the buffer.
+	 */
+	bool in_literal(size_t length, size_t *begin, size_t *left) const;
+
+	/* Called when bytes at the beginning of the literal have been removed */
+	void remove_literal(size_t count) { m_pos -= count; }
+
+private:
+	/* where to continue scanning, relative to the start of the response */
+	size_t m_pos;
+	/* the beginning of the latest literal, zero if none */
+	size_t m_literal;
+};
+
+unsigned int parse_flags(IMAP_Tokenizer &parser);
+void parse_fetch_reply(IMAP_Tokenizer &parser, Fetch_Reply *reply);
+
+/* a message and the one it replies to, zero if it begins a conversation */
+typedef std::pair<uint32_t, uint32_t> Thread_Link;
+
+/*
+ * The threads of a THREAD response (RFC 5256), such as
+ * "(2)(3 6 (4 23)(44 7 96))", as links from each message to its parent.
+ */
+void parse_threads(IMAP_Tokenizer &parser, std::vector<Thread_Link> *links);
+
+/*
+ * The part to show as the text of a message: the first text/plain part
+ * that is not an attachment, or failing that, the first text/html part.
+ * Returns NULL if there is neither.
+ */
+const Body_Part *find_text_part(const Body_Structure &parts);
+
+/*
+ * Check whether the beginning of a response (up to a literal prefix) is a
+ * FETCH response where the literal is the contents of a body part, such as
+ * "* 1 FETCH (UID 2 BODY[1] {1000}". The UID is zero if it has not been
+ * given before the part.
+ */
+bool parse_part_prefix(const char *data, size_t length, uint32_t *seq,
+		       uint32_t *uid, std::string *section);
+
+#endif
@@ -6,7 +6,12 @@
  * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
  */
 #include "ioutils.h"
+#include "stats.h"
+#include <algorithm>
+#include <new>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 
 int set_nonblock(int fd, bool enabled)
 {
@@ -16,3 +21,63 @@ int set_nonblock(int fd, bool enabled)
 	}
 	return fcntl(fd, F_SETFL, flags);
 }
+
+IO_Buffer::IO_Buffer() :
+	m_data(NULL),
+	m_capacity(0),
+	m_begin(0),
+	m_end(0)
+{
+}
+
+IO_Buffer::~IO_Buffer()
+{
+	free(m_data);
+}
+
+char *IO_Buffer::reserve(size_t length)
+{
+	if (m_capacity - m_end >= length) {
+		return m_data + m_end;
+	}
+	size_t used = m_end - m_begin;
+	if (m_capacity - used < length || used > m_capacity / 2) {
+		/* grow, so that there is always room to move into */
+		size_t capacity = std::max(m_capacity * 2, size_t(4096));
+		while (capacity - used < length) {
+			capacity *= 2;
+		}
+		char *data = (char *) malloc(capacity);
+		if (data == NULL) {
+			throw std::bad_alloc();
+		}
+		stats_add(STAT_BUFFER_ALLOCS);
+		stats_add(STAT_BUFFER_BYTES, capacity);
+		if (used > 0) {
+			memcpy(data, m_data + m_begin, used);
+		}
+		free(m_data);
+		m_data = data;
+		m_capacity = capacity;
+	} else {
+		memmove(m_data, m_data + m_begin, used);
+	}
+	m_begin = 0;
+	m_end = used;
+	return m_data + m_end;
+}
+
+void IO_Buffer::append(const char *data, size_t length)
+{
+	memcpy(reserve(length), data, length);
+	commit(length);
+}
+
+void IO_Buffer::consume(size_t length)
+{
+	m_begin += length;
+	if (m_begin == m_end) {
+		/* start over from the beginning when empty */
+		m_begin = m_end = 0;
+	}
+}
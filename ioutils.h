@@ -1,6 +1,48 @@
 #ifndef _IOUTILS_H
 #define _IOUTILS_H
 
+#include "common.h"
+
 int set_nonblock(int fd, bool enabled);
 
+/*
+ * A byte buffer for the data of a connection. Consuming from the front only
+ * advances an offset, and the contents are moved back to the beginning
+ * when more space is needed. The contents stay contiguous, so they can be
+ * parsed in place, and each byte is moved only a few times on average.
+ */
+class IO_Buffer {
+public:
+	IO_Buffer();
+	~IO_Buffer();
+
+	const char *data() const { return m_data + m_begin; }
+	char *data() { return m_data + m_begin; }
+	size_t size() const { return m_end - m_begin; }
+	bool empty() const { return m_begin == m_end; }
+
+	/*
+	 * Get space for at least the given number of bytes at the end. The
+	 * bytes that were written there are added with commit().
+	 */
+	char *reserve(size_t length);
+	void commit(size_t length) { m_end += length; }
+
+	void append(const char *data, size_t length);
+	void append(const std::string &s) { append(s.data(), s.size()); }
+
+	/* remove bytes from the front, or everything after the given size */
+	void consume(size_t length);
+	void truncate(size_t size) { m_end = m_begin + size; }
+	void clear() { m_begin = m_end = 0; }
+
+private:
+	char *m_data;
+	size_t m_capacity;
+	size_t m_begin;
+	size_t m_end;
+
+	DISABLE_COPY_AND_ASSIGN(IO_Buffer);
+};
+
 #endif
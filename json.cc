@@ -6,13 +6,61 @@
  * See LICENSE file for license.
  */
 #include "json.h"
+#include "stats.h"
+#include "utils.h"
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sstream>
 #include <assert.h>
 
 namespace {
 
+/* the size of the arena blocks, larger allocations get their own block */
+const size_t ARENA_BLOCK = 64 * 1024;
+
+/*
+ * Every node starts with a header telling where it was allocated from, as
+ * a node may be freed after its arena is no longer the current one.
+ */
+union Node_Header {
+	size_t from_arena;
+	double align_double;
+	long align_long;
+	void *align_ptr;
+};
+
+/* large enough to hold any member of the JSON_Value union */
+union Payload {
+	bool b;
+	void *p;
+	long i;
+	double f;
+};
+
+const JSON_Value null_value;
+
+template<class T>
+T *create()
+{
+	return new (JSON_Arena::allocate_node(sizeof(T))) T;
+}
+
+template<class T>
+T *create(const T &from)
+{
+	return new (JSON_Arena::allocate_node(sizeof(T))) T(from);
+}
+
+template<class T>
+void destroy(T *obj)
+{
+	obj->~T();
+	JSON_Arena::free_node(obj);
+}
+
 /* should match the enum JSON_Value::Type */
 const char *type_names[] = {
 	NULL,
@@ -26,35 +74,6 @@ const char *type_names[] = {
 	NULL
 };
 
-/*
- * FAST conversion from ASCII to unicode. Invalid characters are replaced
- * with '?'.
- */
-ustring to_unicode(const std::string &in)
-{
-	ustring out(in.size(), 0);
-	for (size_t i = 0; i < in.size(); ++i) {
-		unsigned char c = in[i];
-		if (c >= 128) {
-			c = '?';
-		}
-		out[i] = c;
-	}
-	return out;
-}
-
-std::string strf(const char *fmt, ...)
-{
-	va_list args;
-	va_start(args, fmt);
-	char buffer[1024];
-	if (vsnprintf(buffer, sizeof buffer, fmt, args) >= int(sizeof buffer)) {
-		throw std::runtime_error("strf() buffer overflow");
-	}
-	va_end(args);
-	return buffer;
-}
-
 /* check whether the next token is the given one */
 bool check(std::basic_istream<uint32_t> &is, char token)
 {
@@ -169,7 +188,8 @@ std::string parse_number(std::basic_istream<uint32_t> &is)
 }
 
 /* read a quoted string (while converting escaped characters) */
-ustring parse_string(std::basic_istream<uint32_t> &is)
+template<class String>
+void parse_string(std::basic_istream<uint32_t> &is, String *out)
 {
 	expect(is, '"');
 
@@ -179,7 +199,6 @@ ustring parse_string(std::basic_istream<uint32_t> &is)
 	table['\"'] = '"';
 	table['\\'] = '\\';
 
-	ustring out;
 	unsigned int c = is.get();
 	while (!is.eof() && c != '"') {
 		if (c == '\\') {
@@ -200,13 +219,130 @@ ustring parse_string(std::basic_istream<uint32_t> &is)
 				c = '?';
 			}
 		}
-		out += c;
+		*out += c;
 		c = is.get();
 	}
 	if (is.eof()) {
 		throw json_parse_error("Unterminated string");
 	}
-	return out;
+}
+
+/* character classes for scanning UTF-8 */
+enum {
+	C_SPACE = 1 << 0,
+	/* ends a run of plain characters in a string */
+	C_STRING_END = 1 << 1,
+	C_DIGIT = 1 << 2,
+	C_ALPHA = 1 << 3
+};
+
+struct Char_Classes {
+	unsigned char table[256];
+
+	Char_Classes()
+	{
+		for (int c = 0; c < 256; ++c) {
+			table[c] = 0;
+			if (c < 128 && isspace(c))
+				table[c] |= C_SPACE;
+			if (c == '"' || c == '\\' || c >= 0x80)
+				table[c] |= C_STRING_END;
+			if (c < 128 && isdigit(c))
+				table[c] |= C_DIGIT;
+			if (c < 128 && isalnum(c))
+				table[c] |= C_ALPHA;
+		}
+	}
+	bool is(char c, int cls) const
+	{
+		return table[(unsigned char) c] & cls;
+	}
+};
+
+const Char_Classes char_classes;
+
+/* decode one UTF-8 sequence, invalid sequences are replaced with '?' */
+uint32_t decode_utf8(const char *&pos, const char *end)
+{
+	unsigned char c = *pos++;
+	int extra;
+	uint32_t value;
+	if (c < 0x80) {
+		return c;
+	} else if ((c & 0xe0) == 0xc0) {
+		extra = 1;
+		value = c & 0x1f;
+	} else if ((c & 0xf0) == 0xe0) {
+		extra = 2;
+		value = c & 0x0f;
+	} else if ((c & 0xf8) == 0xf0) {
+		extra = 3;
+		value = c & 0x07;
+	} else {
+		return '?';
+	}
+	if (end - pos < extra) {
+		pos = end;
+		return '?';
+	}
+	for (int i = 0; i < extra; ++i) {
+		c = *pos;
+		if ((c & 0xc0) != 0x80) {
+			return '?';
+		}
+		value = (value << 6) | (c & 0x3f);
+		pos++;
+	}
+	return value;
+}
+
+void encode_utf8(std::string &out, uint32_t c)
+{
+	if (c < 0x80) {
+		out += char(c);
+	} else if (c < 0x800) {
+		out += char(0xc0 | (c >> 6));
+		out += char(0x80 | (c & 0x3f));
+	} else if (c < 0x10000) {
+		out += char(0xe0 | (c >> 12));
+		out += char(0x80 | ((c >> 6) & 0x3f));
+		out += char(0x80 | (c & 0x3f));
+	} else {
+		out += char(0xf0 | (c >> 18));
+		out += char(0x80 | ((c >> 12) & 0x3f));
+		out += char(0x80 | ((c >> 6) & 0x3f));
+		out += char(0x80 | (c & 0x3f));
+	}
+}
+
+/* same escapes as escape() below, but written as UTF-8 */
+template<class String>
+void escape_utf8(std::string &out, const String &in)
+{
+	for (size_t i = 0; i < in.size(); ++i) {
+		uint32_t c = in[i];
+		switch (c) {
+		case '\n':
+			out += "\\n";
+			break;
+		case '\r':
+			out += "\\r";
+			break;
+		case '"':
+			out += "\\\"";
+			break;
+		case '\\':
+			out += "\\\\";
+			break;
+		default:
+			if (c < 32) {
+				out += strf("\\u%04x", c);
+			} else {
+				encode_utf8(out, c);
+			}
+			break;
+		}
+	}
 }
 
 ustring escape(const ustring &in)
@@ -239,6 +375,297 @@ ustring escape(const ustring &in)
 
 }
 
+/* Reads JSON tokens from a UTF-8 buffer */
+class JSON_Reader {
+public:
+	JSON_Reader(const char *data, size_t length) :
+		m_begin(data),
+		m_pos(data),
+		m_end(data + length)
+	{
+	}
+
+	size_t consumed() const { return m_pos - m_begin; }
+
+	/* returns the next character, or -1 at the end of the input */
+	int peek()
+	{
+		skip_space();
+		if (m_pos == m_end) {
+			return -1;
+		}
+		return (unsigned char) *m_pos;
+	}
+
+	bool skip(char token)
+	{
+		if (peek() == token) {
+			m_pos++;
+			return true;
+		}
+		return false;
+	}
+
+	void expect(char token)
+	{
+		if (!skip(token)) {
+			throw json_parse_error(strf("Expected token %c", token));
+		}
+	}
+
+	/* a JSON word (a sequence of alphanumeric chars) */
+	std::string word()
+	{
+		const char *begin = m_pos;
+		while (m_pos < m_end && char_classes.is(*m_pos, C_ALPHA)) {
+			m_pos++;
+		}
+		return std::string(begin, m_pos);
+	}
+
+	/* the characters of a JSON number */
+	std::string number();
+
+	/* a quoted string, decoded to unicode */
+	template<class String>
+	void string(String *out);
+
+private:
+	const char *m_begin;
+	const char *m_pos;
+	const char *m_end;
+
+	void skip_space()
+	{
+		while (m_pos < m_end && char_classes.is(*m_pos, C_SPACE)) {
+			m_pos++;
+		}
+	}
+
+	void digits()
+	{
+		while (m_pos < m_end && char_classes.is(*m_pos, C_DIGIT)) {
+			m_pos++;
+		}
+	}
+
+	uint32_t hex4();
+};
+
+std::string JSON_Reader::number()
+{
+	const char *begin = m_pos;
+	if (m_pos < m_end && *m_pos == '-') {
+		m_pos++;
+	}
+	if (m_pos == m_end || !char_classes.is(*m_pos, C_DIGIT)) {
+		throw json_parse_error("Expected a digit");
+	}
+	digits();
+
+	/* decimal part */
+	if (m_pos < m_end && *m_pos == '.') {
+		m_pos++;
+		digits();
+	}
+
+	/* exponent */
+	if (m_pos < m_end && (*m_pos == 'e' || *m_pos == 'E')) {
+		m_pos++;
+		if (m_pos < m_end && (*m_pos == '-' || *m_pos == '+')) {
+			m_pos++;
+		}
+		if (m_pos == m_end || !char_classes.is(*m_pos, C_DIGIT)) {
+			throw json_parse_error("Expected a digit in exponent");
+		}
+		digits();
+	}
+	return std::string(begin, m_pos);
+}
+
+uint32_t JSON_Reader::hex4()
+{
+	if (m_end - m_pos < 4) {
+		throw json_parse_error("Invalid escaped char");
+	}
+	uint32_t value = 0;
+	for (int i = 0; i < 4; ++i) {
+		char c = *m_pos++;
+		value <<= 4;
+		if (c >= '0' && c <= '9') {
+			value |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			value |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			value |= c - 'A' + 10;
+		} else {
+			throw json_parse_error("Invalid escaped char");
+		}
+	}
+	return value;
+}
+
+template<class String>
+void JSON_Reader::string(String *out)
+{
+	expect('"');
+	while (1) {
+		/* a run of plain ASCII is copied as it is */
+		const char *begin = m_pos;
+		while (m_pos < m_end && !char_classes.is(*m_pos, C_STRING_END)) {
+			m_pos++;
+		}
+		out->append(begin, m_pos);
+		if (m_pos == m_end) {
+			throw json_parse_error("Unterminated string");
+		}
+
+		char c = *m_pos;
+		if (c == '"') {
+			m_pos++;
+			return;
+		} else if (c != '\\') {
+			*out += decode_utf8(m_pos, m_end);
+			continue;
+		}
+
+		/* An escaped character */
+		m_pos++;
+		if (m_pos == m_end) {
+			throw json_parse_error("Invalid escaped char");
+		}
+		c = *m_pos++;
+		switch (c) {
+		case 'n':
+			*out += '\n';
+			break;
+		case 'r':
+			*out += '\r';
+			break;
+		case 't':
+			*out += '\t';
+			break;
+		case 'b':
+			*out += '\b';
+			break;
+		case 'f':
+			*out += '\f';
+			break;
+		case '"':
+		case '\\':
+		case '/':
+			*out += c;
+			break;
+		case 'u': {
+				uint32_t value = hex4();
+				if (value < 0xd800 || value >= 0xe000) {
+					*out += value;
+					break;
+				}
+				/* a surrogate pair, an unpaired half is replaced */
+				const char *next = m_pos;
+				uint32_t low = 0;
+				if (value < 0xdc00 && m_end - m_pos >= 6 &&
+				    m_pos[0] == '\\' && m_pos[1] == 'u') {
+					m_pos += 2;
+					low = hex4();
+				}
+				if (low >= 0xdc00 && low < 0xe000) {
+					*out += 0x10000 + ((value - 0xd800) << 10) +
+						(low - 0xdc00);
+				} else {
+					/* the next escape is read on its own */
+					m_pos = next;
+					*out += '?';
+				}
+			}
+			break;
+		default:
+			throw json_parse_error("Invalid escaped char");
+		}
+	}
+}
+
+JSON_Arena *JSON_Arena::current = NULL;
+
+JSON_Arena::JSON_Arena() :
+	m_pos(NULL),
+	m_left(0)
+{
+}
+
+JSON_Arena::~JSON_Arena()
+{
+	for (size_t i = 0; i < m_blocks.size(); ++i) {
+		free(m_blocks[i]);
+	}
+}
+
+void *JSON_Arena::allocate(size_t size)
+{
+	size = (size + sizeof(Node_Header) - 1) & ~(sizeof(Node_Header) - 1);
+	if (size > ARENA_BLOCK / 4) {
+		char *block = (char *) malloc(size);
+		if (block == NULL) {
+			throw std::bad_alloc();
+		}
+		stats_add(STAT_JSON_ALLOCS);
+		stats_add(STAT_JSON_BYTES, size);
+		m_blocks.push_back(block);
+		return block;
+	}
+	if (size > m_left) {
+		m_pos = (char *) malloc(ARENA_BLOCK);
+		if (m_pos == NULL) {
+			throw std::bad_alloc();
+		}
+		stats_add(STAT_JSON_ALLOCS);
+		stats_add(STAT_JSON_BYTES, ARENA_BLOCK);
+		m_blocks.push_back(m_pos);
+		m_left = ARENA_BLOCK;
+	}
+	void *ptr = m_pos;
+	m_pos += size;
+	m_left -= size;
+	return ptr;
+}
+
+void *JSON_Arena::allocate_node(size_t size)
+{
+	Node_Header *hdr;
+	if (current != NULL) {
+		hdr = (Node_Header *) current->allocate(sizeof *hdr + size);
+		hdr->from_arena = 1;
+	} else {
+		hdr = (Node_Header *) malloc(sizeof *hdr + size);
+		if (hdr == NULL) {
+			throw std::bad_alloc();
+		}
+		hdr->from_arena = 0;
+	}
+	return hdr + 1;
+}
+
+void JSON_Arena::free_node(void *ptr)
+{
+	Node_Header *hdr = (Node_Header *) ptr - 1;
+	/* the memory of an arena is only freed with the arena */
+	if (!hdr->from_arena) {
+		free(hdr);
+	}
+}
+
+JSON_Arena::Scope::Scope(JSON_Arena *arena) :
+	m_prev(current)
+{
+	current = arena;
+}
+
+JSON_Arena::Scope::~Scope()
+{
+	current = m_prev;
+}
+
 JSON_Value::JSON_Value() :
 	m_type(NULL_VALUE)
 {
@@ -247,13 +674,14 @@ JSON_Value::JSON_Value() :
 JSON_Value::JSON_Value(const ustring &s) :
 	m_type(STRING)
 {
-	m_string = new ustring(s);
+	m_string = create(String(s.begin(), s.end()));
 }
 
 JSON_Value::JSON_Value(const std::string &s) :
 	m_type(STRING)
 {
-	m_string = new ustring(to_unicode(s));
+	ustring u = to_unicode(s);
+	m_string = create(String(u.begin(), u.end()));
 }
 
 JSON_Value::JSON_Value(long value) :
@@ -287,10 +715,10 @@ JSON_Value::JSON_Value(Type type) :
 	case NULL_VALUE:
 		break;
 	case OBJECT:
-		m_children = new std::map<ustring, JSON_Value>;
+		m_children = create<Object>();
 		break;
 	case ARRAY:
-		m_array = new std::list<JSON_Value>;
+		m_array = create<Array>();
 		break;
 	default:
 		assert(0);
@@ -312,13 +740,13 @@ void JSON_Value::clear()
 		/* do nothing */
 		break;
 	case STRING:
-		delete m_string;
+		destroy(m_string);
 		break;
 	case OBJECT:
-		delete m_children;
+		destroy(m_children);
 		break;
 	case ARRAY:
-		delete m_array;
+		destroy(m_array);
 		break;
 	default:
 		assert(0);
@@ -387,10 +815,10 @@ ustring JSON_Value::to_string() const
 			std::string("expected a string, but got JSON type ") +
 			type_names[m_type]);
 	}
-	return *m_string;
+	return ustring(m_string->begin(), m_string->end());
 }
 
-std::map<ustring, JSON_Value> JSON_Value::children() const
+const JSON_Value::Object &JSON_Value::children() const
 {
 	if (m_type != OBJECT) {
 		throw std::runtime_error(
@@ -400,7 +828,7 @@ std::map<ustring, JSON_Value> JSON_Value::children() const
 	return *m_children;
 }
 
-std::list<JSON_Value> JSON_Value::array() const
+const JSON_Value::Array &JSON_Value::array() const
 {
 	if (m_type != ARRAY) {
 		throw std::runtime_error(
@@ -410,32 +838,22 @@ std::list<JSON_Value> JSON_Value::array() const
 	return *m_array;
 }
 
-JSON_Value JSON_Value::get(const ustring &key) const
+const JSON_Value &JSON_Value::get(const ustring &key) const
 {
 	if (m_type != OBJECT) {
 		throw std::runtime_error(
 			std::string("expected an object, but got JSON type ") +
 			type_names[m_type]);
 	}
-	std::map<ustring, JSON_Value>::const_iterator i
-		= m_children->find(key);
+	Object::const_iterator i = m_children->find(key);
 	if (i == m_children->end())
-		return JSON_Value();
+		return null_value;
 	return i->second;
 }
 
-JSON_Value JSON_Value::get(const std::string &key) const
+const JSON_Value &JSON_Value::get(const std::string &key) const
 {
-	if (m_type != OBJECT) {
-		throw std::runtime_error(
-			std::string("expected an object, but got JSON type ") +
-			type_names[m_type]);
-	}
-	std::map<ustring, JSON_Value>::const_iterator i
-		= m_children->find(to_unicode(key));
-	if (i == m_children->end())
-		return JSON_Value();
-	return i->second;
+	return get(to_unicode(key));
 }
 
 void JSON_Value::insert(const ustring &key, const JSON_Value &value)
@@ -476,6 +894,9 @@ JSON_Value::JSON_Value(const JSON_Value &from) :
 
 void JSON_Value::operator =(const JSON_Value &from)
 {
+	if (&from == this) {
+		return;
+	}
 	clear();
 
 	m_type = from.m_type;
@@ -493,20 +914,29 @@ void JSON_Value::operator =(const JSON_Value &from)
 		m_float = from.m_float;
 		break;
 	case STRING:
-		m_string = new ustring(*from.m_string);
+		m_string = create(*from.m_string);
 		break;
 	case OBJECT:
-		m_children =
-		    new std::map<ustring, JSON_Value>(*from.m_children);
+		m_children = create(*from.m_children);
 		break;
 	case ARRAY:
-		m_array = new std::list<JSON_Value>(*from.m_array);
+		m_array = create(*from.m_array);
 		break;
 	default:
 		assert(0);
 	}
 }
 
+void JSON_Value::swap(JSON_Value &other)
+{
+	std::swap(m_type, other.m_type);
+	/* all members of the union start at the same address */
+	Payload tmp;
+	memcpy(&tmp, &m_int, sizeof tmp);
+	memcpy(&m_int, &other.m_int, sizeof tmp);
+	memcpy(&other.m_int, &tmp, sizeof tmp);
+}
+
 JSON_Value::Type JSON_Value::equal_type() const
 {
 	if (m_type == NUMBER_INT)
@@ -551,9 +981,9 @@ bool JSON_Value::operator ==(const JSON_Value &other) const
 			return false;
 
 		/* Check that every key can be also found in the other map */
-		for (std::map<ustring, JSON_Value>::const_iterator i =
-		     m_children->begin(); i != m_children->end(); ++i) {
-			std::map<ustring, JSON_Value>::const_iterator j =
+		for (Object::const_iterator i = m_children->begin();
+		     i != m_children->end(); ++i) {
+			Object::const_iterator j =
 				other.m_children->find(i->first);
 			if (j == other.m_children->end())
 				return false;
@@ -567,10 +997,9 @@ bool JSON_Value::operator ==(const JSON_Value &other) const
 			if (m_array->size() != other.m_array->size())
 				return false;
 			/* Iterate over both arrays at the same time */
-			std::list<JSON_Value>::const_iterator j =
-				other.m_array->begin();
-			for (std::list<JSON_Value>::const_iterator i =
-			     m_array->begin(); i != m_array->end(); ++i) {
+			Array::const_iterator j = other.m_array->begin();
+			for (Array::const_iterator i = m_array->begin();
+			     i != m_array->end(); ++i) {
 				if (*i != *j)
 					return false;
 				j++;
@@ -589,7 +1018,17 @@ bool JSON_Value::operator !=(const JSON_Value &other) const
 	return !(*this == other);
 }
 
-void JSON_Value::load(std::basic_istream<uint32_t> &is)
+void JSON_Value::load(std::basic_istream<uint32_t> &is, JSON_Arena *arena)
+{
+	if (arena != NULL) {
+		JSON_Arena::Scope scope(arena);
+		parse(is);
+	} else {
+		parse(is);
+	}
+}
+
+void JSON_Value::parse(std::basic_istream<uint32_t> &is)
 {
 	clear();
 
@@ -604,21 +1043,23 @@ void JSON_Value::load(std::basic_istream<uint32_t> &is)
 	}
 	switch (c) {
 	case '"':
-		m_string = new ustring(parse_string(is));
+		m_string = create<String>();
 		m_type = STRING;
+		parse_string(is, m_string);
 		break;
 
 	case '{':
 		/* An object (key-value pairs) */
 		is.get();
-		m_children = new std::map<ustring, JSON_Value>;
+		m_children = create<Object>();
 		m_type = OBJECT;
 		while (!check(is, '}')) {
-			ustring key = parse_string(is);
+			ustring key;
+			parse_string(is, &key);
 			expect(is, ':');
 			JSON_Value val;
-			val.load(is);
-			(*m_children)[key] = val;
+			val.parse(is);
+			(*m_children)[key].swap(val);
 			if (!skip(is, ','))
 				break;
 		}
@@ -628,12 +1069,11 @@ void JSON_Value::load(std::basic_istream<uint32_t> &is)
 	case '[':
 		/* An array */
 		is.get();
-		m_array = new std::list<JSON_Value>;
+		m_array = create<Array>();
 		m_type = ARRAY;
 		while (!check(is, ']')) {
-			JSON_Value val;
-			val.load(is);
-			m_array->push_back(val);
+			m_array->push_back(JSON_Value());
+			m_array->back().parse(is);
 			if (!skip(is, ','))
 				break;
 		}
@@ -678,9 +1118,10 @@ void JSON_Value::load(std::basic_istream<uint32_t> &is)
 	}
 }
 
-void JSON_Value::load_all(std::basic_istream<uint32_t> &is)
+void JSON_Value::load_all(std::basic_istream<uint32_t> &is,
+			  JSON_Arena *arena)
 {
-	load(is);
+	load(is, arena);
 
 	char c = is.get();
 	if (!is.eof()) {
@@ -688,6 +1129,191 @@ void JSON_Value::load_all(std::basic_istream<uint32_t> &is)
 	}
 }
 
+size_t JSON_Value::load(const char *data, size_t length, JSON_Arena *arena)
+{
+	JSON_Reader reader(data, length);
+	if (arena != NULL) {
+		JSON_Arena::Scope scope(arena);
+		parse(reader);
+	} else {
+		parse(reader);
+	}
+	return reader.consumed();
+}
+
+void JSON_Value::load_all(const char *data, size_t length, JSON_Arena *arena)
+{
+	JSON_Reader reader(data, length);
+	if (arena != NULL) {
+		JSON_Arena::Scope scope(arena);
+		parse(reader);
+	} else {
+		parse(reader);
+	}
+	if (reader.peek() >= 0) {
+		throw json_parse_error("Extra characters after JSON data");
+	}
+}
+
+void JSON_Value::parse(JSON_Reader &reader)
+{
+	clear();
+
+	int c = reader.peek();
+	switch (c) {
+	case -1:
+		throw json_parse_error("Expected a token");
+
+	case '"':
+		m_string = create<String>();
+		m_type = STRING;
+		reader.string(m_string);
+		break;
+
+	case '{':
+		/* An object (key-value pairs) */
+		reader.skip('{');
+		m_children = create<Object>();
+		m_type = OBJECT;
+		while (reader.peek() != '}') {
+			ustring key;
+			reader.string(&key);
+			reader.expect(':');
+			JSON_Value val;
+			val.parse(reader);
+			(*m_children)[key].swap(val);
+			if (!reader.skip(','))
+				break;
+		}
+		reader.expect('}');
+		break;
+
+	case '[':
+		/* An array */
+		reader.skip('[');
+		m_array = create<Array>();
+		m_type = ARRAY;
+		while (reader.peek() != ']') {
+			m_array->push_back(JSON_Value());
+			m_array->back().parse(reader);
+			if (!reader.skip(','))
+				break;
+		}
+		reader.expect(']');
+		break;
+
+	default:
+		if (c < 128 && isalpha(c)) {
+			/* It is a word. The only possible words are below */
+			std::string id = reader.word();
+			if (id == "null") {
+				m_type = NULL_VALUE;
+			} else if (id == "true") {
+				m_type = BOOLEAN;
+				m_boolean = true;
+			} else if (id == "false") {
+				m_type = BOOLEAN;
+				m_boolean = false;
+			} else {
+				throw json_parse_error("Unknown word");
+			}
+		} else if (c == '-' || (c < 128 && isdigit(c))) {
+			/* A number (a float or an integer) */
+			std::string num = reader.number();
+			if (num.find_first_of(".eE") != std::string::npos) {
+				/* streams are not affected by setlocale() */
+				std::istringstream parser(num);
+				m_type = NUMBER_FLOAT;
+				parser >> m_float;
+				if (!parser) {
+					throw json_parse_error("Invalid number " +
+							       num);
+				}
+			} else {
+				errno = 0;
+				m_type = NUMBER_INT;
+				m_int = strtol(num.c_str(), NULL, 10);
+				if (errno) {
+					throw json_parse_error("Invalid number " +
+							       num);
+				}
+			}
+		} else {
+			throw json_parse_error("Unknown character");
+		}
+		break;
+	}
+}
+
+void JSON_Value::write(std::string &out, int indentation) const
+{
+	bool first = true;
+
+	switch (m_type) {
+	case NULL_VALUE:
+		out += "null";
+		break;
+	case BOOLEAN:
+		out += m_boolean ? "true" : "false";
+		break;
+	case NUMBER_INT:
+		out += strf("%ld", m_int);
+		break;
+	case NUMBER_FLOAT:
+		out += strf("%f", m_float);
+		break;
+
+	case STRING:
+		out += '"';
+		escape_utf8(out, *m_string);
+		out += '"';
+		break;
+
+	case OBJECT:
+		/* the same layout as with the stream */
+		out += "{\n";
+		for (Object::const_iterator i = m_children->begin();
+		     i != m_children->end(); ++i) {
+			if (!first) {
+				out += ",\n";
+			}
+			out.append(indentation + 1, '\t');
+			out += '"';
+			escape_utf8(out, i->first);
+			out += "\": ";
+			i->second.write(out, indentation + 1);
+			first = false;
+		}
+		if (!first) {
+			out += '\n';
+		}
+		out.append(indentation, '\t');
+		out += '}';
+		break;
+
+	case ARRAY:
+		out += "[\n";
+		for (Array::const_iterator i = m_array->begin();
+		     i != m_array->end(); ++i) {
+			if (!first) {
+				out += ",\n";
+			}
+			out.append(indentation + 1, '\t');
+			i->write(out, indentation + 1);
+			first = false;
+		}
+		if (!first) {
+			out += '\n';
+		}
+		out.append(indentation, '\t');
+		out += ']';
+		break;
+
+	default:
+		assert(0);
+	}
+}
+
 void JSON_Value::write(std::basic_ostream<uint32_t> &os, int indentation) const
 {
 	ustring out;
@@ -709,7 +1335,7 @@ void JSON_Value::write(std::basic_ostream<uint32_t> &os, int indentation) const
 
 	case STRING:
 		os.put('"');
-		os << escape(*m_string);
+		os << escape(ustring(m_string->begin(), m_string->end()));
 		os.put('"');
 		break;
 
@@ -721,8 +1347,8 @@ void JSON_Value::write(std::basic_ostream<uint32_t> &os, int indentation) const
 		 */
 		os.put('{');
 		os.put('\n');
-		for (std::map<ustring, JSON_Value>::const_iterator i =
-		     m_children->begin(); i != m_children->end(); ++i) {
+		for (Object::const_iterator i = m_children->begin();
+		     i != m_children->end(); ++i) {
 			if (!first) {
 				os.put(',');
 				os.put('\n');
@@ -750,8 +1376,8 @@ void JSON_Value::write(std::basic_ostream<uint32_t> &os, int indentation) const
 	case ARRAY:
 		os.put('[');
 		os.put('\n');
-		for (std::list<JSON_Value>::const_iterator i =
-		     m_array->begin(); i != m_array->end(); ++i) {
+		for (Array::const_iterator i = m_array->begin();
+		     i != m_array->end(); ++i) {
 			if (!first) {
 				os.put(',');
 				os.put('\n');
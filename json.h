@@ -12,9 +12,12 @@
 #include <string>
 #include <list>
 #include <map>
+#include <new>
 #include <istream>
 #include <ostream>
 #include <stdexcept>
+#include <vector>
+#include <stddef.h>
 
 /* An unicode string (UTF-32) */
 typedef std::basic_string<uint32_t> ustring;
@@ -26,6 +29,88 @@ public:
 	{}
 };
 
+/*
+ * Memory for a loaded JSON document. The values, containers and strings
+ * created while loading are allocated from a few large blocks, which are
+ * freed all at once when the arena is destroyed. The loaded values must
+ * be destroyed before the arena. Anything allocated when no arena is in
+ * use comes from the heap as usual. Not thread safe.
+ */
+class JSON_Arena {
+public:
+	JSON_Arena();
+	~JSON_Arena();
+
+	void *allocate(size_t size);
+
+	/* used by JSON_Allocator */
+	static void *allocate_node(size_t size);
+	static void free_node(void *ptr);
+
+	/* makes the arena the current one during its lifetime */
+	class Scope {
+	public:
+		Scope(JSON_Arena *arena);
+		~Scope();
+	private:
+		JSON_Arena *m_prev;
+
+		Scope(const Scope &from);
+		void operator =(const Scope &from);
+	};
+
+private:
+	std::vector<char *> m_blocks;
+	char *m_pos;
+	size_t m_left;
+
+	static JSON_Arena *current;
+
+	JSON_Arena(const JSON_Arena &from);
+	void operator =(const JSON_Arena &from);
+};
+
+/* A standard allocator that uses the current JSON_Arena, if any */
+template<class T>
+class JSON_Allocator {
+public:
+	typedef T value_type;
+	typedef T *pointer;
+	typedef const T *const_pointer;
+	typedef T &reference;
+	typedef const T &const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template<class U>
+	struct rebind {
+		typedef JSON_Allocator<U> other;
+	};
+
+	JSON_Allocator() {}
+	JSON_Allocator(const JSON_Allocator &) {}
+	template<class U>
+	JSON_Allocator(const JSON_Allocator<U> &) {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+
+	pointer allocate(size_type n, const void * = 0)
+	{
+		return (pointer) JSON_Arena::allocate_node(n * sizeof(T));
+	}
+	void deallocate(pointer p, size_type) { JSON_Arena::free_node(p); }
+
+	size_type max_size() const { return size_t(-1) / sizeof(T) / 2; }
+	void construct(pointer p, const T &val) { new ((void *) p) T(val); }
+	void destroy(pointer p) { p->~T(); }
+
+	bool operator ==(const JSON_Allocator &) const { return true; }
+	bool operator !=(const JSON_Allocator &) const { return false; }
+};
+
+class JSON_Reader;
+
 class JSON_Value {
 public:
 	enum Type {
@@ -40,6 +125,13 @@ public:
 		MAX_TYPE
 	};
 
+	typedef std::basic_string<uint32_t, std::char_traits<uint32_t>,
+				  JSON_Allocator<uint32_t> > String;
+	typedef std::map<ustring, JSON_Value, std::less<ustring>,
+			 JSON_Allocator<std::pair<const ustring, JSON_Value> > >
+		Object;
+	typedef std::list<JSON_Value, JSON_Allocator<JSON_Value> > Array;
+
 	JSON_Value();
 	JSON_Value(const ustring &s);
 	JSON_Value(const std::string &s);
@@ -54,23 +146,23 @@ public:
 
 	/*
 	 * Convert the value to different types. An exception is raised when
-	 * the conversion fails. Note that the returned JSONValue objects
-	 * should not be destroyed.
+	 * the conversion fails. The returned references point inside the
+	 * value, and are valid as long as the value is not modified.
 	 */
 	long to_long() const;
 	int to_int() const;
 	double to_double() const;
 	bool to_bool() const;
 	ustring to_string() const;
-	std::map<ustring, JSON_Value> children() const;
-	std::list<JSON_Value> array() const;
+	const Object &children() const;
+	const Array &array() const;
 
 	/*
 	 * If the value is a JSON object, return the value that matches the
 	 * given key. If the key does not exists, returns a NULL JSON value.
 	 */
-	JSON_Value get(const ustring &key) const;
-	JSON_Value get(const std::string &key) const;
+	const JSON_Value &get(const ustring &key) const;
+	const JSON_Value &get(const std::string &key) const;
 
 	/*
 	 * If the value is a JSON object, associate the given value to the
@@ -89,6 +181,9 @@ public:
 	JSON_Value(const JSON_Value &from);
 	void operator =(const JSON_Value &from);
 
+	/* Exchange the contents of two values, without copying anything */
+	void swap(JSON_Value &other);
+
 	bool operator ==(const JSON_Value &other) const;
 	bool operator !=(const JSON_Value &other) const;
 
@@ -96,15 +191,28 @@ public:
 	 * Load the contents of a JSON input from the given input stream.
 	 * The current value is discarded and the input is loaded recursively
 	 * into the current value. An exception is raised if the input contains
-	 * syntax errors.
+	 * syntax errors. If an arena is given, the loaded data is allocated
+	 * from it.
 	 */
-	void load(std::basic_istream<uint32_t> &is);
+	void load(std::basic_istream<uint32_t> &is, JSON_Arena *arena = NULL);
 
 	/*
 	 * Same as the above, but verifies that there is no extra characters
 	 * after the JSON encoded data.
 	 */
-	void load_all(std::basic_istream<uint32_t> &is);
+	void load_all(std::basic_istream<uint32_t> &is,
+		      JSON_Arena *arena = NULL);
+
+	/*
+	 * Load a JSON value directly from a UTF-8 buffer, such as a memory
+	 * mapped file. Only the contents of the strings are decoded. Returns
+	 * the number of bytes consumed.
+	 */
+	size_t load(const char *data, size_t length, JSON_Arena *arena = NULL);
+
+	/* Same as the above, but only whitespace may follow the value */
+	void load_all(const char *data, size_t length,
+		      JSON_Arena *arena = NULL);
 
 	/*
 	 * Serialize the JSON value as unicode to the given output stream. The
@@ -112,18 +220,23 @@ public:
 	 */
 	void write(std::basic_ostream<uint32_t> &os, int indentation = 0) const;
 
+	/* Same as the above, but appends UTF-8 to the given string */
+	void write(std::string &out, int indentation = 0) const;
+
 private:
 	Type m_type;
 	union {
 		bool m_boolean;
-		ustring *m_string;
+		String *m_string;
 		long m_int;
 		double m_float;
-		std::map<ustring, JSON_Value> *m_children;
-		std::list<JSON_Value> *m_array;
+		Object *m_children;
+		Array *m_array;
 	};
 
 	void clear();
+	void parse(std::basic_istream<uint32_t> &is);
+	void parse(JSON_Reader &reader);
 	Type equal_type() const;
 };
 
@@ -7,14 +7,27 @@
  */
 #include "utils.h"
 #include "imap.h"
-#include "json.h"
 #include "encoding.h"
+#include "json.h"
 #include "common.h"
-#include "imap.h"
+#include "account.h"
+#include "store.h"
+#include "body_cache.h"
+#include "message_list.h"
+#include "part_sink.h"
+#include "snapshot.h"
+#include "stats.h"
+#include <algorithm>
 #include <dirent.h>
 #include <gtk/gtk.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <fstream>
 #include <sstream>
 
@@ -24,22 +37,53 @@ namespace {
 
 std::string cache_path;
 
-std::list<IMAP *> accounts;
+std::list<Account *> accounts;
+
+/* the message that is waiting for its body to be fetched */
+Account *wanted_account = NULL;
+uint32_t wanted_uid = 0;
+
+/* the message that is shown */
+Account *shown_account = NULL;
+uint32_t shown_uid = 0;
 
 GtkWidget *messages_view;
 GtkWidget *text_view;
+/* a button for each attachment of the shown message */
+GtkWidget *attachments_box;
+Message_List *message_list;
+/* the messages shown are those that match, when not empty */
+std::string search_query;
+
+GtkWidget *folders_combo;
+/* the account and the folder of each item in the combo box */
+std::vector<std::pair<Account *, std::string> > folder_items;
+/* the account whose folder was chosen the last time */
+Account *folder_account = NULL;
+bool updating_folders = false;
+
+/* default widths of the message list columns */
+const int ID_WIDTH = 60;
+const int TEXT_WIDTH = 250;
+
+/* measured from here */
+uint64_t start_time;
+bool print_stats = false;
+/* the stats are written here every few seconds */
+std::string stats_file;
+const unsigned int STATS_INTERVAL = 10;
 
-/* columns of the message list */
-enum {
-	COL_ID,
-	COL_FROM,
-	COL_SUBJECT,
-	COL_ACCOUNT,
-	MAX_COL
-};
+/*
+ * The caches are opened and the servers connected to after the snapshot
+ * has been drawn, or after this many milliseconds if it never is.
+ */
+const unsigned int START_TIMEOUT = 200;
+bool accounts_started = false;
 
 }
 
+gboolean start_accounts(gpointer ptr);
+
 class Main_Window {
 public:
 	Main_Window();
@@ -47,10 +91,22 @@ public:
 
 private:
 	GtkWidget *m_window;
+	GtkWidget *m_threads_button;
+	int m_sort_column;
+	GtkSortType m_sort_order;
 
 	/* GTK callbacks */
 	static void message_clicked(GtkTreeView *tree_view, GtkTreePath *path,
 				    GtkTreeViewColumn *column, gpointer ptr);
+	static void column_clicked(GtkTreeViewColumn *column, gpointer ptr);
+	static void search_changed(GtkEditable *editable, gpointer ptr);
+	static void search_activated(GtkEntry *entry, gpointer ptr);
+	static void threads_toggled(GtkToggleButton *button, gpointer ptr);
+	static void folder_selected(GtkComboBox *combo, gpointer ptr);
+	static gboolean messages_exposed(GtkWidget *widget,
+					 GdkEventExpose *event, gpointer ptr);
+	static gboolean window_deleted(GtkWidget *widget, GdkEvent *event,
+				       gpointer ptr);
 };
 
 namespace {
@@ -84,6 +140,24 @@ std::string hexdump(const std::string &s)
 	return out;
 }
 
+/* the limits of the numeric account options */
+const unsigned long MAX_PREFETCH = 100000;
+const unsigned long MAX_CONNECTIONS = 64;
+
+/* A decimal number between the limits, anything else is rejected */
+bool parse_number(const char *s, unsigned long min, unsigned long max,
+		  unsigned long *value)
+{
+	/* strtoul() would take a sign and leading space */
+	if (!isdigit((unsigned char) s[0])) {
+		return false;
+	}
+	char *end;
+	errno = 0;
+	*value = strtoul(s, &end, 10);
+	return errno == 0 && *end == '\0' && *value >= min && *value <= max;
+}
+
 void load_config(const char *fname)
 {
 	std::ifstream f(fname);
@@ -105,42 +179,309 @@ void load_config(const char *fname)
 		if (type == "account") {
 			std::string server, user, pw;
 			parser >> server >> user >> pw;
-			IMAP *acc = new IMAP(server, user, pw);
+			Account *acc = new Account(server, user, pw);
 			accounts.push_back(acc);
+
+			std::string option;
+			while (parser >> option) {
+				unsigned long value;
+				if (option.compare(0, 9, "prefetch=") == 0) {
+					if (!parse_number(option.c_str() + 9, 0,
+							  MAX_PREFETCH,
+							  &value)) {
+						printf("invalid prefetch count: "
+						       "%s\n", option.c_str());
+						continue;
+					}
+					acc->set_prefetch(value);
+				} else if (option.compare(0, 12,
+						"connections=") == 0) {
+					if (!parse_number(option.c_str() + 12, 1,
+							  MAX_CONNECTIONS,
+							  &value)) {
+						printf("invalid connection "
+						       "count: %s\n",
+						       option.c_str());
+						continue;
+					}
+					acc->set_connections(value);
+				} else {
+					printf("invalid account option: %s\n",
+					       option.c_str());
+				}
+			}
 		} else {
 			printf("invalid config line: %s\n", type.c_str());
 		}
 	}
 }
 
+/* the text buffer only takes valid UTF-8 */
+void append_text(const char *data, size_t length)
+{
+	GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+	GtkTextIter end;
+	gtk_text_buffer_get_end_iter(buf, &end);
+	if (is_utf8(data, length)) {
+		gtk_text_buffer_insert(buf, &end, data, length);
+		return;
+	}
+	std::string text(data, length);
+	for (size_t i = 0; i < text.size(); ++i) {
+		if ((unsigned char) text[i] >= 0x80) {
+			text[i] = '?';
+		}
+	}
+	gtk_text_buffer_insert(buf, &end, text.data(), text.size());
+}
+
+/* shows the text of the wanted message as it arrives */
+class Text_Sink: public Part_Sink {
+public:
+	Text_Sink(Account *account, uint32_t uid) :
+		m_account(account),
+		m_uid(uid)
+	{
+		GtkTextBuffer *buf =
+			gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
+		gtk_text_buffer_set_text(buf, "", 0);
+	}
+
+	void write(const char *data, size_t length)
+	{
+		if (!wanted()) {
+			return;
+		}
+		/* a char may be split between the pieces */
+		m_pending.append(data, length);
+		size_t end = m_pending.size();
+		for (size_t i = 1; i <= 3 && i <= m_pending.size(); ++i) {
+			unsigned char c = m_pending[m_pending.size() - i];
+			if ((c & 0xc0) == 0x80) {
+				continue;
+			}
+			size_t need = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : 2;
+			if (c >= 0xc0 && need > i) {
+				end = m_pending.size() - i;
+			}
+			break;
+		}
+		append_text(m_pending.data(), end);
+		m_pending.erase(0, end);
+	}
+
+	void finish()
+	{
+		if (wanted()) {
+			append_text(m_pending.data(), m_pending.size());
+			wanted_account = NULL;
+		}
+	}
+
+private:
+	Account *m_account;
+	uint32_t m_uid;
+	std::string m_pending;
+
+	/* the user may have opened another message meanwhile */
+	bool wanted() const
+	{
+		return m_account == wanted_account && m_uid == wanted_uid;
+	}
+};
+
+/* an attachment is saved to the home directory, into a new file */
+class Attachment_Sink: public Part_Sink {
+public:
+	/* takes the ownership of the file */
+	Attachment_Sink(const std::string &path, FILE *file) :
+		m_path(path),
+		m_file(file),
+		m_ok(true)
+	{
+	}
+
+	~Attachment_Sink()
+	{
+		if (m_file != NULL) {
+			fclose(m_file);
+			unlink(m_path.c_str());
+		}
+	}
+
+	void write(const char *data, size_t length)
+	{
+		if (fwrite(data, 1, length, m_file) != length) {
+			m_ok = false;
+		}
+	}
+
+	void finish()
+	{
+		bool ok = fclose(m_file) == 0 && m_ok;
+		m_file = NULL;
+		if (!ok) {
+			printf("Unable to save %s\n", m_path.c_str());
+			unlink(m_path.c_str());
+			return;
+		}
+		printf("Saved %s\n", m_path.c_str());
+	}
+
+private:
+	std::string m_path;
+	FILE *m_file;
+	bool m_ok;
+};
+
+/*
+ * An existing file is never replaced, a number is added to the name
+ * instead, before the extension: "report.pdf", "report-1.pdf", ...
+ */
+FILE *create_file(const std::string &dir, const std::string &name,
+		  std::string *path)
+{
+	size_t dot = name.rfind('.');
+	if (dot == 0 || dot == std::string::npos) {
+		dot = name.size();
+	}
+	for (unsigned int i = 0; i < 1000; ++i) {
+		*path = dir + '/' + name;
+		if (i > 0) {
+			*path = strf("%s/%s-%u%s", dir.c_str(),
+				     name.substr(0, dot).c_str(), i,
+				     name.substr(dot).c_str());
+		}
+		int fd = open(path->c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd >= 0) {
+			FILE *file = fdopen(fd, "wb");
+			if (file == NULL) {
+				close(fd);
+				unlink(path->c_str());
+			}
+			return file;
+		}
+		if (errno != EEXIST) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+void attachment_clicked(GtkButton *button, gpointer ptr)
+{
+	UNUSED(ptr);
+	const char *section =
+		(const char *) g_object_get_data(G_OBJECT(button), "section");
+	shown_account->fetch_part(shown_uid, section);
+}
+
+/* the attachments are only fetched when asked for */
+void show_attachments(Account *account, uint32_t uid)
+{
+	GList *children =
+		gtk_container_get_children(GTK_CONTAINER(attachments_box));
+	for (GList *i = children; i != NULL; i = i->next) {
+		gtk_widget_destroy(GTK_WIDGET(i->data));
+	}
+	g_list_free(children);
+
+	Envelope env;
+	if (!account->store()->get(uid, &env)) {
+		return;
+	}
+	const Body_Part *text = find_text_part(env.parts);
+	for (size_t i = 0; i < env.parts.size(); ++i) {
+		const Body_Part *part = &env.parts[i];
+		if (part == text || part->type == "multipart" ||
+		    (part->type == "text" && part->name.empty())) {
+			continue;
+		}
+		std::string label = part->name;
+		if (label.empty()) {
+			label = part->type + '/' + part->subtype;
+		}
+		label += strf(" (%u kB)", (part->size + 1023) / 1024);
+
+		GtkWidget *button = gtk_button_new_with_label(label.c_str());
+		g_object_set_data_full(G_OBJECT(button), "section",
+				       g_strdup(part->section.c_str()), g_free);
+		g_signal_connect(G_OBJECT(button), "clicked",
+				 G_CALLBACK(attachment_clicked), NULL);
+		gtk_box_pack_start(GTK_BOX(attachments_box), button, FALSE,
+				   FALSE, 0);
+	}
+	gtk_widget_show_all(attachments_box);
+}
+
+void open_message(Account *account, uint32_t uid)
+{
+	if (account->store() == NULL) {
+		/* a row of the snapshot, the caches are not open yet */
+		return;
+	}
+	shown_account = account;
+	shown_uid = uid;
+	show_attachments(account, uid);
+
+	wanted_account = account;
+	wanted_uid = uid;
+	if (!account->show_cached(uid, new Text_Sink(account, uid))) {
+		account->fetch_message(uid);
+	}
 }
 
-Main_Window::Main_Window()
+}
+
+Main_Window::Main_Window() :
+	m_sort_column(-1),
+	m_sort_order(GTK_SORT_ASCENDING)
 {
 	m_window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
 	gtk_window_set_title(GTK_WINDOW(m_window), "jamail");
 	gtk_window_set_default_size(GTK_WINDOW(m_window), 300, 300);
 	gtk_container_set_border_width(GTK_CONTAINER(m_window), 4);
 	g_signal_connect(G_OBJECT(m_window), "delete_event",
-			 G_CALLBACK(gtk_main_quit), NULL);
+			 G_CALLBACK(window_deleted), this);
 
 	GtkWidget *vbox = gtk_vbox_new(FALSE, 4);
 
-	GtkListStore *store =
-		gtk_list_store_new(MAX_COL, G_TYPE_INT, G_TYPE_STRING,
-				   G_TYPE_STRING, G_TYPE_POINTER);
-	messages_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
+	/* searched as it is typed, and on the servers with enter */
+	GtkWidget *search_entry = gtk_entry_new();
+	g_signal_connect(G_OBJECT(search_entry), "changed",
+			 G_CALLBACK(search_changed), this);
+	g_signal_connect(G_OBJECT(search_entry), "activate",
+			 G_CALLBACK(search_activated), this);
+	GtkWidget *hbox = gtk_hbox_new(FALSE, 4);
+	folders_combo = gtk_combo_box_new_text();
+	g_signal_connect(G_OBJECT(folders_combo), "changed",
+			 G_CALLBACK(folder_selected), this);
+	gtk_box_pack_start(GTK_BOX(hbox), folders_combo, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(hbox), search_entry, TRUE, TRUE, 0);
+
+	m_threads_button = gtk_check_button_new_with_label("Conversations");
+	g_signal_connect(G_OBJECT(m_threads_button), "toggled",
+			 G_CALLBACK(threads_toggled), this);
+	gtk_box_pack_start(GTK_BOX(hbox), m_threads_button, FALSE, FALSE, 0);
+	gtk_box_pack_start(GTK_BOX(vbox), hbox, FALSE, FALSE, 0);
+
+	message_list = new Message_List;
+	messages_view = gtk_tree_view_new_with_model(message_list->model());
+	message_list->set_view(GTK_TREE_VIEW(messages_view));
 	g_signal_connect(G_OBJECT(messages_view), "row-activated",
 			 G_CALLBACK(message_clicked), this);
+	g_signal_connect(G_OBJECT(messages_view), "expose-event",
+			 G_CALLBACK(messages_exposed), this);
 
 	const struct {
 		int id;
 		const char *title;
+		int width;
 	} columns[] = {
-		{COL_ID, "ID"},
-		{COL_FROM, "From"},
-		{COL_SUBJECT, "Subject"},
-		{-1, NULL}
+		{COL_ID, "ID", ID_WIDTH},
+		{COL_FROM, "From", TEXT_WIDTH},
+		{COL_SUBJECT, "Subject", TEXT_WIDTH},
+		{-1, NULL, 0}
 	};
 
 	for (int i = 0; columns[i].title; ++i) {
@@ -150,9 +491,19 @@ Main_Window::Main_Window()
 				columns[i].title, renderer, "text",
 				columns[i].id, NULL);
 		gtk_tree_view_column_set_resizable(column, TRUE);
+		/* the rows are only built when they become visible */
+		gtk_tree_view_column_set_sizing(column,
+						GTK_TREE_VIEW_COLUMN_FIXED);
+		gtk_tree_view_column_set_fixed_width(column, columns[i].width);
+		gtk_tree_view_column_set_clickable(column, TRUE);
+		g_object_set_data(G_OBJECT(column), "column-id",
+				  GINT_TO_POINTER(columns[i].id));
+		g_signal_connect(G_OBJECT(column), "clicked",
+				 G_CALLBACK(column_clicked), this);
 		gtk_tree_view_insert_column(GTK_TREE_VIEW(messages_view),
 					    column, -1);
 	}
+	gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(messages_view), TRUE);
 
 	GtkWidget *scrollwin = gtk_scrolled_window_new(NULL, NULL);
 	gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(scrollwin),
@@ -172,6 +523,9 @@ Main_Window::Main_Window()
 	gtk_container_add(GTK_CONTAINER(scrollwin), text_view);
 	gtk_box_pack_start(GTK_BOX(vbox), scrollwin, TRUE, TRUE, 0);
 
+	attachments_box = gtk_hbox_new(FALSE, 4);
+	gtk_box_pack_start(GTK_BOX(vbox), attachments_box, FALSE, FALSE, 0);
+
 	gtk_container_add(GTK_CONTAINER(m_window), vbox);
 
 	gtk_widget_show_all(m_window);
@@ -180,6 +534,7 @@ Main_Window::Main_Window()
 Main_Window::~Main_Window()
 {
 	gtk_widget_destroy(m_window);
+	delete message_list;
 }
 
 void Main_Window::message_clicked(GtkTreeView *tree_view, GtkTreePath *path,
@@ -193,94 +548,256 @@ void Main_Window::message_clicked(GtkTreeView *tree_view, GtkTreePath *path,
 	GtkTreeModel *model = gtk_tree_view_get_model(tree_view);
 
 	GtkTreeIter iter;
-	int id;
-	IMAP *acc = NULL;
+	unsigned int uid;
+	Account *acc = NULL;
 	gtk_tree_model_get_iter(model, &iter, path);
-	gtk_tree_model_get(model, &iter, COL_ID, &id, COL_ACCOUNT, &acc, -1);
+	gtk_tree_model_get(model, &iter, COL_ID, &uid, COL_ACCOUNT, &acc, -1);
 
-	acc->fetch_message(id);
+	open_message(acc, uid);
 }
 
-std::list<Header_Address> parse_address_list(const JSON_Value &value)
+void Main_Window::column_clicked(GtkTreeViewColumn *column, gpointer ptr)
 {
-	std::list<JSON_Value> array = value.array();
-	std::list<Header_Address> out;
-	for (const_list_iter<JSON_Value> i(array); i; i.next()) {
-		Header_Address addr;
-		addr.name = i->get("name").to_string();
-		addr.email = i->get("email").to_string();
-		out.push_back(addr);
+	Main_Window *self = (Main_Window *) ptr;
+
+	int id = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(column),
+						   "column-id"));
+	if (id == self->m_sort_column &&
+	    self->m_sort_order == GTK_SORT_ASCENDING) {
+		self->m_sort_order = GTK_SORT_DESCENDING;
+	} else {
+		self->m_sort_order = GTK_SORT_ASCENDING;
 	}
-	return out;
+	self->m_sort_column = id;
+	message_list->sort(id, self->m_sort_order);
+
+	for (int i = 0; i < MAX_COL; ++i) {
+		GtkTreeViewColumn *col =
+			gtk_tree_view_get_column(GTK_TREE_VIEW(messages_view), i);
+		if (col == NULL)
+			break;
+		gtk_tree_view_column_set_sort_indicator(col, col == column);
+	}
+	gtk_tree_view_column_set_sort_order(column, self->m_sort_order);
+	/* sorting splits the conversations */
+	gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(self->m_threads_button),
+				     FALSE);
 }
 
-JSON_Value json_address_list(const std::list<Header_Address> &list)
+void Main_Window::threads_toggled(GtkToggleButton *button, gpointer ptr)
 {
-	JSON_Value out(JSON_Value::ARRAY);
-	for (const_list_iter<Header_Address> i(list); i; i.next()) {
-		JSON_Value addr(JSON_Value::OBJECT);
-		addr.insert("name", JSON_Value(i->name));
-		addr.insert("email", JSON_Value(i->email));
-		out.push_back(addr);
+	Main_Window *self = (Main_Window *) ptr;
+
+	bool active = gtk_toggle_button_get_active(button);
+	message_list->set_threaded(active);
+	if (!active) {
+		return;
+	}
+	self->m_sort_column = -1;
+	for (int i = 0; i < MAX_COL; ++i) {
+		GtkTreeViewColumn *col =
+			gtk_tree_view_get_column(GTK_TREE_VIEW(messages_view), i);
+		if (col == NULL)
+			break;
+		gtk_tree_view_column_set_sort_indicator(col, FALSE);
 	}
-	return out;
 }
 
-void add_message_to_list(IMAP *account, const Envelope *env)
+void Main_Window::search_changed(GtkEditable *editable, gpointer ptr)
 {
-	GtkTreeModel *model =
-		gtk_tree_view_get_model(GTK_TREE_VIEW(messages_view));
+	UNUSED(ptr);
 
-	/* GTK wants UTF-8 */
-	std::string from = "?";
-	if (!env->from.empty()) {
-		from = encode(env->from.front().email, "UTF-8");
+	search_query = gtk_entry_get_text(GTK_ENTRY(editable));
+	if (search_query.empty()) {
+		message_list->clear_filter();
+		return;
 	}
-	std::string subject = encode(env->subject, "UTF-8");
+	bool first = true;
+	for (const_list_iter<Account *> i(accounts); i; i.next()) {
+		std::vector<uint32_t> uids = (*i)->search(search_query);
+		if (first) {
+			message_list->set_filter(*i, uids);
+			first = false;
+		} else {
+			message_list->add_to_filter(*i, uids);
+		}
+	}
+}
 
-	GtkTreeIter iter;
-	gtk_list_store_append(GTK_LIST_STORE(model),
-			      &iter);
-	gtk_list_store_set(GTK_LIST_STORE(model), &iter,
-		COL_ID, env->id,
-		COL_FROM, from.c_str(),
-		COL_SUBJECT, subject.c_str(),
-		COL_ACCOUNT, account,
-		-1);
-}
-
-void add_message(IMAP *account, const Envelope *env)
-{
-	add_message_to_list(account, env);
-
-	/* Serialize the headers of the message with JSON */
-	JSON_Value message(JSON_Value::OBJECT);
-	message.insert(to_unicode("subject"), env->subject);
-	message.insert(to_unicode("date"), env->date);
-	message.insert(to_unicode("sender"), json_address_list(env->sender));
-	message.insert(to_unicode("from"), json_address_list(env->from));
-	message.insert(to_unicode("to"), json_address_list(env->to));
-	message.insert(to_unicode("cc"), json_address_list(env->cc));
-	message.insert(to_unicode("bcc"), json_address_list(env->bcc));
-	message.insert(to_unicode("reply_to"), json_address_list(env->reply_to));
-
-	std::string fname = cache_path + '/' + account->server() +
-			    strf("/%d", env->id);
-
-	/* write to a file using UTF-8 encoding */
-	std::ofstream f(fname.c_str(), std::ofstream::binary);
-	if (!f) {
-		debug("Unable to write to %s\n", fname.c_str());
+void Main_Window::search_activated(GtkEntry *entry, gpointer ptr)
+{
+	UNUSED(entry);
+	UNUSED(ptr);
+
+	if (search_query.empty()) {
 		return;
 	}
-	enc_streambuf sb(f, "UTF-8");
-	std::basic_ostream<uint32_t> os(&sb);
-	message.write(os);
+	/* the bodies that are not cached */
+	for (const_list_iter<Account *> i(accounts); i; i.next()) {
+		if (!(*i)->search_server(search_query)) {
+			debug("%s: unable to search on the server\n",
+			      (*i)->server().c_str());
+		}
+	}
 }
 
-void load_cache(IMAP *account)
+void messages_found(Account *account, const std::string &query,
+		    const std::vector<uint32_t> &uids)
 {
-	std::string path = cache_path + '/' + account->server();
+	/* the query may have changed while waiting */
+	if (query == search_query) {
+		message_list->add_to_filter(account, uids);
+	}
+}
+
+/* The snapshot is saved while the message list is still shown */
+gboolean Main_Window::window_deleted(GtkWidget *widget, GdkEvent *event,
+				     gpointer ptr)
+{
+	UNUSED(widget);
+	UNUSED(event);
+	UNUSED(ptr);
+
+	if (!message_list->save_snapshot(cache_path + "/snapshot")) {
+		printf("Can not save the snapshot\n");
+	}
+	gtk_main_quit();
+	/* the window is destroyed with the rest of it */
+	return TRUE;
+}
+
+/* only the first time is of interest */
+gboolean Main_Window::messages_exposed(GtkWidget *widget,
+				       GdkEventExpose *event, gpointer ptr)
+{
+	UNUSED(event);
+	stats_span(PHASE_FIRST_PAINT, start_time);
+	g_signal_handlers_disconnect_by_func(widget, (gpointer) messages_exposed,
+					     ptr);
+	g_idle_add(start_accounts, NULL);
+	return FALSE;
+}
+
+void Main_Window::folder_selected(GtkComboBox *combo, gpointer ptr)
+{
+	UNUSED(ptr);
+
+	int active = gtk_combo_box_get_active(combo);
+	if (updating_folders || active < 0 ||
+	    size_t(active) >= folder_items.size()) {
+		return;
+	}
+	folder_account = folder_items[active].first;
+	folder_account->open_folder(folder_items[active].second);
+}
+
+/* the folders that have changed since they were shown are marked */
+void folders_changed(Account *account)
+{
+	UNUSED(account);
+
+	updating_folders = true;
+	gtk_list_store_clear(GTK_LIST_STORE(
+		gtk_combo_box_get_model(GTK_COMBO_BOX(folders_combo))));
+	folder_items.clear();
+	int active = -1;
+	for (const_list_iter<Account *> i(accounts); i; i.next()) {
+		Account *acc = *i;
+		std::vector<std::string> folders = acc->folders();
+		if (std::find(folders.begin(), folders.end(), acc->folder()) ==
+		    folders.end()) {
+			folders.insert(folders.begin(), acc->folder());
+		}
+		for (size_t j = 0; j < folders.size(); ++j) {
+			std::string label = acc->server() + ": " + folders[j];
+			if (acc->folder_changed(folders[j])) {
+				label += " *";
+			}
+			if (folders[j] == acc->folder() &&
+			    (active < 0 || acc == folder_account)) {
+				active = folder_items.size();
+			}
+			gtk_combo_box_append_text(GTK_COMBO_BOX(folders_combo),
+						  label.c_str());
+			folder_items.push_back(std::make_pair(acc, folders[j]));
+		}
+	}
+	gtk_combo_box_set_active(GTK_COMBO_BOX(folders_combo), active);
+	updating_folders = false;
+}
+
+void threads_changed(Account *account)
+{
+	UNUSED(account);
+	message_list->update_threads();
+}
+
+void message_added(Account *account, uint32_t uid)
+{
+	message_list->add(account, account->store(), uid);
+}
+
+void message_removed(Account *account, uint32_t uid)
+{
+	message_list->remove(account, uid);
+}
+
+void messages_removed(Account *account, const std::vector<uint32_t> &uids)
+{
+	message_list->remove(account, uids);
+}
+
+void messages_cleared(Account *account)
+{
+	message_list->remove_account(account);
+}
+
+Part_Sink *open_text(Account *account, uint32_t uid)
+{
+	if (account != wanted_account || uid != wanted_uid) {
+		return NULL;
+	}
+	return new Text_Sink(account, uid);
+}
+
+Part_Sink *open_part(Account *account, uint32_t uid, const std::string &section)
+{
+	std::string name;
+	Envelope env;
+	if (account->store()->get(uid, &env)) {
+		for (size_t i = 0; i < env.parts.size(); ++i) {
+			if (env.parts[i].section == section) {
+				name = env.parts[i].name;
+			}
+		}
+	}
+	/* only the last component of the name, it comes from the sender */
+	size_t slash = name.rfind('/');
+	if (slash != std::string::npos) {
+		name = name.substr(slash + 1);
+	}
+	if (name.empty() || name[0] == '.') {
+		name = strf("attachment-%u-%s", uid, section.c_str());
+	}
+	std::string path;
+	FILE *file = create_file(getenv("HOME"), name, &path);
+	if (file == NULL) {
+		printf("Unable to save %s: %s\n", path.c_str(),
+		       strerror(errno));
+		return NULL;
+	}
+	return new Attachment_Sink(path, file);
+}
+
+/*
+ * Remove the files of the old one-file-per-message cache. Its state file
+ * goes last, so the directory is only scanned while it is still there.
+ */
+void remove_legacy_cache(const std::string &path)
+{
+	std::string state = path + "/state";
+	if (access(state.c_str(), F_OK) != 0)
+		return;
 	DIR *dir = opendir(path.c_str());
 	if (dir == NULL)
 		return;
@@ -288,44 +805,101 @@ void load_cache(IMAP *account)
 		dirent *de = readdir(dir);
 		if (de == NULL)
 			break;
-		if (de->d_name[0] == '.')
-			continue;
+		std::string name = de->d_name;
+		if (isdigit(name[0])) {
+			unlink((path + '/' + name).c_str());
+		}
+	}
+	closedir(dir);
+	unlink(state.c_str());
+}
 
-		std::string fname = path + '/' + de->d_name;
-		std::ifstream f(fname.c_str(), std::ifstream::binary);
-		if (!f) {
-			debug("Can not open %s\n", fname.c_str());
-			continue;
+void load_cache(Account *account)
+{
+	std::string path = cache_path + '/' + account->server();
+	remove_legacy_cache(path);
+
+	account->open_cache(path);
+	folders_changed(account);
+	Envelope_Store *store = account->store();
+	for (size_t i = 0; i < store->size(); ++i) {
+		message_list->add(account, store, store->uid_at(i));
+	}
+}
+
+/* The rows that were shown the last time, before anything else is done */
+void show_snapshot()
+{
+	Snapshot *snapshot = new Snapshot;
+	if (!snapshot->open(cache_path + "/snapshot")) {
+		delete snapshot;
+		return;
+	}
+	std::vector<Account *> owners;
+	for (size_t i = 0; i < snapshot->size(); ++i) {
+		std::string server = snapshot->server(i);
+		Account *owner = NULL;
+		for (const_list_iter<Account *> j(accounts); j; j.next()) {
+			if ((*j)->server() == server) {
+				owner = *j;
+			}
 		}
+		owners.push_back(owner);
+	}
+	message_list->show_snapshot(snapshot, owners);
+}
 
-		dec_streambuf sb(f, "UTF-8");
-		std::basic_istream<uint32_t> is(&sb);
-		JSON_Value val;
-		val.load(is);
+gboolean start_accounts(gpointer ptr)
+{
+	UNUSED(ptr);
 
-		Envelope env;
-		env.subject = val.get("subject").to_string();
-		env.date = val.get("date").to_string();
-		env.sender = parse_address_list(val.get("sender"));
-		env.from = parse_address_list(val.get("from"));
-		env.to = parse_address_list(val.get("to"));
-		env.cc = parse_address_list(val.get("cc"));
-		env.bcc = parse_address_list(val.get("bcc"));
-		env.reply_to = parse_address_list(val.get("reply_to"));
+	if (accounts_started) {
+		return FALSE;
+	}
+	accounts_started = true;
+	for (const_list_iter<Account *> i(accounts); i; i.next()) {
+		Account *acc = *i;
 
-		add_message_to_list(account, &env);
+		std::string path = cache_path + '/' + acc->server();
+		mkdir(path.c_str(), 0700);
+
+		load_cache(acc);
+		acc->connect();
 	}
-	closedir(dir);
+	/* the snapshot goes even if there are no messages */
+	message_list->flush();
+	return FALSE;
 }
 
-void show_message(const std::string &body)
+void write_stats()
 {
-	GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view));
-	gtk_text_buffer_set_text(buf, body.data(), body.size());
+	std::string out;
+	stats_json().write(out, 0);
+	out += '\n';
+
+	std::string tmp = stats_file + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "w");
+	if (f == NULL) {
+		printf("Can not open %s\n", tmp.c_str());
+		return;
+	}
+	fwrite(out.data(), 1, out.size(), f);
+	if (fclose(f) != 0 || rename(tmp.c_str(), stats_file.c_str()) < 0) {
+		printf("Can not write %s\n", stats_file.c_str());
+		unlink(tmp.c_str());
+	}
+}
+
+gboolean stats_timeout(gpointer ptr)
+{
+	UNUSED(ptr);
+	write_stats();
+	return TRUE;
 }
 
 int main(int argc, char **argv)
 try {
+	start_time = stats_now();
 	gtk_init(&argc, &argv);
 	SSL_library_init();
 
@@ -338,6 +912,11 @@ try {
 
 		if (arg == "-d") {
 			debug_enabled = true;
+		} else if (arg == "--stats") {
+			print_stats = true;
+		} else if (arg == "--stats-json" && !val.empty()) {
+			stats_file = val;
+			++i;
 		}
 	}
 
@@ -348,18 +927,24 @@ try {
 	mkdir(cache_path.c_str(), 0700);
 
 	Main_Window mw;
+	show_snapshot();
+	g_timeout_add(START_TIMEOUT, start_accounts, NULL);
 
-	for (const_list_iter<IMAP *> i(accounts); i; i.next()) {
-		IMAP *acc = *i;
-
-		std::string path = cache_path + '/' + acc->server();
-		mkdir(path.c_str(), 0700);
-
-		load_cache(acc);
-		acc->connect();
+	if (!stats_file.empty()) {
+		g_timeout_add_seconds(STATS_INTERVAL, stats_timeout, NULL);
 	}
 
 	gtk_main();
+
+	for (const_list_iter<Account *> i(accounts); i; i.next()) {
+		delete *i;
+	}
+	if (print_stats) {
+		stats_print(stdout);
+	}
+	if (!stats_file.empty()) {
+		write_stats();
+	}
 	return 0;
 
 } catch (const std::exception &e) {
@@ -0,0 +1,866 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "message_list.h"
+#include "account.h"
+#include "snapshot.h"
+#include "store.h"
+#include "thread_index.h"
+#include "utils.h"
+#include <algorithm>
+#include <iterator>
+#include <map>
+
+namespace {
+
+const size_t NO_ROW = size_t(-1);
+const int INVALID_GTK_WATCH = -1;
+/* the new rows are added at most this often, in milliseconds */
+const unsigned int FLUSH_INTERVAL = 1000 / 60;
+/* a batch this large is added while the view is detached */
+const size_t BULK_ROWS = 500;
+/* deeper replies are not indented any further */
+const unsigned int MAX_INDENT = 10;
+/* more than a screenful, even on a tall window */
+const size_t SNAPSHOT_ROWS = 100;
+
+/* the GObject that implements the GtkTreeModel interface */
+struct Model_Object {
+	GObject parent;
+	Message_List *list;
+};
+
+struct Model_Class {
+	GObjectClass parent_class;
+};
+
+bool is_text_column(int column)
+{
+	return column == COL_FROM || column == COL_SUBJECT;
+}
+
+}
+
+bool Message_List::Key_Less::operator ()(size_t a, size_t b) const
+{
+	if (m_list->m_sort_order == GTK_SORT_DESCENDING) {
+		std::swap(a, b);
+	}
+	if (is_text_column(m_list->m_sort_column)) {
+		return m_list->m_keys[a] < m_list->m_keys[b];
+	}
+	return m_list->m_rows[a].uid < m_list->m_rows[b].uid;
+}
+
+Message_List::Message_List() :
+	m_view(NULL),
+	m_stamp(1),
+	m_flush_timer(INVALID_GTK_WATCH),
+	m_filtered(false),
+	m_threaded(false),
+	m_snapshot(NULL),
+	m_sort_column(-1),
+	m_sort_order(GTK_SORT_ASCENDING),
+	m_cached_row(NO_ROW)
+{
+	Model_Object *obj = (Model_Object *) g_object_new(get_type(), NULL);
+	obj->list = this;
+	m_model = GTK_TREE_MODEL(obj);
+}
+
+Message_List::~Message_List()
+{
+	if (m_flush_timer != INVALID_GTK_WATCH) {
+		g_source_remove(m_flush_timer);
+	}
+	g_object_unref(m_model);
+	delete m_snapshot;
+}
+
+void Message_List::add(Account *account, Envelope_Store *store, uint32_t uid)
+{
+	Row r;
+	r.account = account;
+	r.store = store;
+	r.uid = uid;
+	m_added.push_back(r);
+
+	if (m_flush_timer == INVALID_GTK_WATCH) {
+		m_flush_timer = g_timeout_add(FLUSH_INTERVAL, flush_timeout,
+					      this);
+	}
+}
+
+void Message_List::flush()
+{
+	size_t first = take_added();
+	if (m_snapshot != NULL) {
+		drop_snapshot();
+		return;
+	}
+	if (first == m_rows.size()) {
+		return;
+	}
+	if (m_threaded) {
+		/* the replies may go anywhere */
+		rebuild();
+		return;
+	}
+	if (m_view == NULL || m_rows.size() - first < BULK_ROWS) {
+		insert_rows(first, true);
+		return;
+	}
+
+	size_t top, cursor;
+	detach_view(&top, &cursor);
+	insert_rows(first, false);
+	attach_view(top, cursor);
+}
+
+/* Move the waiting rows to the rest, returns the first of them */
+size_t Message_List::take_added()
+{
+	if (m_flush_timer != INVALID_GTK_WATCH) {
+		g_source_remove(m_flush_timer);
+		m_flush_timer = INVALID_GTK_WATCH;
+	}
+	size_t first = m_rows.size();
+	m_rows.insert(m_rows.end(), m_added.begin(), m_added.end());
+	m_added.clear();
+	return first;
+}
+
+/* The real rows replace the ones from the snapshot, all at once */
+void Message_List::drop_snapshot()
+{
+	size_t count = m_snapshot_rows.size();
+	delete m_snapshot;
+	m_snapshot = NULL;
+	m_snapshot_rows.clear();
+	m_cached_row = NO_ROW;
+
+	/* the positions still refer to the old rows */
+	if (m_view != NULL) {
+		gtk_tree_view_set_model(m_view, NULL);
+	} else {
+		while (!m_order.empty()) {
+			m_order.pop_back();
+			m_stamp++;
+			GtkTreePath *path =
+				gtk_tree_path_new_from_indices(m_order.size(), -1);
+			gtk_tree_model_row_deleted(m_model, path);
+			gtk_tree_path_free(path);
+		}
+	}
+	m_order.clear();
+	m_depths.clear();
+	m_rows.erase(m_rows.begin(), m_rows.begin() + count);
+	if (!m_keys.empty()) {
+		m_keys.erase(m_keys.begin(), m_keys.begin() + count);
+	}
+	insert_rows(0, m_view == NULL);
+	if (m_view != NULL) {
+		gtk_tree_view_set_model(m_view, m_model);
+	}
+}
+
+void Message_List::show_snapshot(Snapshot *snapshot,
+				 const std::vector<Account *> &accounts)
+{
+	if (!m_rows.empty() || !m_added.empty()) {
+		/* too late, the real rows are there already */
+		delete snapshot;
+		return;
+	}
+	m_snapshot = snapshot;
+	for (size_t i = 0; i < snapshot->size(); ++i) {
+		if (accounts[i] == NULL) {
+			continue;
+		}
+		Row r;
+		r.account = accounts[i];
+		r.store = NULL;
+		r.uid = snapshot->uid(i);
+		m_rows.push_back(r);
+		m_snapshot_rows.push_back(i);
+	}
+	insert_rows(0, true);
+}
+
+bool Message_List::save_snapshot(const std::string &fname)
+{
+	if (m_snapshot == NULL) {
+		flush();
+	}
+
+	size_t top = 0;
+	GtkTreePath *start, *end;
+	if (m_view != NULL &&
+	    gtk_tree_view_get_visible_range(m_view, &start, &end)) {
+		top = gtk_tree_path_get_indices(start)[0];
+		gtk_tree_path_free(start);
+		gtk_tree_path_free(end);
+	}
+	std::vector<Snapshot_Row> rows;
+	for (size_t pos = top;
+	     pos < m_order.size() && rows.size() < SNAPSHOT_ROWS; ++pos) {
+		size_t row = m_order[pos];
+		fill_cache(row);
+		Snapshot_Row r;
+		r.server = m_rows[row].account->server();
+		r.uid = m_rows[row].uid;
+		r.from = m_cached_from;
+		/* the conversations are saved as they are indented */
+		if (!m_depths.empty()) {
+			r.subject.assign(2 * std::min(m_depths[pos], MAX_INDENT),
+					 ' ');
+		}
+		r.subject += m_cached_subject;
+		rows.push_back(r);
+	}
+	return Snapshot::save(fname, rows);
+}
+
+/* The view forgets where it was, it is put back to the same rows */
+void Message_List::detach_view(size_t *top, size_t *cursor)
+{
+	*top = NO_ROW;
+	GtkTreePath *start, *end;
+	if (gtk_tree_view_get_visible_range(m_view, &start, &end)) {
+		*top = row_at_path(start);
+		gtk_tree_path_free(start);
+		gtk_tree_path_free(end);
+	}
+	*cursor = NO_ROW;
+	GtkTreePath *path;
+	gtk_tree_view_get_cursor(m_view, &path, NULL);
+	if (path != NULL) {
+		*cursor = row_at_path(path);
+		gtk_tree_path_free(path);
+	}
+	gtk_tree_view_set_model(m_view, NULL);
+}
+
+void Message_List::attach_view(size_t top, size_t cursor)
+{
+	gtk_tree_view_set_model(m_view, m_model);
+
+	/* the rows may be hidden now */
+	GtkTreePath *path;
+	if (cursor != NO_ROW && position(cursor) < m_order.size()) {
+		path = gtk_tree_path_new_from_indices(position(cursor), -1);
+		gtk_tree_view_set_cursor(m_view, path, NULL, FALSE);
+		gtk_tree_path_free(path);
+	}
+	if (top != NO_ROW && position(top) < m_order.size()) {
+		path = gtk_tree_path_new_from_indices(position(top), -1);
+		gtk_tree_view_scroll_to_cell(m_view, path, NULL, TRUE, 0, 0);
+		gtk_tree_path_free(path);
+	}
+}
+
+/*
+ * The rows from the given one onwards are new. When sorted, they are
+ * sorted among themselves and merged with the rest, which is much faster
+ * than inserting them one by one.
+ */
+void Message_List::insert_rows(size_t first, bool notify)
+{
+	/* the keys are kept for all the rows */
+	if (is_text_column(m_sort_column)) {
+		for (size_t row = m_keys.size(); row < m_rows.size(); ++row) {
+			m_keys.push_back(sort_key(row));
+		}
+	}
+	if (m_threaded) {
+		assert(first == 0);
+		thread_order();
+	} else if (m_sort_column >= 0) {
+		std::vector<size_t> added;
+		added.reserve(m_rows.size() - first);
+		for (size_t row = first; row < m_rows.size(); ++row) {
+			if (visible(row)) {
+				added.push_back(row);
+			}
+		}
+		std::stable_sort(added.begin(), added.end(), Key_Less(this));
+
+		/* the earlier rows go first among equal ones */
+		std::vector<size_t> order;
+		order.reserve(m_rows.size());
+		std::merge(m_order.begin(), m_order.end(), added.begin(),
+			   added.end(), std::back_inserter(order),
+			   Key_Less(this));
+		m_order.swap(order);
+	} else {
+		for (size_t row = first; row < m_rows.size(); ++row) {
+			if (visible(row)) {
+				m_order.push_back(row);
+			}
+		}
+	}
+	m_stamp++;
+
+	if (!notify) {
+		return;
+	}
+	/* in the order of the positions, so that each one is already right */
+	for (size_t pos = 0; pos < m_order.size(); ++pos) {
+		if (m_order[pos] < first) {
+			continue;
+		}
+		GtkTreeIter iter;
+		make_iter(&iter, pos);
+		GtkTreePath *path = gtk_tree_path_new_from_indices(pos, -1);
+		gtk_tree_model_row_inserted(m_model, path, &iter);
+		gtk_tree_path_free(path);
+	}
+}
+
+bool Message_List::visible(size_t row) const
+{
+	return !m_filtered ||
+	       m_matches.count(Message_Id(m_rows[row].account, m_rows[row].uid));
+}
+
+void Message_List::set_filter(Account *account,
+			      const std::vector<uint32_t> &uids)
+{
+	m_filtered = true;
+	m_matches.clear();
+	add_to_filter(account, uids);
+}
+
+void Message_List::add_to_filter(Account *account,
+				 const std::vector<uint32_t> &uids)
+{
+	for (size_t i = 0; i < uids.size(); ++i) {
+		m_matches.insert(Message_Id(account, uids[i]));
+	}
+	refilter();
+}
+
+void Message_List::clear_filter()
+{
+	if (!m_filtered) {
+		return;
+	}
+	m_filtered = false;
+	m_matches.clear();
+	refilter();
+}
+
+void Message_List::refilter()
+{
+	take_added();
+	rebuild();
+}
+
+/* Rebuilds the positions from all the rows, in the same way as adding them */
+void Message_List::rebuild()
+{
+	if (m_view == NULL) {
+		while (!m_order.empty()) {
+			m_order.pop_back();
+			m_stamp++;
+			GtkTreePath *path =
+				gtk_tree_path_new_from_indices(m_order.size(), -1);
+			gtk_tree_model_row_deleted(m_model, path);
+			gtk_tree_path_free(path);
+		}
+		insert_rows(0, true);
+		return;
+	}
+	size_t top, cursor;
+	detach_view(&top, &cursor);
+	m_order.clear();
+	insert_rows(0, false);
+	attach_view(top, cursor);
+}
+
+/* All the rows that are shown, in the order of the conversations */
+void Message_List::thread_order()
+{
+	std::map<Message_Id, size_t> rows;
+	std::vector<Account *> accounts;
+	for (size_t row = 0; row < m_rows.size(); ++row) {
+		if (!visible(row)) {
+			continue;
+		}
+		Account *account = m_rows[row].account;
+		ins(rows, Message_Id(account, m_rows[row].uid), row);
+		if (std::find(accounts.begin(), accounts.end(), account) ==
+		    accounts.end()) {
+			accounts.push_back(account);
+		}
+	}
+
+	m_order.clear();
+	m_depths.clear();
+	for (size_t i = 0; i < accounts.size(); ++i) {
+		std::vector<Thread_Entry> sequence =
+			accounts[i]->threads()->sequence();
+		for (size_t j = 0; j < sequence.size(); ++j) {
+			std::map<Message_Id, size_t>::iterator row =
+				rows.find(Message_Id(accounts[i],
+						     sequence[j].uid));
+			if (row == rows.end()) {
+				continue;
+			}
+			m_order.push_back(row->second);
+			m_depths.push_back(sequence[j].depth);
+			rows.erase(row);
+		}
+	}
+	/* not threaded yet */
+	for (const_map_iter<Message_Id, size_t> i(rows); i; i.next()) {
+		m_order.push_back(*i);
+		m_depths.push_back(0);
+	}
+}
+
+void Message_List::set_threaded(bool threaded)
+{
+	if (threaded == m_threaded) {
+		return;
+	}
+	m_threaded = threaded;
+	m_depths.clear();
+	if (threaded) {
+		/* the order they were added in, when not threaded again */
+		m_sort_column = -1;
+		m_keys.clear();
+	}
+	refilter();
+}
+
+void Message_List::update_threads()
+{
+	if (m_threaded) {
+		refilter();
+	}
+}
+
+size_t Message_List::position(size_t row) const
+{
+	return std::find(m_order.begin(), m_order.end(), row) -
+	       m_order.begin();
+}
+
+size_t Message_List::row_at_path(GtkTreePath *path) const
+{
+	size_t pos = gtk_tree_path_get_indices(path)[0];
+	return pos < m_order.size() ? m_order[pos] : NO_ROW;
+}
+
+int Message_List::flush_timeout(gpointer ptr)
+{
+	Message_List *self = (Message_List *) ptr;
+
+	self->m_flush_timer = INVALID_GTK_WATCH;
+	self->flush();
+
+	return FALSE;
+}
+
+void Message_List::remove(Account *account, uint32_t uid)
+{
+	std::set<uint32_t> uids;
+	uids.insert(uid);
+	remove_rows(account, &uids);
+}
+
+void Message_List::remove(Account *account, const std::vector<uint32_t> &uids)
+{
+	std::set<uint32_t> removed(uids.begin(), uids.end());
+	remove_rows(account, &removed);
+}
+
+void Message_List::remove_account(Account *account)
+{
+	remove_rows(account, NULL);
+}
+
+/*
+ * Remove the rows of the account, or only the ones with the given UIDs.
+ * Many rows are removed while the view is detached, so that the view is
+ * not told about each one of them.
+ */
+void Message_List::remove_rows(Account *account,
+			       const std::set<uint32_t> *uids)
+{
+	flush();
+
+	std::vector<bool> removed(m_rows.size(), false);
+	size_t count = 0;
+	for (size_t row = 0; row < m_rows.size(); ++row) {
+		if (m_rows[row].account == account &&
+		    (uids == NULL || uids->count(m_rows[row].uid))) {
+			removed[row] = true;
+			count++;
+		}
+	}
+	if (count == 0) {
+		return;
+	}
+
+	bool bulk = m_view != NULL && count >= BULK_ROWS;
+	size_t top = NO_ROW, cursor = NO_ROW;
+	if (bulk) {
+		detach_view(&top, &cursor);
+		size_t n = 0;
+		for (size_t pos = 0; pos < m_order.size(); ++pos) {
+			if (removed[m_order[pos]]) {
+				continue;
+			}
+			m_order[n] = m_order[pos];
+			if (!m_depths.empty()) {
+				m_depths[n] = m_depths[pos];
+			}
+			n++;
+		}
+		m_order.resize(n);
+		if (!m_depths.empty()) {
+			m_depths.resize(n);
+		}
+		m_stamp++;
+	} else {
+		/* going backwards keeps the earlier positions valid */
+		for (size_t pos = m_order.size(); pos-- > 0;) {
+			if (!removed[m_order[pos]]) {
+				continue;
+			}
+			m_order.erase(m_order.begin() + pos);
+			if (!m_depths.empty()) {
+				m_depths.erase(m_depths.begin() + pos);
+			}
+			m_stamp++;
+
+			GtkTreePath *path = gtk_tree_path_new_from_indices(pos, -1);
+			gtk_tree_model_row_deleted(m_model, path);
+			gtk_tree_path_free(path);
+		}
+	}
+
+	/* pack the remaining rows */
+	std::vector<size_t> remap(m_rows.size(), NO_ROW);
+	size_t n = 0;
+	for (size_t i = 0; i < m_rows.size(); ++i) {
+		if (removed[i]) {
+			continue;
+		}
+		m_rows[n] = m_rows[i];
+		if (!m_keys.empty()) {
+			m_keys[n] = m_keys[i];
+		}
+		remap[i] = n++;
+	}
+	m_rows.resize(n);
+	if (!m_keys.empty()) {
+		m_keys.resize(n);
+	}
+	for (size_t pos = 0; pos < m_order.size(); ++pos) {
+		m_order[pos] = remap[m_order[pos]];
+	}
+	m_cached_row = NO_ROW;
+
+	if (bulk) {
+		attach_view(top == NO_ROW ? NO_ROW : remap[top],
+			    cursor == NO_ROW ? NO_ROW : remap[cursor]);
+	}
+}
+
+void Message_List::sort(int column, GtkSortType order)
+{
+	flush();
+
+	m_sort_column = column;
+	m_sort_order = order;
+	/* the conversations stay together no more */
+	m_threaded = false;
+	m_depths.clear();
+
+	m_keys.clear();
+	if (is_text_column(column)) {
+		m_keys.reserve(m_rows.size());
+		for (size_t i = 0; i < m_rows.size(); ++i) {
+			m_keys.push_back(sort_key(i));
+		}
+	}
+	if (m_order.empty()) {
+		return;
+	}
+
+	std::vector<gint> old_pos(m_rows.size());
+	for (size_t pos = 0; pos < m_order.size(); ++pos) {
+		old_pos[m_order[pos]] = pos;
+	}
+	std::stable_sort(m_order.begin(), m_order.end(), Key_Less(this));
+	m_stamp++;
+
+	/* new_order[new position] = old position */
+	std::vector<gint> new_order(m_order.size());
+	for (size_t pos = 0; pos < m_order.size(); ++pos) {
+		new_order[pos] = old_pos[m_order[pos]];
+	}
+	GtkTreePath *path = gtk_tree_path_new();
+	gtk_tree_model_rows_reordered(m_model, path, NULL, &new_order[0]);
+	gtk_tree_path_free(path);
+}
+
+void Message_List::fill_cache(size_t row)
+{
+	if (row == m_cached_row) {
+		return;
+	}
+	m_cached_row = row;
+	m_cached_from = "?";
+	m_cached_subject.clear();
+
+	if (m_rows[row].store == NULL) {
+		size_t i = m_snapshot_rows[row];
+		m_cached_from = m_snapshot->from(i);
+		m_cached_subject = m_snapshot->subject(i);
+		return;
+	}
+
+	/* the store keeps UTF-8, which is what GTK wants */
+	Envelope env;
+	try {
+		if (!m_rows[row].store->get(m_rows[row].uid, &env)) {
+			return;
+		}
+		if (!env.from.empty()) {
+			m_cached_from = env.from.front().email;
+		}
+		m_cached_subject = env.subject;
+	} catch (const std::runtime_error &e) {
+		debug("Unable to read message %u: %s\n", m_rows[row].uid,
+		      e.what());
+	}
+}
+
+std::string Message_List::sort_key(size_t row)
+{
+	fill_cache(row);
+	const std::string &text =
+		(m_sort_column == COL_FROM) ? m_cached_from : m_cached_subject;
+	gchar *key = g_utf8_collate_key(text.c_str(), text.size());
+	std::string out = key;
+	g_free(key);
+	return out;
+}
+
+void Message_List::make_iter(GtkTreeIter *iter, size_t pos) const
+{
+	iter->stamp = m_stamp;
+	iter->user_data = GUINT_TO_POINTER(pos);
+	iter->user_data2 = NULL;
+	iter->user_data3 = NULL;
+}
+
+bool Message_List::valid_iter(const GtkTreeIter *iter) const
+{
+	return iter != NULL && iter->stamp == m_stamp &&
+		GPOINTER_TO_UINT(iter->user_data) < m_order.size();
+}
+
+Message_List *Message_List::from_model(GtkTreeModel *model)
+{
+	return ((Model_Object *) model)->list;
+}
+
+void Message_List::init_interface(gpointer g_iface, gpointer data)
+{
+	UNUSED(data);
+
+	GtkTreeModelIface *iface = (GtkTreeModelIface *) g_iface;
+	iface->get_flags = get_flags;
+	iface->get_n_columns = get_n_columns;
+	iface->get_column_type = get_column_type;
+	iface->get_iter = get_iter;
+	iface->get_path = get_path;
+	iface->get_value = get_value;
+	iface->iter_next = iter_next;
+	iface->iter_children = iter_children;
+	iface->iter_has_child = iter_has_child;
+	iface->iter_n_children = iter_n_children;
+	iface->iter_nth_child = iter_nth_child;
+	iface->iter_parent = iter_parent;
+}
+
+GtkTreeModelFlags Message_List::get_flags(GtkTreeModel *model)
+{
+	UNUSED(model);
+	return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+gint Message_List::get_n_columns(GtkTreeModel *model)
+{
+	UNUSED(model);
+	return MAX_COL;
+}
+
+GType Message_List::get_column_type(GtkTreeModel *model, gint column)
+{
+	UNUSED(model);
+	switch (column) {
+	case COL_ID:
+		return G_TYPE_UINT;
+	case COL_FROM:
+	case COL_SUBJECT:
+		return G_TYPE_STRING;
+	case COL_ACCOUNT:
+		return G_TYPE_POINTER;
+	default:
+		return G_TYPE_INVALID;
+	}
+}
+
+gboolean Message_List::get_iter(GtkTreeModel *model, GtkTreeIter *iter,
+				GtkTreePath *path)
+{
+	Message_List *self = from_model(model);
+	if (gtk_tree_path_get_depth(path) != 1) {
+		return FALSE;
+	}
+	gint pos = gtk_tree_path_get_indices(path)[0];
+	if (pos < 0 || size_t(pos) >= self->m_order.size()) {
+		return FALSE;
+	}
+	self->make_iter(iter, pos);
+	return TRUE;
+}
+
+GtkTreePath *Message_List::get_path(GtkTreeModel *model, GtkTreeIter *iter)
+{
+	Message_List *self = from_model(model);
+	g_return_val_if_fail(self->valid_iter(iter), NULL);
+
+	GtkTreePath *path = gtk_tree_path_new();
+	gtk_tree_path_append_index(path, GPOINTER_TO_UINT(iter->user_data));
+	return path;
+}
+
+void Message_List::get_value(GtkTreeModel *model, GtkTreeIter *iter,
+			     gint column, GValue *value)
+{
+	Message_List *self = from_model(model);
+	g_value_init(value, get_column_type(model, column));
+	g_return_if_fail(self->valid_iter(iter));
+
+	size_t pos = GPOINTER_TO_UINT(iter->user_data);
+	size_t row = self->m_order[pos];
+	const Row &r = self->m_rows[row];
+	switch (column) {
+	case COL_ID:
+		g_value_set_uint(value, r.uid);
+		break;
+	case COL_FROM:
+		self->fill_cache(row);
+		g_value_set_string(value, self->m_cached_from.c_str());
+		break;
+	case COL_SUBJECT:
+		self->fill_cache(row);
+		if (!self->m_depths.empty() && self->m_depths[pos] > 0) {
+			std::string indented(2 * std::min(self->m_depths[pos],
+							  MAX_INDENT), ' ');
+			indented += self->m_cached_subject;
+			g_value_set_string(value, indented.c_str());
+		} else {
+			g_value_set_string(value,
+					   self->m_cached_subject.c_str());
+		}
+		break;
+	case COL_ACCOUNT:
+		g_value_set_pointer(value, r.account);
+		break;
+	default:
+		break;
+	}
+}
+
+gboolean Message_List::iter_next(GtkTreeModel *model, GtkTreeIter *iter)
+{
+	Message_List *self = from_model(model);
+	g_return_val_if_fail(self->valid_iter(iter), FALSE);
+
+	size_t pos = GPOINTER_TO_UINT(iter->user_data) + 1;
+	if (pos >= self->m_order.size()) {
+		iter->stamp = 0;
+		return FALSE;
+	}
+	iter->user_data = GUINT_TO_POINTER(pos);
+	return TRUE;
+}
+
+gboolean Message_List::iter_children(GtkTreeModel *model, GtkTreeIter *iter,
+				     GtkTreeIter *parent)
+{
+	Message_List *self = from_model(model);
+	if (parent != NULL || self->m_order.empty()) {
+		return FALSE;
+	}
+	self->make_iter(iter, 0);
+	return TRUE;
+}
+
+gboolean Message_List::iter_has_child(GtkTreeModel *model, GtkTreeIter *iter)
+{
+	UNUSED(model);
+	UNUSED(iter);
+	return FALSE;
+}
+
+gint Message_List::iter_n_children(GtkTreeModel *model, GtkTreeIter *iter)
+{
+	Message_List *self = from_model(model);
+	if (iter != NULL) {
+		return 0;
+	}
+	return self->m_order.size();
+}
+
+gboolean Message_List::iter_nth_child(GtkTreeModel *model, GtkTreeIter *iter,
+				      GtkTreeIter *parent, gint n)
+{
+	Message_List *self = from_model(model);
+	if (parent != NULL || n < 0 || size_t(n) >= self->m_order.size()) {
+		return FALSE;
+	}
+	self->make_iter(iter, n);
+	return TRUE;
+}
+
+gboolean Message_List::iter_parent(GtkTreeModel *model, GtkTreeIter *iter,
+				   GtkTreeIter *child)
+{
+	UNUSED(model);
+	UNUSED(iter);
+	UNUSED(child);
+	return FALSE;
+}
+
+GType Message_List::get_type()
+{
+	static GType type = 0;
+	if (type == 0) {
+		GTypeInfo info = {
+			sizeof(Model_Class),
+			NULL, NULL, NULL, NULL, NULL,
+			sizeof(Model_Object),
+			0, NULL, NULL
+		};
+		type = g_type_register_static(G_TYPE_OBJECT, "JamailMessageList",
+					      &info, GTypeFlags(0));
+
+		GInterfaceInfo iface_info = { init_interface, NULL, NULL };
+		g_type_add_interface_static(type, GTK_TYPE_TREE_MODEL,
+					    &iface_info);
+	}
+	return type;
+}
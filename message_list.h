@@ -0,0 +1,181 @@
+/*
+ * A lazily evaluated model of the message list
+ */
+#ifndef _MESSAGE_LIST_H
+#define _MESSAGE_LIST_H
+
+#include "common.h"
+#include <gtk/gtk.h>
+#include <set>
+#include <string>
+#include <vector>
+
+class Account;
+class Envelope_Store;
+class Snapshot;
+
+/* columns of the message list */
+enum {
+	COL_ID,
+	COL_FROM,
+	COL_SUBJECT,
+	COL_ACCOUNT,
+	MAX_COL
+};
+
+/*
+ * A GtkTreeModel over the envelope stores of the accounts. Only the UID of
+ * each message is kept in memory. The text of a row is built from the store
+ * when the tree view asks for it, which (in the fixed height mode) only
+ * happens for the visible rows.
+ *
+ * The rows are kept in the order they were added, and sorting only changes
+ * an index that maps the positions in the list to the rows.
+ *
+ * New rows are collected and added to the list in batches, at most at the
+ * display rate. A large batch is added while the view is detached from the
+ * model, so that the view does not update itself for every row.
+ *
+ * A filter, such as the results of a search, hides the other rows. The
+ * positions only cover the rows that are shown.
+ *
+ * Instead of sorting by a column, the list can show the conversations of
+ * each account one after another, with the replies indented below the
+ * messages they reply to. The list stays flat, so that the view can keep
+ * its fixed height mode.
+ *
+ * On start, the rows of a snapshot are shown until the first real rows are
+ * added, since opening the caches of every account takes a while.
+ */
+class Message_List {
+public:
+	Message_List();
+	~Message_List();
+
+	GtkTreeModel *model() const { return m_model; }
+	/* the view that shows the model, none by default */
+	void set_view(GtkTreeView *view) { m_view = view; }
+
+	void add(Account *account, Envelope_Store *store, uint32_t uid);
+	/*
+	 * Add the rows that are waiting, without waiting for the next batch.
+	 * The rows of a snapshot are replaced by them.
+	 */
+	void flush();
+	void remove(Account *account, uint32_t uid);
+	/* Remove many messages at once, in a single pass over the rows */
+	void remove(Account *account, const std::vector<uint32_t> &uids);
+	void remove_account(Account *account);
+
+	void sort(int column, GtkSortType order);
+
+	/* Show only the given messages */
+	void set_filter(Account *account, const std::vector<uint32_t> &uids);
+	void add_to_filter(Account *account, const std::vector<uint32_t> &uids);
+	void clear_filter();
+
+	void set_threaded(bool threaded);
+	/* Called when the conversations have been threaded again */
+	void update_threads();
+
+	/*
+	 * Show the rows of a snapshot, each one for the given account, or
+	 * not at all for NULL. Takes the ownership of the snapshot.
+	 */
+	void show_snapshot(Snapshot *snapshot,
+			   const std::vector<Account *> &accounts);
+	/* Save the rows from the first one that is visible */
+	bool save_snapshot(const std::string &fname);
+
+private:
+	struct Row {
+		Account *account;
+		Envelope_Store *store;
+		uint32_t uid;
+	};
+	typedef std::pair<Account *, uint32_t> Message_Id;
+
+	/* compares two rows by the sort keys */
+	class Key_Less {
+	public:
+		Key_Less(const Message_List *list) : m_list(list) {}
+		bool operator ()(size_t a, size_t b) const;
+	private:
+		const Message_List *m_list;
+	};
+
+	GtkTreeModel *m_model;
+	GtkTreeView *m_view;
+	int m_stamp;
+	std::vector<Row> m_rows;
+	/* maps a position in the list to an index of m_rows */
+	std::vector<size_t> m_order;
+	/* rows that have not been added to the list yet */
+	std::vector<Row> m_added;
+	int m_flush_timer;
+	bool m_filtered;
+	std::set<Message_Id> m_matches;
+	bool m_threaded;
+	/* how deep each position is in its conversation, when threaded */
+	std::vector<unsigned int> m_depths;
+	/* the rows from the snapshot are the first ones, without a store */
+	Snapshot *m_snapshot;
+	/* the entry of the snapshot of each of those rows */
+	std::vector<size_t> m_snapshot_rows;
+
+	int m_sort_column;
+	GtkSortType m_sort_order;
+	/* sort keys of the rows, when sorted by a text column */
+	std::vector<std::string> m_keys;
+
+	/* the text of the row that was asked for the last time */
+	size_t m_cached_row;
+	std::string m_cached_from;
+	std::string m_cached_subject;
+
+	size_t take_added();
+	void remove_rows(Account *account, const std::set<uint32_t> *uids);
+	void drop_snapshot();
+	void insert_rows(size_t first, bool notify);
+	void thread_order();
+	bool visible(size_t row) const;
+	void refilter();
+	void rebuild();
+	void detach_view(size_t *top, size_t *cursor);
+	void attach_view(size_t top, size_t cursor);
+	size_t position(size_t row) const;
+	size_t row_at_path(GtkTreePath *path) const;
+	void fill_cache(size_t row);
+	std::string sort_key(size_t row);
+	void make_iter(GtkTreeIter *iter, size_t pos) const;
+	bool valid_iter(const GtkTreeIter *iter) const;
+
+	/* GtkTreeModel interface */
+	static int flush_timeout(gpointer ptr);
+
+	static Message_List *from_model(GtkTreeModel *model);
+	static void init_interface(gpointer g_iface, gpointer data);
+	static GtkTreeModelFlags get_flags(GtkTreeModel *model);
+	static gint get_n_columns(GtkTreeModel *model);
+	static GType get_column_type(GtkTreeModel *model, gint column);
+	static gboolean get_iter(GtkTreeModel *model, GtkTreeIter *iter,
+				 GtkTreePath *path);
+	static GtkTreePath *get_path(GtkTreeModel *model, GtkTreeIter *iter);
+	static void get_value(GtkTreeModel *model, GtkTreeIter *iter,
+			      gint column, GValue *value);
+	static gboolean iter_next(GtkTreeModel *model, GtkTreeIter *iter);
+	static gboolean iter_children(GtkTreeModel *model, GtkTreeIter *iter,
+				      GtkTreeIter *parent);
+	static gboolean iter_has_child(GtkTreeModel *model, GtkTreeIter *iter);
+	static gint iter_n_children(GtkTreeModel *model, GtkTreeIter *iter);
+	static gboolean iter_nth_child(GtkTreeModel *model, GtkTreeIter *iter,
+				       GtkTreeIter *parent, gint n);
+	static gboolean iter_parent(GtkTreeModel *model, GtkTreeIter *iter,
+				    GtkTreeIter *child);
+
+	static GType get_type();
+
+	DISABLE_COPY_AND_ASSIGN(Message_List);
+};
+
+#endif
@@ -0,0 +1,497 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "net_thread.h"
+#include "stats.h"
+#include "utils.h"
+#include <stdexcept>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+namespace {
+
+/* the amount of data to read at once, it grows with the throughput */
+const size_t MIN_READ_SIZE = 4096;
+const size_t MAX_READ_SIZE = 64 * 1024;
+/* the space given to zlib at once */
+const size_t ZLIB_CHUNK = 16 * 1024;
+
+}
+
+Net_Thread::Net_Thread(SSL *ssl, const std::string &server,
+		       GSourceFunc ready, gpointer data) :
+	m_ssl(ssl),
+	m_fd(SSL_get_fd(ssl)),
+	m_server(server),
+	m_ready(ready),
+	m_data(data),
+	m_thread(NULL),
+	m_stop(0),
+	m_notified(0),
+	m_compress_tag(0),
+	m_read_size(MIN_READ_SIZE),
+	m_want_write(false),
+	m_compressing(false),
+	m_wire_bytes(0),
+	m_plain_bytes(0),
+	m_streaming(false),
+	m_stream_begin(0),
+	m_stream_left(0),
+	m_batch(NULL)
+{
+	if (pipe(m_wake_pipe) < 0) {
+		SSL_free(m_ssl);
+		close(m_fd);
+		throw std::runtime_error(strf("Can not create a pipe (%s)",
+					      strerror(errno)));
+	}
+	set_nonblock(m_wake_pipe[0], true);
+	set_nonblock(m_wake_pipe[1], true);
+}
+
+Net_Thread::~Net_Thread()
+{
+	if (m_thread != NULL) {
+		__atomic_store_n(&m_stop, 1, __ATOMIC_SEQ_CST);
+		if (write(m_wake_pipe[1], "", 1) < 0) {
+			/* the pipe is full, the thread wakes up anyway */
+		}
+		g_thread_join(m_thread);
+	}
+	/* the thread is gone, so the callback can not be added again */
+	if (m_notified) {
+		g_idle_remove_by_data(m_data);
+	}
+	Net_Batch *batch;
+	while (m_incoming.pop(&batch)) {
+		delete batch;
+	}
+	std::string *s;
+	while (m_outgoing.pop(&s)) {
+		delete s;
+	}
+	delete m_batch;
+	if (m_compressing) {
+		inflateEnd(&m_inflate);
+		deflateEnd(&m_deflate);
+	}
+	close(m_wake_pipe[0]);
+	close(m_wake_pipe[1]);
+	SSL_free(m_ssl);
+	close(m_fd);
+}
+
+void Net_Thread::start()
+{
+	m_thread = g_thread_new("net", thread_main, this);
+}
+
+void Net_Thread::send(const std::string &data)
+{
+	m_outgoing.push(new std::string(data));
+	if (write(m_wake_pipe[1], "", 1) < 0) {
+		/* already full of wake-ups */
+	}
+}
+
+Net_Batch *Net_Thread::receive()
+{
+	Net_Batch *batch;
+	if (m_incoming.pop(&batch)) {
+		return batch;
+	}
+	/*
+	 * The next batch adds the callback again. One may have been pushed
+	 * just before, while the callback was still considered pending.
+	 */
+	__atomic_store_n(&m_notified, 0, __ATOMIC_SEQ_CST);
+	if (m_incoming.pop(&batch)) {
+		return batch;
+	}
+	return NULL;
+}
+
+void Net_Thread::compress_after(int tag)
+{
+	__atomic_store_n(&m_compress_tag, tag, __ATOMIC_SEQ_CST);
+}
+
+bool Net_Thread::stopping() const
+{
+	return __atomic_load_n(&m_stop, __ATOMIC_SEQ_CST) != 0;
+}
+
+gpointer Net_Thread::thread_main(gpointer ptr)
+{
+	Net_Thread *self = (Net_Thread *) ptr;
+
+	self->run();
+
+	return NULL;
+}
+
+void Net_Thread::run()
+{
+	if (!handshake()) {
+		flush();
+		return;
+	}
+	debug("%s: %s TLS session, certificate: %s\n", m_server.c_str(),
+	      SSL_session_reused(m_ssl) ? "resumed" : "new",
+	      X509_verify_cert_error_string(SSL_get_verify_result(m_ssl)));
+
+	while (!stopping()) {
+		m_want_write = false;
+		std::string *s;
+		while (m_outgoing.pop(&s)) {
+			if (m_compressing) {
+				deflate_send(*s);
+			} else {
+				m_send_buf.append(*s);
+			}
+			delete s;
+		}
+		if (!m_send_buf.empty() && !try_write()) {
+			break;
+		}
+		if (!try_read()) {
+			break;
+		}
+		wait(true);
+	}
+	if (m_compressing) {
+		debug("%s: received %lu bytes, %lu bytes inflated\n",
+		      m_server.c_str(), (unsigned long) m_wire_bytes,
+		      (unsigned long) m_plain_bytes);
+	}
+	flush();
+}
+
+bool Net_Thread::handshake()
+{
+	uint64_t begin = stats_now();
+	while (!stopping()) {
+		m_want_write = false;
+		int ret = SSL_connect(m_ssl);
+		if (ret == 1) {
+			stats_span(PHASE_TLS_HANDSHAKE, begin);
+			return true;
+		}
+		if (!ssl_error(ret)) {
+			return false;
+		}
+		wait(!m_want_write);
+	}
+	return false;
+}
+
+/* Sleep until the socket is ready, or until woken up */
+void Net_Thread::wait(bool readable)
+{
+	pollfd fds[2];
+	fds[0].fd = m_fd;
+	fds[0].events = (readable ? POLLIN : 0) | (m_want_write ? POLLOUT : 0);
+	fds[1].fd = m_wake_pipe[0];
+	fds[1].events = POLLIN;
+	if (poll(fds, 2, -1) < 0) {
+		return;
+	}
+	if (fds[1].revents) {
+		char buf[64];
+		while (read(m_wake_pipe[0], buf, sizeof buf) > 0);
+	}
+}
+
+/* Returns false if the connection is lost */
+bool Net_Thread::ssl_error(int ret)
+{
+	int error = SSL_get_error(m_ssl, ret);
+	switch (error) {
+	case SSL_ERROR_WANT_READ:
+		/* we always wait for the socket to become readable */
+		return true;
+	case SSL_ERROR_WANT_WRITE:
+		m_want_write = true;
+		return true;
+	case SSL_ERROR_SYSCALL:
+		add_event(Net_Event::E_ERROR).data =
+			strf("SSL: syscall error (%s)", strerror(errno));
+		return false;
+	default:
+		add_event(Net_Event::E_ERROR).data = "SSL: an error occured";
+		return false;
+	}
+}
+
+bool Net_Thread::try_read()
+{
+	while (!stopping()) {
+		/* SSL decrypts directly into the buffer */
+		IO_Buffer &buf = m_compressing ? m_raw_buf : m_recv_buf;
+		char *pos = buf.reserve(m_read_size);
+		int got = SSL_read(m_ssl, pos, m_read_size);
+		if (got <= 0) {
+			return ssl_error(got);
+		}
+		buf.commit(got);
+		m_wire_bytes += got;
+		stats_add(STAT_BYTES_RECEIVED, got);
+		if (size_t(got) == m_read_size && m_read_size < MAX_READ_SIZE) {
+			m_read_size *= 2;
+		}
+		if (m_compressing) {
+			if (!inflate_raw()) {
+				return false;
+			}
+		} else {
+			m_plain_bytes += got;
+		}
+		bool compressing = m_compressing;
+		size_t i = process_recv(m_recv_buf.data(), m_recv_buf.size());
+		m_recv_buf.consume(i);
+		if (m_compressing && !compressing) {
+			/* the data after the OK was compressed already */
+			m_raw_buf.append(m_recv_buf.data(), m_recv_buf.size());
+			m_recv_buf.clear();
+			if (!inflate_raw()) {
+				return false;
+			}
+			i = process_recv(m_recv_buf.data(), m_recv_buf.size());
+			m_recv_buf.consume(i);
+		}
+		stream_literal();
+		flush();
+	}
+	return true;
+}
+
+bool Net_Thread::try_write()
+{
+	int written = SSL_write(m_ssl, m_send_buf.data(), m_send_buf.size());
+	if (written <= 0) {
+		return ssl_error(written);
+	}
+	m_send_buf.consume(written);
+	stats_add(STAT_BYTES_SENT, written);
+	if (!m_send_buf.empty()) {
+		/* the rest when the socket becomes writable */
+		m_want_write = true;
+	}
+	return true;
+}
+
+void Net_Thread::start_compress()
+{
+	memset(&m_inflate, 0, sizeof m_inflate);
+	memset(&m_deflate, 0, sizeof m_deflate);
+	/* raw deflate, without the zlib header */
+	inflateInit2(&m_inflate, -MAX_WBITS);
+	deflateInit2(&m_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS,
+		     8, Z_DEFAULT_STRATEGY);
+	m_compressing = true;
+}
+
+/* Inflate what has been read into the receive buffer */
+bool Net_Thread::inflate_raw()
+{
+	m_inflate.next_in = (Bytef *) m_raw_buf.data();
+	m_inflate.avail_in = m_raw_buf.size();
+	do {
+		m_inflate.next_out = (Bytef *) m_recv_buf.reserve(ZLIB_CHUNK);
+		m_inflate.avail_out = ZLIB_CHUNK;
+		int ret = inflate(&m_inflate, Z_SYNC_FLUSH);
+		size_t produced = ZLIB_CHUNK - m_inflate.avail_out;
+		m_recv_buf.commit(produced);
+		m_plain_bytes += produced;
+		if (ret == Z_BUF_ERROR) {
+			/* needs more input */
+			break;
+		}
+		if (ret != Z_OK) {
+			add_event(Net_Event::E_ERROR).data =
+				"Corrupted compressed stream";
+			return false;
+		}
+	} while (m_inflate.avail_out == 0 || m_inflate.avail_in > 0);
+	m_raw_buf.consume(m_raw_buf.size() - m_inflate.avail_in);
+	return true;
+}
+
+/* Each command is flushed, the server waits for it */
+void Net_Thread::deflate_send(const std::string &data)
+{
+	m_deflate.next_in = (Bytef *) data.data();
+	m_deflate.avail_in = data.size();
+	do {
+		m_deflate.next_out = (Bytef *) m_send_buf.reserve(ZLIB_CHUNK);
+		m_deflate.avail_out = ZLIB_CHUNK;
+		deflate(&m_deflate, Z_SYNC_FLUSH);
+		m_send_buf.commit(ZLIB_CHUNK - m_deflate.avail_out);
+	} while (m_deflate.avail_out == 0);
+}
+
+size_t Net_Thread::process_recv(const char *data, size_t length)
+{
+	size_t begin = 0;
+	while (1) {
+		/* wait until the whole response, with literals, has arrived */
+		size_t end = m_assembler.find_end(&data[begin], length - begin);
+		if (end == std::string::npos) {
+			break;
+		}
+		m_assembler.reset();
+
+		if (m_streaming) {
+			/*
+			 * The rest of the part is handed on, and the response
+			 * is parsed as if the part was empty.
+			 */
+			assert(begin == 0);
+			if (m_stream_left > 0) {
+				add_event(Net_Event::E_PART_DATA).data.assign(
+					&data[m_stream_begin], m_stream_left);
+				stats_add(STAT_PART_BYTES, m_stream_left);
+			}
+			std::string response(data, m_stream_begin);
+			response.erase(response.rfind('{'));
+			response += "\"\"";
+			response.append(&data[m_stream_begin + m_stream_left],
+					&data[end]);
+			m_streaming = false;
+			add_response(response.data(), response.size());
+		} else {
+			add_response(&data[begin], end);
+			if (compress_reply(&data[begin], end)) {
+				/* the rest has to be inflated first */
+				begin += end + 2;
+				break;
+			}
+		}
+		begin += end + 2;
+	}
+	return begin;
+}
+
+/* Checks for the OK of the COMPRESS command, and begins compressing */
+bool Net_Thread::compress_reply(const char *data, size_t length)
+{
+	int tag = __atomic_load_n(&m_compress_tag, __ATOMIC_SEQ_CST);
+	if (tag == 0 || m_compressing) {
+		return false;
+	}
+	std::string prefix = strf("%d ", tag);
+	if (length < prefix.size() ||
+	    memcmp(data, prefix.data(), prefix.size()) != 0) {
+		return false;
+	}
+	__atomic_store_n(&m_compress_tag, 0, __ATOMIC_SEQ_CST);
+	if (length < prefix.size() + 2 ||
+	    strncasecmp(&data[prefix.size()], "OK", 2) != 0) {
+		return false;
+	}
+	start_compress();
+	return true;
+}
+
+/* The FETCH responses are parsed, the rest are left for the main loop */
+void Net_Thread::add_response(const char *data, size_t length)
+{
+	stats_add(STAT_RESPONSES);
+	IMAP_Tokenizer parser(data, length);
+	uint32_t seq = 0;
+	try {
+		if (parser.skip('*') && parser.check_digit()) {
+			seq = parser.number();
+			if (parser.atom() != "FETCH") {
+				seq = 0;
+			}
+		}
+	} catch (const imap_parse_error &e) {
+		seq = 0;
+	}
+	if (seq == 0) {
+		add_event(Net_Event::E_RESPONSE).data.assign(data, length);
+		return;
+	}
+
+	Net_Event &event = add_event(Net_Event::E_FETCH);
+	event.seq = seq;
+	try {
+		parse_fetch_reply(parser, &event.reply);
+		if (event.reply.items & Fetch_Reply::F_ENVELOPE) {
+			stats_add(STAT_ENVELOPES);
+		}
+	} catch (const imap_parse_error &e) {
+		stats_add(STAT_PARSE_ERRORS);
+		printf("IMAP parse error: %s\n", e.what());
+		printf("\"%s\"\n", parser.response().str().c_str());
+		m_batch->pop_back();
+	}
+}
+
+/*
+ * The contents of a body part are handed on as they arrive, instead of
+ * buffering the whole literal. The incomplete response is always at the
+ * beginning of the buffer.
+ */
+void Net_Thread::stream_literal()
+{
+	size_t begin, left;
+	if (!m_assembler.in_literal(m_recv_buf.size(), &begin, &left)) {
+		return;
+	}
+	if (!m_streaming) {
+		/* the main loop knows the UIDs by the sequence numbers */
+		Net_Event &event = add_event(Net_Event::E_PART_BEGIN);
+		if (!parse_part_prefix(m_recv_buf.data(), begin - 2,
+				       &event.seq, &event.reply.env.uid,
+				       &event.reply.section)) {
+			m_batch->pop_back();
+			return;
+		}
+		m_streaming = true;
+		m_stream_begin = begin;
+		m_stream_left = left;
+	}
+	size_t count = m_recv_buf.size() - begin;
+	if (count > 0) {
+		add_event(Net_Event::E_PART_DATA).data.assign(
+			&m_recv_buf.data()[begin], count);
+		stats_add(STAT_PART_BYTES, count);
+		m_recv_buf.truncate(begin);
+		m_assembler.remove_literal(count);
+		m_stream_left -= count;
+	}
+}
+
+Net_Event &Net_Thread::add_event(Net_Event::Type type)
+{
+	if (m_batch == NULL) {
+		m_batch = new Net_Batch;
+	}
+	m_batch->push_back(Net_Event());
+	Net_Event &event = m_batch->back();
+	event.type = type;
+	return event;
+}
+
+/* Hand the events so far to the main loop */
+void Net_Thread::flush()
+{
+	if (m_batch == NULL) {
+		return;
+	}
+	m_incoming.push(m_batch);
+	m_batch = NULL;
+	if (__atomic_exchange_n(&m_notified, 1, __ATOMIC_SEQ_CST) == 0) {
+		g_idle_add(m_ready, m_data);
+	}
+}
@@ -0,0 +1,139 @@
+/*
+ * The TLS stream of a connection, on a thread of its own
+ */
+#ifndef _NET_THREAD_H
+#define _NET_THREAD_H
+
+#include "imap_parser.h"
+#include "ioutils.h"
+#include "queue.h"
+#include <glib.h>
+#include <openssl/ssl.h>
+#include <zlib.h>
+#include <list>
+#include <string>
+
+/* something that happened on the connection */
+struct Net_Event {
+	enum Type {
+		/* a response that was not parsed yet */
+		E_RESPONSE,
+		/* a FETCH response, parsed into the reply */
+		E_FETCH,
+		/* a body part begins, the reply tells which one */
+		E_PART_BEGIN,
+		/* a piece of the part */
+		E_PART_DATA,
+		/* the connection is lost, the data tells why */
+		E_ERROR
+	} type;
+	/* the response without the CRLF, a piece of a part or the error */
+	std::string data;
+	uint32_t seq;
+	Fetch_Reply reply;
+
+	Net_Event() :
+		type(E_RESPONSE),
+		seq(0)
+	{}
+};
+
+/* the events of one read, in the order they happened */
+typedef std::list<Net_Event> Net_Batch;
+
+/*
+ * Does the TLS handshake, the encryption and the decryption of one
+ * connection, and splits what the server sends into responses. The bulk
+ * of the responses during a sync are FETCH responses, and those are parsed
+ * here as well, so that the main loop only has to act on them. The body
+ * parts are handed on as they arrive, like in the main loop before.
+ *
+ * The events are passed to the main loop in batches through a lock-free
+ * queue. When the queue turns from empty to non-empty, the given callback
+ * is added as an idle source, and it should receive() until there is
+ * nothing more. Commands to send go the other way through another queue.
+ *
+ * With COMPRESS=DEFLATE (RFC 4978), the stream is compressed between the
+ * TLS layer and the buffers. What arrives is inflated piece by piece as it
+ * is read, so the responses are framed from the plain text as before.
+ */
+class Net_Thread {
+public:
+	/* Takes the ownership of the SSL object and its socket */
+	Net_Thread(SSL *ssl, const std::string &server, GSourceFunc ready,
+		   gpointer data);
+	/* Stops the thread and drops the events that were not received */
+	~Net_Thread();
+
+	void start();
+	void send(const std::string &data);
+	/* Returns the next batch, or NULL if there is none */
+	Net_Batch *receive();
+	/*
+	 * Everything after the OK of the COMPRESS command with the given tag
+	 * is compressed, both ways. Called before sending the command, and
+	 * nothing else may be sent before its reply.
+	 */
+	void compress_after(int tag);
+
+private:
+	SSL *m_ssl;
+	int m_fd;
+	std::string m_server;
+	GSourceFunc m_ready;
+	gpointer m_data;
+	GThread *m_thread;
+	/* written to wake up the thread */
+	int m_wake_pipe[2];
+	int m_stop;
+	/* whether the callback has been added and not run yet */
+	int m_notified;
+	Spsc_Queue<std::string *> m_outgoing;
+	Spsc_Queue<Net_Batch *> m_incoming;
+	/* the tag of the COMPRESS command, zero if none */
+	int m_compress_tag;
+
+	/* owned by the thread */
+	IO_Buffer m_send_buf;
+	IO_Buffer m_recv_buf;
+	/* grows while the reads fill the whole space given to SSL_read */
+	size_t m_read_size;
+	Response_Assembler m_assembler;
+	bool m_want_write;
+	bool m_compressing;
+	/* the compressed data that has been read and not inflated yet */
+	IO_Buffer m_raw_buf;
+	z_stream m_inflate;
+	z_stream m_deflate;
+	/* the bytes on the wire and in plain text, for the debug output */
+	uint64_t m_wire_bytes;
+	uint64_t m_plain_bytes;
+	/* a body part is being handed on while its literal arrives */
+	bool m_streaming;
+	/* where the literal begins in the response, and how much is left */
+	size_t m_stream_begin;
+	size_t m_stream_left;
+	Net_Batch *m_batch;
+
+	static gpointer thread_main(gpointer ptr);
+	bool stopping() const;
+	void run();
+	bool handshake();
+	void wait(bool readable);
+	bool try_read();
+	bool try_write();
+	bool ssl_error(int ret);
+	void start_compress();
+	bool inflate_raw();
+	void deflate_send(const std::string &data);
+	size_t process_recv(const char *data, size_t length);
+	bool compress_reply(const char *data, size_t length);
+	void add_response(const char *data, size_t length);
+	void stream_literal();
+	Net_Event &add_event(Net_Event::Type type);
+	void flush();
+
+	DISABLE_COPY_AND_ASSIGN(Net_Thread);
+};
+
+#endif
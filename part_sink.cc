@@ -0,0 +1,72 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "part_sink.h"
+#include "encoding.h"
+#include "imap_parser.h"
+
+Decoding_Sink::Decoding_Sink(const Body_Part &part, bool text,
+			     Part_Sink *next) :
+	m_transfer(Transfer_Decoder::create(part.encoding)),
+	m_charset(NULL),
+	m_next(next)
+{
+	if (text) {
+		m_charset = new Charset_Decoder(part.charset);
+	}
+}
+
+Decoding_Sink::~Decoding_Sink()
+{
+	delete m_transfer;
+	delete m_charset;
+	delete m_next;
+}
+
+void Decoding_Sink::write(const char *data, size_t length)
+{
+	if (m_transfer == NULL) {
+		m_decoded.assign(data, length);
+	} else {
+		m_transfer->decode(data, length, m_decoded);
+	}
+	pass(m_decoded);
+}
+
+void Decoding_Sink::finish()
+{
+	if (m_transfer != NULL) {
+		m_transfer->finish(m_decoded);
+	}
+	pass(m_decoded);
+	if (m_charset != NULL) {
+		m_charset->finish(m_text);
+		if (!m_text.empty()) {
+			m_next->write(m_text.data(), m_text.size());
+		}
+		m_text.clear();
+	}
+	m_next->finish();
+}
+
+/* the buffers are cleared but keep their capacity for the next piece */
+void Decoding_Sink::pass(std::string &data)
+{
+	if (m_charset != NULL) {
+		m_charset->decode(data.data(), data.size(), m_text);
+		data.clear();
+		if (!m_text.empty()) {
+			m_next->write(m_text.data(), m_text.size());
+		}
+		m_text.clear();
+		return;
+	}
+	if (!data.empty()) {
+		m_next->write(data.data(), data.size());
+	}
+	data.clear();
+}
@@ -0,0 +1,53 @@
+/*
+ * Receiver of the contents of a body part
+ */
+#ifndef _PART_SINK_H
+#define _PART_SINK_H
+
+#include "common.h"
+#include <string>
+
+class Transfer_Decoder;
+class Charset_Decoder;
+struct Body_Part;
+
+/*
+ * A large part is handed on in pieces as it arrives, so it never has to be
+ * kept in memory as a whole. If the part can not be received completely,
+ * the sink is destroyed without calling finish().
+ */
+class Part_Sink {
+public:
+	virtual ~Part_Sink() {}
+
+	virtual void write(const char *data, size_t length) = 0;
+	/* the whole part has been written */
+	virtual void finish() = 0;
+};
+
+/*
+ * Decodes the transfer encoding of a part, and converts text to UTF-8, on
+ * the way to another sink. Only one piece at a time is kept in memory.
+ */
+class Decoding_Sink: public Part_Sink {
+public:
+	/* takes the ownership of the next sink */
+	Decoding_Sink(const Body_Part &part, bool text, Part_Sink *next);
+	~Decoding_Sink();
+
+	void write(const char *data, size_t length);
+	void finish();
+
+private:
+	Transfer_Decoder *m_transfer;
+	Charset_Decoder *m_charset;
+	Part_Sink *m_next;
+	std::string m_decoded;
+	std::string m_text;
+
+	void pass(std::string &data);
+
+	DISABLE_COPY_AND_ASSIGN(Decoding_Sink);
+};
+
+#endif
@@ -0,0 +1,75 @@
+/*
+ * A lock-free queue between two threads
+ */
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+#include "common.h"
+
+/*
+ * A queue with one thread pushing and another one popping. It is a linked
+ * list that always contains a dummy node at its head: the producer only
+ * touches the tail and the consumer only the head, so the single atomic
+ * link between them is all they share. The values are copied in and out,
+ * so a pointer or some other cheap type is best.
+ */
+template<class T>
+class Spsc_Queue {
+public:
+	Spsc_Queue() :
+		m_head(new Node),
+		m_tail(m_head)
+	{}
+
+	~Spsc_Queue()
+	{
+		while (m_head != NULL) {
+			Node *next = m_head->next;
+			delete m_head;
+			m_head = next;
+		}
+	}
+
+	/* by the producer */
+	void push(const T &value)
+	{
+		Node *node = new Node;
+		node->value = value;
+		/* the value has to be written before the node is seen */
+		__atomic_store_n(&m_tail->next, node, __ATOMIC_SEQ_CST);
+		m_tail = node;
+	}
+
+	/* by the consumer, returns false if the queue is empty */
+	bool pop(T *value)
+	{
+		Node *next = __atomic_load_n(&m_head->next, __ATOMIC_SEQ_CST);
+		if (next == NULL) {
+			return false;
+		}
+		/* the node becomes the new dummy */
+		*value = next->value;
+		next->value = T();
+		delete m_head;
+		m_head = next;
+		return true;
+	}
+
+private:
+	struct Node {
+		T value;
+		Node *next;
+
+		Node() :
+			value(),
+			next(NULL)
+		{}
+	};
+
+	Node *m_head;
+	Node *m_tail;
+
+	DISABLE_COPY_AND_ASSIGN(Spsc_Queue);
+};
+
+#endif
@@ -0,0 +1,603 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "search_index.h"
+#include "part_sink.h"
+#include "store.h"
+#include "utils.h"
+#include <algorithm>
+#include <iterator>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = "JMSRC01";
+/* shorter words are not indexed, longer ones are cut */
+const size_t MIN_WORD = 2;
+const size_t MAX_WORD = 40;
+/* only the beginning of a long body is indexed */
+const size_t MAX_BODY_TEXT = 256 * 1024;
+/* a longer journal is folded into the snapshot when the index is opened */
+const off_t MAX_JOURNAL = 4 * 1024 * 1024;
+
+enum {
+	J_ADD = 1,
+	J_REMOVE
+};
+
+/* FNV-1a */
+uint32_t checksum(const char *data, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+void put_u32(std::string &buf, uint32_t value)
+{
+	buf.append((const char *) &value, sizeof value);
+}
+
+void put_varint(std::string &buf, uint32_t value)
+{
+	while (value >= 0x80) {
+		buf += char(value | 0x80);
+		value >>= 7;
+	}
+	buf += char(value);
+}
+
+class Varint_Reader {
+public:
+	Varint_Reader(const char *data, size_t length) :
+		m_pos(data),
+		m_end(data + length)
+	{
+	}
+
+	uint32_t varint()
+	{
+		uint32_t value = 0;
+		for (int shift = 0; shift < 35; shift += 7) {
+			if (m_pos == m_end) {
+				throw store_error("Truncated varint");
+			}
+			unsigned char c = *m_pos++;
+			value |= uint32_t(c & 0x7f) << shift;
+			if (c < 0x80) {
+				return value;
+			}
+		}
+		throw store_error("Invalid varint");
+	}
+
+	std::string bytes(size_t length)
+	{
+		if (size_t(m_end - m_pos) < length) {
+			throw store_error("Truncated string");
+		}
+		std::string out(m_pos, length);
+		m_pos += length;
+		return out;
+	}
+
+	bool at_end() const { return m_pos == m_end; }
+
+private:
+	const char *m_pos, *m_end;
+};
+
+/*
+ * Words are runs of letters and digits. Only ASCII is folded to lower
+ * case, the other characters of UTF-8 are kept as they are.
+ */
+bool word_char(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	       (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+void split_words(const std::string &text, std::vector<std::string> *words)
+{
+	size_t i = 0;
+	while (i < text.size()) {
+		while (i < text.size() && !word_char(text[i])) {
+			i++;
+		}
+		std::string word;
+		while (i < text.size() && word_char(text[i])) {
+			char c = text[i++];
+			if (c >= 'A' && c <= 'Z') {
+				c += 'a' - 'A';
+			}
+			if (word.size() < MAX_WORD) {
+				word += c;
+			}
+		}
+		if (word.size() >= MIN_WORD) {
+			words->push_back(word);
+		}
+	}
+}
+
+void add_words(const std::string &text, std::set<std::string> *words)
+{
+	std::vector<std::string> list;
+	split_words(text, &list);
+	words->insert(list.begin(), list.end());
+}
+
+void add_words(const Address_List &list, std::set<std::string> *words)
+{
+	for (size_t i = 0; i < list.size(); ++i) {
+		add_words(list[i].name, words);
+		add_words(list[i].email, words);
+	}
+}
+
+bool read_file(const std::string &fname, std::string *data)
+{
+	FILE *f = fopen(fname.c_str(), "rb");
+	if (f == NULL) {
+		return false;
+	}
+	char buf[65536];
+	while (1) {
+		size_t got = fread(buf, 1, sizeof buf, f);
+		if (got == 0)
+			break;
+		data->append(buf, got);
+	}
+	fclose(f);
+	return true;
+}
+
+void write_all(int fd, const char *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			throw store_error(strf("Unable to write: %s",
+					       strerror(errno)));
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+}
+
+/* the text is converted to UTF-8 on the way */
+class Search_Index::Writer: public Part_Sink {
+public:
+	Writer(Search_Index *index, uint32_t uid) :
+		m_index(index),
+		m_uid(uid)
+	{
+	}
+
+	void write(const char *data, size_t length)
+	{
+		if (m_text.size() < MAX_BODY_TEXT) {
+			m_text.append(data, std::min(length,
+					MAX_BODY_TEXT - m_text.size()));
+		}
+	}
+
+	void finish()
+	{
+		m_index->add(m_uid, m_text);
+	}
+
+private:
+	Search_Index *m_index;
+	uint32_t m_uid;
+	std::string m_text;
+};
+
+Search_Index::Search_Index(const std::string &path) :
+	m_path(path),
+	m_journal_fd(-1),
+	m_dirty(false)
+{
+}
+
+Search_Index::~Search_Index()
+{
+	close();
+}
+
+void Search_Index::open()
+{
+	std::string name = m_path + ".log";
+	m_journal_fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (m_journal_fd < 0) {
+		throw store_error("Can not open " + name);
+	}
+	load_snapshot();
+	load_journal();
+
+	struct stat st;
+	fstat(m_journal_fd, &st);
+	if (st.st_size > MAX_JOURNAL) {
+		save_snapshot();
+	}
+}
+
+void Search_Index::close()
+{
+	if (m_journal_fd < 0) {
+		return;
+	}
+	try {
+		commit();
+		if (m_dirty) {
+			save_snapshot();
+		}
+	} catch (const store_error &e) {
+		printf("%s: %s\n", m_path.c_str(), e.what());
+	}
+	::close(m_journal_fd);
+	m_journal_fd = -1;
+	m_terms.clear();
+	m_removed.clear();
+	m_journal.clear();
+}
+
+void Search_Index::add(const Envelope *env)
+{
+	std::set<std::string> words;
+	add_words(env->subject, &words);
+	add_words(env->from, &words);
+	add_words(env->sender, &words);
+	add_words(env->reply_to, &words);
+	add_words(env->to, &words);
+	add_words(env->cc, &words);
+	add_words(env->bcc, &words);
+	insert(env->uid, words);
+	journal(J_ADD, env->uid, words);
+}
+
+void Search_Index::add(uint32_t uid, const std::string &text)
+{
+	std::set<std::string> words;
+	add_words(text, &words);
+	insert(uid, words);
+	journal(J_ADD, uid, words);
+}
+
+void Search_Index::remove(uint32_t uid)
+{
+	m_removed.insert(uid);
+	journal(J_REMOVE, uid, std::set<std::string>());
+}
+
+void Search_Index::clear()
+{
+	m_terms.clear();
+	m_removed.clear();
+	m_journal.clear();
+	/* the old postings must not come back if the journal is lost */
+	std::string name = m_path + ".idx";
+	if (unlink(name.c_str()) && errno != ENOENT) {
+		throw store_error(strf("Unable to remove %s: %s", name.c_str(),
+				       strerror(errno)));
+	}
+	if (ftruncate(m_journal_fd, 0)) {
+		throw store_error(strf("Unable to truncate: %s",
+				       strerror(errno)));
+	}
+	m_dirty = true;
+}
+
+void Search_Index::commit()
+{
+	if (m_journal.empty()) {
+		return;
+	}
+	/* only a cache, the journal is not synced */
+	std::string journal;
+	journal.swap(m_journal);
+	write_all(m_journal_fd, journal.data(), journal.size());
+}
+
+std::vector<uint32_t> Search_Index::search(const std::string &query)
+{
+	std::vector<std::string> words;
+	split_words(query, &words);
+	std::vector<uint32_t> result;
+	if (words.empty()) {
+		return result;
+	}
+	/* the user may still be typing the last word */
+	bool prefix = word_char(query[query.size() - 1]);
+
+	for (size_t i = 0; i < words.size(); ++i) {
+		std::vector<uint32_t> found;
+		if (prefix && i == words.size() - 1) {
+			found = prefix_uids(words[i]);
+		} else {
+			std::map<std::string, Term>::iterator t =
+				m_terms.find(words[i]);
+			if (t == m_terms.end()) {
+				return std::vector<uint32_t>();
+			}
+			found = sorted_uids(t->second);
+		}
+		if (i == 0) {
+			result.swap(found);
+			continue;
+		}
+		std::vector<uint32_t> both;
+		std::set_intersection(result.begin(), result.end(),
+				      found.begin(), found.end(),
+				      std::back_inserter(both));
+		result.swap(both);
+	}
+
+	if (!m_removed.empty()) {
+		std::vector<uint32_t> kept;
+		std::set_difference(result.begin(), result.end(),
+				    m_removed.begin(), m_removed.end(),
+				    std::back_inserter(kept));
+		result.swap(kept);
+	}
+	return result;
+}
+
+Part_Sink *Search_Index::writer(uint32_t uid)
+{
+	return new Writer(this, uid);
+}
+
+void Search_Index::insert(uint32_t uid, const std::set<std::string> &words)
+{
+	for (std::set<std::string>::const_iterator i = words.begin();
+	     i != words.end(); ++i) {
+		Term &term = m_terms[*i];
+		if (!term.uids.empty() && term.uids.back() >= uid) {
+			if (term.uids.back() == uid) {
+				continue;
+			}
+			/* the ranges of a parallel sync arrive in any order */
+			term.sorted = false;
+		}
+		term.uids.push_back(uid);
+	}
+	/* the message was fetched again */
+	m_removed.erase(uid);
+	m_dirty = true;
+}
+
+std::vector<uint32_t> &Search_Index::sorted_uids(Term &term)
+{
+	if (!term.sorted) {
+		std::sort(term.uids.begin(), term.uids.end());
+		term.uids.erase(std::unique(term.uids.begin(), term.uids.end()),
+				term.uids.end());
+		term.sorted = true;
+	}
+	return term.uids;
+}
+
+std::vector<uint32_t> Search_Index::prefix_uids(const std::string &prefix)
+{
+	std::vector<uint32_t> uids;
+	std::map<std::string, Term>::iterator i = m_terms.lower_bound(prefix);
+	for (; i != m_terms.end() && i->first.compare(0, prefix.size(),
+						       prefix) == 0; ++i) {
+		const std::vector<uint32_t> &term = sorted_uids(i->second);
+		std::vector<uint32_t> both;
+		both.reserve(uids.size() + term.size());
+		std::set_union(uids.begin(), uids.end(), term.begin(),
+			       term.end(), std::back_inserter(both));
+		uids.swap(both);
+	}
+	return uids;
+}
+
+/*
+ * Each journal record is a checksum, the length of the payload, and the
+ * payload: the type, the UID and the words.
+ */
+void Search_Index::journal(int type, uint32_t uid,
+			   const std::set<std::string> &words)
+{
+	std::string payload;
+	payload += char(type);
+	put_varint(payload, uid);
+	put_varint(payload, words.size());
+	for (std::set<std::string>::const_iterator i = words.begin();
+	     i != words.end(); ++i) {
+		put_varint(payload, i->size());
+		payload += *i;
+	}
+	put_u32(m_journal, checksum(payload.data(), payload.size()));
+	put_u32(m_journal, payload.size());
+	m_journal += payload;
+}
+
+/*
+ * The snapshot is the magic, the number of words, and for each word its
+ * length, the word, the number of UIDs and the differences between them.
+ * It ends with a checksum of everything after the magic.
+ */
+void Search_Index::load_snapshot()
+{
+	std::string name = m_path + ".idx";
+	std::string data;
+	if (!read_file(name, &data)) {
+		return;
+	}
+	size_t header = sizeof SNAPSHOT_MAGIC;
+	bool valid = false;
+	if (data.size() >= header + sizeof(uint32_t) &&
+	    memcmp(data.data(), SNAPSHOT_MAGIC, header) == 0) {
+		size_t length = data.size() - header - sizeof(uint32_t);
+		uint32_t sum;
+		memcpy(&sum, &data[header + length], sizeof sum);
+		valid = checksum(&data[header], length) == sum;
+	}
+	try {
+		if (!valid) {
+			throw store_error("Invalid checksum");
+		}
+		Varint_Reader reader(&data[header],
+				     data.size() - header - sizeof(uint32_t));
+		uint32_t count = reader.varint();
+		for (uint32_t i = 0; i < count; ++i) {
+			std::string word = reader.bytes(reader.varint());
+			Term &term = m_terms[word];
+			uint32_t n = reader.varint();
+			term.uids.reserve(n);
+			uint32_t uid = 0;
+			for (uint32_t j = 0; j < n; ++j) {
+				uid += reader.varint();
+				term.uids.push_back(uid);
+			}
+		}
+	} catch (const store_error &e) {
+		/* the journal alone would not be the whole index */
+		printf("%s: %s, starting over\n", name.c_str(), e.what());
+		m_terms.clear();
+		if (ftruncate(m_journal_fd, 0)) {
+			throw store_error(strf("Unable to truncate: %s",
+					       strerror(errno)));
+		}
+	}
+}
+
+void Search_Index::load_journal()
+{
+	std::string data;
+	char buf[65536];
+	while (1) {
+		ssize_t got = read(m_journal_fd, buf, sizeof buf);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+		data.append(buf, got);
+	}
+
+	size_t pos = 0;
+	while (data.size() - pos >= 2 * sizeof(uint32_t)) {
+		uint32_t sum, length;
+		memcpy(&sum, &data[pos], sizeof sum);
+		memcpy(&length, &data[pos + sizeof sum], sizeof length);
+		size_t begin = pos + 2 * sizeof(uint32_t);
+		if (data.size() - begin < length ||
+		    checksum(&data[begin], length) != sum) {
+			break;
+		}
+		try {
+			Varint_Reader reader(&data[begin], length);
+			int type = (unsigned char) reader.bytes(1)[0];
+			uint32_t uid = reader.varint();
+			std::set<std::string> words;
+			uint32_t count = reader.varint();
+			for (uint32_t i = 0; i < count; ++i) {
+				words.insert(reader.bytes(reader.varint()));
+			}
+			if (type == J_ADD) {
+				insert(uid, words);
+			} else if (type == J_REMOVE) {
+				m_removed.insert(uid);
+			}
+		} catch (const store_error &) {
+			break;
+		}
+		pos = begin + length;
+	}
+	if (pos < data.size()) {
+		/* cut short by a crash */
+		printf("%s.log: dropping %lu bytes of a broken record\n",
+		       m_path.c_str(), (unsigned long) (data.size() - pos));
+		if (ftruncate(m_journal_fd, pos)) {
+			throw store_error(strf("Unable to truncate: %s",
+					       strerror(errno)));
+		}
+	}
+	m_dirty = pos > 0;
+}
+
+/* a partially written snapshot is never seen under the real name */
+void Search_Index::save_snapshot()
+{
+	std::string buf(SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC);
+	std::string body;
+	size_t count = 0;
+	for (std::map<std::string, Term>::iterator i = m_terms.begin();
+	     i != m_terms.end();) {
+		std::vector<uint32_t> &uids = sorted_uids(i->second);
+		if (!m_removed.empty()) {
+			std::vector<uint32_t> kept;
+			std::set_difference(uids.begin(), uids.end(),
+					    m_removed.begin(), m_removed.end(),
+					    std::back_inserter(kept));
+			uids.swap(kept);
+		}
+		if (uids.empty()) {
+			m_terms.erase(i++);
+			continue;
+		}
+		put_varint(body, i->first.size());
+		body += i->first;
+		put_varint(body, uids.size());
+		uint32_t prev = 0;
+		for (size_t j = 0; j < uids.size(); ++j) {
+			put_varint(body, uids[j] - prev);
+			prev = uids[j];
+		}
+		count++;
+		++i;
+	}
+	m_removed.clear();
+
+	std::string header;
+	put_varint(header, count);
+	body.insert(0, header);
+	buf += body;
+	put_u32(buf, checksum(body.data(), body.size()));
+
+	std::string name = m_path + ".idx";
+	std::string tmp = name + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		throw store_error("Can not open " + tmp);
+	}
+	try {
+		write_all(fd, buf.data(), buf.size());
+	} catch (...) {
+		::close(fd);
+		unlink(tmp.c_str());
+		throw;
+	}
+	fdatasync(fd);
+	::close(fd);
+	if (rename(tmp.c_str(), name.c_str())) {
+		unlink(tmp.c_str());
+		throw store_error("Can not rename " + tmp);
+	}
+
+	/* the journal is in the snapshot now */
+	commit();
+	if (ftruncate(m_journal_fd, 0)) {
+		throw store_error(strf("Unable to truncate: %s",
+				       strerror(errno)));
+	}
+	m_dirty = false;
+}
@@ -0,0 +1,86 @@
+/*
+ * Full-text index of the cached messages
+ */
+#ifndef _SEARCH_INDEX_H
+#define _SEARCH_INDEX_H
+
+#include "imap_parser.h"
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+class Part_Sink;
+
+/*
+ * An inverted index from words to the UIDs of the messages that contain
+ * them. The subject and the addresses of every envelope are indexed, and
+ * the text of a body when it is cached.
+ *
+ * On disk, the index is a snapshot with the UIDs of each word delta-coded
+ * as varints, followed by a journal of the documents added and removed
+ * since the snapshot. The journal is committed together with the envelope
+ * store, and folded into a new snapshot when the index is closed.
+ */
+class Search_Index {
+public:
+	Search_Index(const std::string &path);
+	~Search_Index();
+
+	void open();
+	void close();
+
+	bool empty() const { return m_terms.empty(); }
+	bool has_pending() const { return !m_journal.empty(); }
+
+	void add(const Envelope *env);
+	void add(uint32_t uid, const std::string &text);
+	void remove(uint32_t uid);
+	void clear();
+	/* Write the journal entries that are waiting */
+	void commit();
+
+	/*
+	 * The UIDs of the messages that contain all the words of the query,
+	 * in ascending order. The last word may be the beginning of a word.
+	 */
+	std::vector<uint32_t> search(const std::string &query);
+
+	/* Index a body as it arrives, when the sink is finished */
+	Part_Sink *writer(uint32_t uid);
+
+private:
+	class Writer;
+
+	struct Term {
+		std::vector<uint32_t> uids;
+		/* new UIDs are appended, and sorted when they are needed */
+		bool sorted;
+
+		Term() :
+			sorted(true)
+		{}
+	};
+
+	std::string m_path;
+	int m_journal_fd;
+	std::map<std::string, Term> m_terms;
+	/* removed UIDs are filtered out until the next snapshot */
+	std::set<uint32_t> m_removed;
+	/* journal records that have not been written yet */
+	std::string m_journal;
+	/* there are changes that are not in the snapshot */
+	bool m_dirty;
+
+	void insert(uint32_t uid, const std::set<std::string> &words);
+	std::vector<uint32_t> &sorted_uids(Term &term);
+	std::vector<uint32_t> prefix_uids(const std::string &prefix);
+	void journal(int type, uint32_t uid, const std::set<std::string> &words);
+	void load_snapshot();
+	void load_journal();
+	void save_snapshot();
+
+	DISABLE_COPY_AND_ASSIGN(Search_Index);
+};
+
+#endif
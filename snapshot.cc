@@ -0,0 +1,173 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "snapshot.h"
+#include "utils.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* in the native byte order, like the other caches */
+struct Snapshot::Header {
+	char magic[8];
+	uint32_t count;
+	uint32_t text_size;
+};
+
+/* the text is referred to by offsets from the end of the entries */
+struct Snapshot::Entry {
+	uint32_t uid;
+	uint32_t server;
+	uint32_t server_len;
+	uint32_t from;
+	uint32_t from_len;
+	uint32_t subject;
+	uint32_t subject_len;
+};
+
+namespace {
+
+const char SNAPSHOT_MAGIC[8] = "JMSNP01";
+
+}
+
+Snapshot::Snapshot() :
+	m_map(NULL),
+	m_size(0),
+	m_count(0)
+{
+}
+
+Snapshot::~Snapshot()
+{
+	unmap();
+}
+
+void Snapshot::unmap()
+{
+	if (m_map != NULL) {
+		munmap((void *) m_map, m_size);
+		m_map = NULL;
+	}
+	m_size = 0;
+	m_count = 0;
+}
+
+bool Snapshot::open(const std::string &fname)
+{
+	unmap();
+	int fd = ::open(fname.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || size_t(st.st_size) < sizeof(Header)) {
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	m_map = (const char *) map;
+	m_size = st.st_size;
+
+	const Header *hdr = (const Header *) m_map;
+	size_t text = sizeof(Header) + sizeof(Entry) * size_t(hdr->count);
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC) != 0 ||
+	    hdr->count > m_size / sizeof(Entry) ||
+	    text + hdr->text_size != m_size) {
+		debug("%s is not a usable snapshot\n", fname.c_str());
+		unmap();
+		return false;
+	}
+	/* a broken entry would point outside the file */
+	for (size_t i = 0; i < hdr->count; ++i) {
+		const Entry *e = (const Entry *) &m_map[sizeof(Header)] + i;
+		if (uint64_t(e->server) + e->server_len > hdr->text_size ||
+		    uint64_t(e->from) + e->from_len > hdr->text_size ||
+		    uint64_t(e->subject) + e->subject_len > hdr->text_size) {
+			debug("%s is not a usable snapshot\n", fname.c_str());
+			unmap();
+			return false;
+		}
+	}
+	m_count = hdr->count;
+	return true;
+}
+
+bool Snapshot::save(const std::string &fname,
+		    const std::vector<Snapshot_Row> &rows)
+{
+	std::vector<Entry> entries(rows.size());
+	std::string text;
+	for (size_t i = 0; i < rows.size(); ++i) {
+		const Snapshot_Row &row = rows[i];
+		Entry &e = entries[i];
+		e.uid = row.uid;
+		e.server = text.size();
+		e.server_len = row.server.size();
+		text += row.server;
+		e.from = text.size();
+		e.from_len = row.from.size();
+		text += row.from;
+		e.subject = text.size();
+		e.subject_len = row.subject.size();
+		text += row.subject;
+	}
+	Header hdr;
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof SNAPSHOT_MAGIC);
+	hdr.count = rows.size();
+	hdr.text_size = text.size();
+
+	std::string tmp = fname + ".tmp";
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (f == NULL) {
+		return false;
+	}
+	fwrite(&hdr, sizeof hdr, 1, f);
+	if (!entries.empty()) {
+		fwrite(&entries[0], sizeof(Entry), entries.size(), f);
+	}
+	fwrite(text.data(), 1, text.size(), f);
+	if (fclose(f) != 0 || rename(tmp.c_str(), fname.c_str()) < 0) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+const Snapshot::Entry *Snapshot::entry(size_t i) const
+{
+	return (const Entry *) &m_map[sizeof(Header)] + i;
+}
+
+uint32_t Snapshot::uid(size_t i) const
+{
+	return entry(i)->uid;
+}
+
+std::string Snapshot::server(size_t i) const
+{
+	const char *text = (const char *) entry(m_count);
+	return std::string(&text[entry(i)->server], entry(i)->server_len);
+}
+
+std::string Snapshot::from(size_t i) const
+{
+	const char *text = (const char *) entry(m_count);
+	return std::string(&text[entry(i)->from], entry(i)->from_len);
+}
+
+std::string Snapshot::subject(size_t i) const
+{
+	const char *text = (const char *) entry(m_count);
+	return std::string(&text[entry(i)->subject], entry(i)->subject_len);
+}
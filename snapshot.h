@@ -0,0 +1,59 @@
+/*
+ * The rows of the message list, saved for the next start
+ */
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include "common.h"
+#include <string>
+#include <vector>
+
+/* a row as it was shown, the text in UTF-8 */
+struct Snapshot_Row {
+	std::string server;
+	uint32_t uid;
+	std::string from;
+	std::string subject;
+
+	Snapshot_Row() :
+		uid(0)
+	{}
+};
+
+/*
+ * The first screenful of the message list is written when the program
+ * exits, so that it can be shown right away on the next start, before the
+ * caches are opened. The file is a table of fixed size entries followed by
+ * the text they refer to, and it is mapped into memory instead of read.
+ */
+class Snapshot {
+public:
+	Snapshot();
+	~Snapshot();
+
+	/* Returns false if there is no snapshot, or it is not usable */
+	bool open(const std::string &fname);
+	static bool save(const std::string &fname,
+			 const std::vector<Snapshot_Row> &rows);
+
+	size_t size() const { return m_count; }
+	uint32_t uid(size_t i) const;
+	std::string server(size_t i) const;
+	std::string from(size_t i) const;
+	std::string subject(size_t i) const;
+
+private:
+	struct Header;
+	struct Entry;
+
+	const char *m_map;
+	size_t m_size;
+	size_t m_count;
+
+	const Entry *entry(size_t i) const;
+	void unmap();
+
+	DISABLE_COPY_AND_ASSIGN(Snapshot);
+};
+
+#endif
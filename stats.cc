@@ -0,0 +1,140 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "stats.h"
+#include "json.h"
+#include <sys/resource.h>
+#include <time.h>
+
+namespace {
+
+const char *counter_names[MAX_STAT_COUNTER] = {
+	"bytes_received",
+	"bytes_sent",
+	"responses",
+	"envelopes",
+	"parse_errors",
+	"part_bytes",
+	"buffer_allocs",
+	"buffer_bytes",
+	"json_allocs",
+	"json_bytes",
+};
+
+const char *phase_names[MAX_STAT_PHASE] = {
+	"connect",
+	"tls_handshake",
+	"login",
+	"select",
+	"fetch",
+	"cache_load",
+	"first_paint",
+};
+
+struct Phase_Stats {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	/* the peak RSS of the process when the phase last ended */
+	uint64_t peak_rss;
+};
+
+/* only touched with atomic operations */
+uint64_t counters[MAX_STAT_COUNTER];
+Phase_Stats phases[MAX_STAT_PHASE];
+
+/* in kilobytes */
+uint64_t peak_rss()
+{
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) < 0) {
+		return 0;
+	}
+	return usage.ru_maxrss;
+}
+
+uint64_t load(const uint64_t *value)
+{
+	return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+}
+
+void stats_add(Stat_Counter counter, uint64_t n)
+{
+	__atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_span(Stat_Phase phase, uint64_t begin)
+{
+	uint64_t elapsed = stats_now() - begin;
+	Phase_Stats *p = &phases[phase];
+	__atomic_fetch_add(&p->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&p->total, elapsed, __ATOMIC_RELAXED);
+	uint64_t max = load(&p->max);
+	while (elapsed > max &&
+	       !__atomic_compare_exchange_n(&p->max, &max, elapsed, true,
+					    __ATOMIC_RELAXED,
+					    __ATOMIC_RELAXED));
+	__atomic_store_n(&p->peak_rss, peak_rss(), __ATOMIC_RELAXED);
+}
+
+void stats_print(FILE *f)
+{
+	fprintf(f, "%-16s %8s %12s %12s %12s %10s\n", "phase", "count",
+		"total ms", "average ms", "max ms", "rss kB");
+	for (int i = 0; i < MAX_STAT_PHASE; ++i) {
+		uint64_t count = load(&phases[i].count);
+		if (count == 0) {
+			continue;
+		}
+		uint64_t total = load(&phases[i].total);
+		fprintf(f, "%-16s %8lu %12.1f %12.1f %12.1f %10lu\n",
+			phase_names[i], (unsigned long) count, total / 1e3,
+			total / 1e3 / count, load(&phases[i].max) / 1e3,
+			(unsigned long) load(&phases[i].peak_rss));
+	}
+	for (int i = 0; i < MAX_STAT_COUNTER; ++i) {
+		fprintf(f, "%-16s %12lu\n", counter_names[i],
+			(unsigned long) load(&counters[i]));
+	}
+	fprintf(f, "%-16s %12lu kB\n", "peak_rss", (unsigned long) peak_rss());
+}
+
+JSON_Value stats_json()
+{
+	JSON_Value out(JSON_Value::OBJECT);
+	JSON_Value counts(JSON_Value::OBJECT);
+	for (int i = 0; i < MAX_STAT_COUNTER; ++i) {
+		counts.insert(counter_names[i],
+			      JSON_Value(long(load(&counters[i]))));
+	}
+	out.insert("counters", counts);
+
+	/* in microseconds */
+	JSON_Value spans(JSON_Value::OBJECT);
+	for (int i = 0; i < MAX_STAT_PHASE; ++i) {
+		JSON_Value span(JSON_Value::OBJECT);
+		span.insert("count", JSON_Value(long(load(&phases[i].count))));
+		span.insert("total_us",
+			    JSON_Value(long(load(&phases[i].total))));
+		span.insert("max_us", JSON_Value(long(load(&phases[i].max))));
+		span.insert("peak_rss_kb",
+			    JSON_Value(long(load(&phases[i].peak_rss))));
+		spans.insert(phase_names[i], span);
+	}
+	out.insert("phases", spans);
+	out.insert("peak_rss_kb", JSON_Value(long(peak_rss())));
+	return out;
+}
@@ -0,0 +1,61 @@
+/*
+ * Counters and timings of what the program does
+ */
+#ifndef _STATS_H
+#define _STATS_H
+
+#include "common.h"
+
+class JSON_Value;
+
+enum Stat_Counter {
+	/* over TLS, compressed if the connection is */
+	STAT_BYTES_RECEIVED,
+	STAT_BYTES_SENT,
+	STAT_RESPONSES,
+	STAT_ENVELOPES,
+	STAT_PARSE_ERRORS,
+	/* the contents of the parts that were streamed */
+	STAT_PART_BYTES,
+	/* the receive and send buffers of the connections */
+	STAT_BUFFER_ALLOCS,
+	STAT_BUFFER_BYTES,
+	/* the blocks of the JSON arenas */
+	STAT_JSON_ALLOCS,
+	STAT_JSON_BYTES,
+
+	MAX_STAT_COUNTER
+};
+
+enum Stat_Phase {
+	/* from the address lookup until a connection attempt succeeds */
+	PHASE_CONNECT,
+	PHASE_TLS_HANDSHAKE,
+	PHASE_LOGIN,
+	PHASE_SELECT,
+	/* a FETCH of envelopes, with all the responses streamed */
+	PHASE_FETCH,
+	/* opening the caches of a folder */
+	PHASE_CACHE_LOAD,
+	/* from the start until the messages are first drawn */
+	PHASE_FIRST_PAINT,
+
+	MAX_STAT_PHASE
+};
+
+/*
+ * These are cheap enough to call on every read, and any thread may call
+ * them. A phase is timed by taking stats_now() when it begins and giving it
+ * to stats_span() when it ends. The same phase may happen many times, on
+ * several connections at once.
+ */
+void stats_add(Stat_Counter counter, uint64_t n = 1);
+/* microseconds from a monotonic clock */
+uint64_t stats_now();
+void stats_span(Stat_Phase phase, uint64_t begin);
+
+/* What has been collected so far, as a table or as JSON */
+void stats_print(FILE *f);
+JSON_Value stats_json();
+
+#endif
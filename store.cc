@@ -0,0 +1,992 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "store.h"
+#include "utils.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Both files use the native byte order, since the cache is never shared
+ * between machines.
+ */
+struct Envelope_Store::Index_Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t clean;
+	uint32_t count;
+	uint32_t capacity;
+	uint64_t log_size;
+	/* total size of the records that are still referenced */
+	uint64_t live_bytes;
+	uint32_t uidvalidity;
+	uint32_t last_uid;
+	uint64_t highestmodseq;
+	char reserved[8];
+};
+
+struct Envelope_Store::Index_Entry {
+	uint32_t uid;
+	uint32_t flags;
+	uint64_t offset;
+};
+
+namespace {
+
+const char LOG_MAGIC[8] = "JMLOG02";
+const char INDEX_MAGIC[8] = "JMIDX01";
+const uint32_t INDEX_VERSION = 1;
+const size_t LOG_HEADER_SIZE = sizeof LOG_MAGIC;
+const uint32_t RECORD_MAGIC = 0x4a4d0000;
+const uint32_t MAX_RECORD_SIZE = 1 << 24;
+const size_t MIN_CAPACITY = 1024;
+/* the log is compacted when less than half of it is in use */
+const uint64_t COMPACT_THRESHOLD = 1 << 20;
+/* the new records are written in batches of about this size */
+const size_t COMMIT_SIZE = 256 * 1024;
+/* the run of out-of-order entries is merged when it grows this long */
+const uint32_t MAX_UNMERGED = 4096;
+
+enum {
+	REC_ENVELOPE = 1,
+	REC_FLAGS,
+	REC_REMOVE,
+	REC_STATE
+};
+
+struct Record_Header {
+	uint32_t magic;		/* RECORD_MAGIC | type */
+	uint32_t length;	/* length of the payload */
+	uint32_t uid;
+	uint32_t checksum;
+};
+
+/* FNV-1a */
+uint32_t checksum(const char *data, size_t length, uint32_t hash = 2166136261u)
+{
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) data[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+
+uint32_t record_checksum(const Record_Header *hdr, const char *payload)
+{
+	Record_Header copy = *hdr;
+	copy.checksum = 0;
+	return checksum(payload, hdr->length,
+			checksum((const char *) &copy, sizeof copy));
+}
+
+/* records are aligned to 4 bytes */
+uint32_t padded(uint32_t length)
+{
+	return (length + 3) & ~3;
+}
+
+void put_u32(std::string &buf, uint32_t value)
+{
+	buf.append((const char *) &value, sizeof value);
+}
+
+void put_string(std::string &buf, const std::string &s)
+{
+	put_u32(buf, s.size());
+	buf += s;
+}
+
+
+std::string encode_record(int type, uint32_t uid, const std::string &payload)
+{
+	Record_Header hdr;
+	hdr.magic = RECORD_MAGIC | type;
+	hdr.length = payload.size();
+	hdr.uid = uid;
+	hdr.checksum = record_checksum(&hdr, payload.data());
+
+	std::string buf((const char *) &hdr, sizeof hdr);
+	buf += payload;
+	buf.resize(sizeof hdr + padded(hdr.length), 0);
+	return buf;
+}
+
+void write_all(int fd, const char *data, size_t length)
+{
+	while (length > 0) {
+		ssize_t written = write(fd, data, length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			throw store_error(strf("Unable to write: %s",
+					       strerror(errno)));
+		}
+		data += written;
+		length -= written;
+	}
+}
+
+}
+
+class Envelope_Store::Record_Reader {
+public:
+	Record_Reader(const char *data, size_t length) :
+		m_pos(data),
+		m_end(data + length)
+	{
+	}
+
+	uint32_t u32()
+	{
+		if (size_t(m_end - m_pos) < sizeof(uint32_t)) {
+			throw store_error("Truncated record");
+		}
+		uint32_t value;
+		memcpy(&value, m_pos, sizeof value);
+		m_pos += sizeof value;
+		return value;
+	}
+
+	std::string string()
+	{
+		uint32_t length = u32();
+		if (size_t(m_end - m_pos) < length) {
+			throw store_error("Truncated string in a record");
+		}
+		std::string out(m_pos, length);
+		m_pos += length;
+		return out;
+	}
+
+	bool at_end() const { return m_pos == m_end; }
+	size_t offset(const char *begin) const { return m_pos - begin; }
+
+private:
+	const char *m_pos, *m_end;
+};
+
+bool Envelope_Store::entry_less(const Index_Entry &entry, uint32_t uid)
+{
+	return entry.uid < uid;
+}
+
+bool Envelope_Store::entry_before(const Index_Entry &a, const Index_Entry &b)
+{
+	return a.uid < b.uid;
+}
+
+Envelope_Store::Envelope_Store(const std::string &path) :
+	m_path(path),
+	m_log_fd(-1),
+	m_index_fd(-1),
+	m_log_size(0),
+	m_committed(0),
+	m_log_map(NULL),
+	m_log_map_size(0),
+	m_index_map(NULL),
+	m_index_map_size(0),
+	m_header(NULL),
+	m_entries(NULL),
+	m_unmerged(0),
+	m_addr_fd(-1)
+{
+}
+
+Envelope_Store::~Envelope_Store()
+{
+	close();
+}
+
+void Envelope_Store::open()
+{
+	std::string log_name = m_path + ".log";
+	m_log_fd = ::open(log_name.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (m_log_fd < 0) {
+		throw store_error("Can not open " + log_name);
+	}
+	struct stat st;
+	fstat(m_log_fd, &st);
+	m_log_size = st.st_size;
+	if (m_log_size == 0) {
+		write_all(m_log_fd, LOG_MAGIC, LOG_HEADER_SIZE);
+		m_log_size = LOG_HEADER_SIZE;
+	}
+	m_committed = m_log_size;
+	map_log();
+	if (m_log_size < LOG_HEADER_SIZE ||
+	    memcmp(m_log_map, LOG_MAGIC, LOG_HEADER_SIZE) != 0) {
+		/* an older format, it is only a cache */
+		printf("%s is not an envelope log, starting over\n",
+		       log_name.c_str());
+		unmap_log();
+		if (ftruncate(m_log_fd, 0)) {
+			throw store_error(strf("Unable to truncate: %s",
+					       strerror(errno)));
+		}
+		write_all(m_log_fd, LOG_MAGIC, LOG_HEADER_SIZE);
+		m_log_size = m_committed = LOG_HEADER_SIZE;
+		map_log();
+	}
+	load_addresses();
+
+	std::string index_name = m_path + ".idx";
+	m_index_fd = ::open(index_name.c_str(), O_RDWR | O_CREAT, 0600);
+	if (m_index_fd < 0) {
+		throw store_error("Can not open " + index_name);
+	}
+	fstat(m_index_fd, &st);
+
+	bool valid = false;
+	if (size_t(st.st_size) >= sizeof(Index_Header)) {
+		const Index_Header *hdr = (const Index_Header *)
+			mmap(NULL, sizeof(Index_Header), PROT_READ, MAP_SHARED,
+			     m_index_fd, 0);
+		if (hdr != MAP_FAILED) {
+			valid = memcmp(hdr->magic, INDEX_MAGIC,
+				       sizeof INDEX_MAGIC) == 0 &&
+				hdr->version == INDEX_VERSION && hdr->clean &&
+				hdr->log_size == m_log_size &&
+				sizeof(Index_Header) + hdr->capacity *
+				sizeof(Index_Entry) <= size_t(st.st_size);
+			size_t capacity = hdr->capacity;
+			munmap((void *) hdr, sizeof(Index_Header));
+			if (valid) {
+				map_index(capacity);
+			}
+		}
+	}
+	if (!valid) {
+		debug("rebuilding the index of %s\n", log_name.c_str());
+		rebuild_index();
+	}
+
+	/* a crash from now on leaves the index unclean */
+	m_header->clean = 0;
+	msync(m_index_map, sizeof(Index_Header), MS_SYNC);
+
+	if (m_log_size > COMPACT_THRESHOLD &&
+	    m_header->live_bytes < (m_log_size - LOG_HEADER_SIZE) / 2) {
+		compact();
+	}
+}
+
+void Envelope_Store::close()
+{
+	if (m_index_map != NULL) {
+		try {
+			commit();
+		} catch (const store_error &e) {
+			printf("%s.log: %s\n", m_path.c_str(), e.what());
+		}
+		m_header->log_size = m_committed;
+		m_header->clean = 1;
+		msync(m_index_map, m_index_map_size, MS_SYNC);
+		munmap(m_index_map, m_index_map_size);
+		m_index_map = NULL;
+		m_header = NULL;
+		m_entries = NULL;
+	}
+	unmap_log();
+	if (m_index_fd >= 0) {
+		::close(m_index_fd);
+		m_index_fd = -1;
+	}
+	if (m_log_fd >= 0) {
+		::close(m_log_fd);
+		m_log_fd = -1;
+	}
+	if (m_addr_fd >= 0) {
+		::close(m_addr_fd);
+		m_addr_fd = -1;
+	}
+	m_addresses.clear();
+	m_address_ids.clear();
+	m_pending.clear();
+	m_pending_addresses.clear();
+}
+
+size_t Envelope_Store::size()
+{
+	merge_entries();
+	return m_header->count;
+}
+
+uint32_t Envelope_Store::uid_at(size_t i)
+{
+	merge_entries();
+	assert(i < m_header->count);
+	return m_entries[i].uid;
+}
+
+unsigned int Envelope_Store::flags_at(size_t i)
+{
+	merge_entries();
+	assert(i < m_header->count);
+	return m_entries[i].flags;
+}
+
+void Envelope_Store::get_at(size_t i, Envelope *env)
+{
+	merge_entries();
+	assert(i < m_header->count);
+	decode(m_entries[i].offset, env);
+	env->uid = m_entries[i].uid;
+	env->flags = m_entries[i].flags;
+}
+
+bool Envelope_Store::get(uint32_t uid, Envelope *env)
+{
+	Index_Entry *entry = find(uid);
+	if (entry == NULL) {
+		return false;
+	}
+	/* the entry may be in the run */
+	decode(entry->offset, env);
+	env->uid = entry->uid;
+	env->flags = entry->flags;
+	return true;
+}
+
+bool Envelope_Store::contains(uint32_t uid)
+{
+	return find(uid) != NULL;
+}
+
+Sync_State Envelope_Store::sync_state() const
+{
+	Sync_State state;
+	state.uidvalidity = m_header->uidvalidity;
+	state.last_uid = m_header->last_uid;
+	state.highestmodseq = m_header->highestmodseq;
+	return state;
+}
+
+void Envelope_Store::set_sync_state(const Sync_State &state)
+{
+	std::string payload;
+	put_u32(payload, state.uidvalidity);
+	put_u32(payload, state.last_uid);
+	put_u32(payload, state.highestmodseq & 0xffffffff);
+	put_u32(payload, state.highestmodseq >> 32);
+	append(REC_STATE, 0, payload);
+}
+
+void Envelope_Store::add(const Envelope *env)
+{
+	append(REC_ENVELOPE, env->uid, encode(env));
+}
+
+void Envelope_Store::set_flags(uint32_t uid, unsigned int flags)
+{
+	Index_Entry *entry = find(uid);
+	if (entry == NULL || entry->flags == flags) {
+		return;
+	}
+	std::string payload;
+	put_u32(payload, flags);
+	append(REC_FLAGS, uid, payload);
+}
+
+void Envelope_Store::remove(uint32_t uid)
+{
+	if (find(uid) != NULL) {
+		append(REC_REMOVE, uid, std::string());
+	}
+}
+
+void Envelope_Store::remove(const std::vector<uint32_t> &uids)
+{
+	std::vector<uint32_t> sorted(uids);
+	std::sort(sorted.begin(), sorted.end());
+	merge_entries();
+
+	/* the records are appended as usual, but not applied one by one */
+	Index_Entry *end = m_entries + m_header->count;
+	Index_Entry *out = m_entries;
+	size_t j = 0;
+	for (Index_Entry *i = m_entries; i != end; ++i) {
+		while (j < sorted.size() && sorted[j] < i->uid) {
+			j++;
+		}
+		if (j == sorted.size() || sorted[j] != i->uid) {
+			*out++ = *i;
+			continue;
+		}
+		m_header->live_bytes -= record_size(i->offset);
+		std::string rec = encode_record(REC_REMOVE, i->uid,
+						std::string());
+		m_pending += rec;
+		m_log_size += rec.size();
+	}
+	m_header->count = out - m_entries;
+	if (m_pending.size() >= COMMIT_SIZE) {
+		commit();
+	}
+}
+
+void Envelope_Store::clear()
+{
+	if (ftruncate(m_log_fd, LOG_HEADER_SIZE)) {
+		throw store_error(strf("Unable to truncate: %s",
+				       strerror(errno)));
+	}
+	m_log_size = m_committed = LOG_HEADER_SIZE;
+	m_pending.clear();
+	unmap_log();
+	map_log();
+	reset_index();
+
+	if (ftruncate(m_addr_fd, 0)) {
+		throw store_error(strf("Unable to truncate: %s",
+				       strerror(errno)));
+	}
+	m_addresses.clear();
+	m_address_ids.clear();
+	m_pending_addresses.clear();
+}
+
+void Envelope_Store::commit()
+{
+	merge_entries();
+	if (m_pending.empty() && m_pending_addresses.empty()) {
+		return;
+	}
+	try {
+		/* the envelopes refer to the addresses, so they go first */
+		if (!m_pending_addresses.empty()) {
+			write_all(m_addr_fd, m_pending_addresses.data(),
+				  m_pending_addresses.size());
+			fdatasync(m_addr_fd);
+		}
+		write_all(m_log_fd, m_pending.data(), m_pending.size());
+		fdatasync(m_log_fd);
+	} catch (const store_error &) {
+		discard_pending();
+		throw;
+	}
+	m_pending_addresses.clear();
+	m_committed += m_pending.size();
+	m_pending.clear();
+	m_header->log_size = m_committed;
+}
+
+/*
+ * Forget the records that could not be written. The address table and
+ * the index are read back from the files, as they were before.
+ */
+void Envelope_Store::discard_pending()
+{
+	if (ftruncate(m_log_fd, m_committed)) {
+		debug("Unable to truncate %s.log\n", m_path.c_str());
+	}
+	m_pending.clear();
+	m_pending_addresses.clear();
+	m_log_size = m_committed;
+
+	::close(m_addr_fd);
+	m_addr_fd = -1;
+	m_addresses.clear();
+	m_address_ids.clear();
+	load_addresses();
+	rebuild_index();
+}
+
+void Envelope_Store::compact()
+{
+	commit();
+	debug("compacting %s.log\n", m_path.c_str());
+
+	std::string tmp_name = m_path + ".log.tmp";
+	int fd = ::open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		throw store_error("Can not open " + tmp_name);
+	}
+
+	/* the current flags are written into the envelope records */
+	std::string buf(LOG_MAGIC, LOG_HEADER_SIZE);
+	uint64_t offset = 0;
+	uint64_t live_bytes = 0;
+	try {
+		for (uint32_t i = 0; i < m_header->count; ++i) {
+			Index_Entry *entry = &m_entries[i];
+			const Record_Header *hdr = (const Record_Header *)
+				log_data(entry->offset, sizeof(Record_Header));
+			std::string payload(log_data(entry->offset +
+						     sizeof(Record_Header),
+						     hdr->length),
+					    hdr->length);
+			memcpy(&payload[0], &entry->flags, sizeof(uint32_t));
+
+			std::string rec = encode_record(REC_ENVELOPE,
+							entry->uid, payload);
+			entry->offset = offset + buf.size();
+			live_bytes += rec.size();
+			buf += rec;
+			if (buf.size() >= (1 << 20)) {
+				write_all(fd, buf.data(), buf.size());
+				offset += buf.size();
+				buf.clear();
+			}
+		}
+		std::string state;
+		put_u32(state, m_header->uidvalidity);
+		put_u32(state, m_header->last_uid);
+		put_u32(state, m_header->highestmodseq & 0xffffffff);
+		put_u32(state, m_header->highestmodseq >> 32);
+		buf += encode_record(REC_STATE, 0, state);
+		write_all(fd, buf.data(), buf.size());
+		offset += buf.size();
+	} catch (...) {
+		::close(fd);
+		unlink(tmp_name.c_str());
+		/* the old log is still intact, but the offsets are not */
+		rebuild_index();
+		throw;
+	}
+	fdatasync(fd);
+	::close(fd);
+
+	std::string log_name = m_path + ".log";
+	if (rename(tmp_name.c_str(), log_name.c_str())) {
+		unlink(tmp_name.c_str());
+		rebuild_index();
+		throw store_error("Can not rename " + tmp_name);
+	}
+
+	unmap_log();
+	::close(m_log_fd);
+	m_log_fd = ::open(log_name.c_str(), O_RDWR | O_APPEND);
+	if (m_log_fd < 0) {
+		throw store_error("Can not open " + log_name);
+	}
+	m_log_size = m_committed = offset;
+	map_log();
+	m_header->log_size = m_committed;
+	m_header->live_bytes = live_bytes;
+}
+
+void Envelope_Store::map_log()
+{
+	assert(m_log_map == NULL);
+	if (m_committed == 0) {
+		return;
+	}
+	void *map = mmap(NULL, m_committed, PROT_READ, MAP_SHARED, m_log_fd,
+			 0);
+	if (map == MAP_FAILED) {
+		throw store_error(strf("Unable to map the log: %s",
+				       strerror(errno)));
+	}
+	m_log_map = (char *) map;
+	m_log_map_size = m_committed;
+}
+
+void Envelope_Store::unmap_log()
+{
+	if (m_log_map != NULL) {
+		munmap(m_log_map, m_log_map_size);
+		m_log_map = NULL;
+		m_log_map_size = 0;
+	}
+}
+
+const char *Envelope_Store::log_data(uint64_t offset, size_t length)
+{
+	if (offset + length > m_log_size) {
+		throw store_error("Record outside of the log");
+	}
+	if (offset >= m_committed) {
+		/* not written yet */
+		return m_pending.data() + (offset - m_committed);
+	}
+	if (offset + length > m_log_map_size) {
+		/* records have been appended after the log was mapped */
+		unmap_log();
+		map_log();
+	}
+	return m_log_map + offset;
+}
+
+void Envelope_Store::map_index(size_t capacity)
+{
+	size_t size = sizeof(Index_Header) + capacity * sizeof(Index_Entry);
+	if (m_index_map != NULL) {
+		munmap(m_index_map, m_index_map_size);
+		m_index_map = NULL;
+	}
+	struct stat st;
+	fstat(m_index_fd, &st);
+	if (size_t(st.st_size) < size && ftruncate(m_index_fd, size)) {
+		throw store_error(strf("Unable to grow the index: %s",
+				       strerror(errno)));
+	}
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 m_index_fd, 0);
+	if (map == MAP_FAILED) {
+		throw store_error(strf("Unable to map the index: %s",
+				       strerror(errno)));
+	}
+	m_index_map = (char *) map;
+	m_index_map_size = size;
+	m_header = (Index_Header *) m_index_map;
+	m_entries = (Index_Entry *) (m_index_map + sizeof(Index_Header));
+}
+
+void Envelope_Store::reset_index()
+{
+	if (ftruncate(m_index_fd, 0)) {
+		throw store_error(strf("Unable to truncate: %s",
+				       strerror(errno)));
+	}
+	map_index(MIN_CAPACITY);
+	memset(m_header, 0, sizeof(Index_Header));
+	memcpy(m_header->magic, INDEX_MAGIC, sizeof INDEX_MAGIC);
+	m_header->version = INDEX_VERSION;
+	m_header->capacity = MIN_CAPACITY;
+	m_header->log_size = m_committed;
+	m_unmerged = 0;
+}
+
+void Envelope_Store::rebuild_index()
+{
+	reset_index();
+
+	uint64_t offset = LOG_HEADER_SIZE;
+	while (offset < m_log_size) {
+		if (m_log_size - offset < sizeof(Record_Header)) {
+			break;
+		}
+		const Record_Header *hdr =
+			(const Record_Header *) log_data(offset, sizeof *hdr);
+		if ((hdr->magic & 0xffff0000) != RECORD_MAGIC ||
+		    hdr->length > MAX_RECORD_SIZE ||
+		    offset + sizeof *hdr + padded(hdr->length) > m_log_size) {
+			break;
+		}
+		const char *payload = log_data(offset + sizeof *hdr,
+					       hdr->length);
+		if (record_checksum(hdr, payload) != hdr->checksum) {
+			break;
+		}
+		uint32_t size = sizeof *hdr + padded(hdr->length);
+		apply(hdr->magic & 0xffff, hdr->uid, offset, size, payload,
+		      hdr->length);
+		offset += size;
+	}
+
+	if (offset < m_log_size) {
+		/* drop the record that was being written during a crash */
+		printf("%s.log: dropping %lu bytes of a broken record\n",
+		       m_path.c_str(), (unsigned long) (m_log_size - offset));
+		if (ftruncate(m_log_fd, offset)) {
+			throw store_error(strf("Unable to truncate: %s",
+					       strerror(errno)));
+		}
+		m_log_size = m_committed = offset;
+		unmap_log();
+		map_log();
+	}
+	merge_entries();
+	m_header->log_size = m_committed;
+}
+
+Envelope_Store::Index_Entry *Envelope_Store::find(uint32_t uid)
+{
+	Index_Entry *end = m_entries + m_header->count;
+	Index_Entry *i = std::lower_bound(m_entries, end, uid, entry_less);
+	if (i != end && i->uid == uid) {
+		return i;
+	}
+	Index_Entry *last = end + m_unmerged;
+	i = std::lower_bound(end, last, uid, entry_less);
+	if (i != last && i->uid == uid) {
+		return i;
+	}
+	return NULL;
+}
+
+Envelope_Store::Index_Entry *Envelope_Store::insert_entry(uint32_t uid)
+{
+	if (m_unmerged >= MAX_UNMERGED) {
+		merge_entries();
+	}
+	if (m_header->count + m_unmerged == m_header->capacity) {
+		size_t capacity = m_header->capacity * 2;
+		map_index(capacity);
+		m_header->capacity = capacity;
+	}
+	Index_Entry *end = m_entries + m_header->count;
+	if (m_unmerged == 0 && (m_header->count == 0 || end[-1].uid < uid)) {
+		/* new messages usually have the highest UID */
+		m_header->count++;
+		end->uid = uid;
+		return end;
+	}
+	/*
+	 * Inserting in the middle would move the rest of the index for
+	 * every envelope, and a parallel sync fetches the newest ones first.
+	 */
+	Index_Entry *last = end + m_unmerged;
+	Index_Entry *i = std::lower_bound(end, last, uid, entry_less);
+	memmove(i + 1, i, (last - i) * sizeof(Index_Entry));
+	m_unmerged++;
+	i->uid = uid;
+	return i;
+}
+
+/* Move the run after the index into its place */
+void Envelope_Store::merge_entries()
+{
+	if (m_unmerged == 0) {
+		return;
+	}
+	Index_Entry *end = m_entries + m_header->count;
+	std::inplace_merge(m_entries, end, end + m_unmerged, entry_before);
+	m_header->count += m_unmerged;
+	m_unmerged = 0;
+}
+
+uint32_t Envelope_Store::record_size(uint64_t offset)
+{
+	const Record_Header *hdr =
+		(const Record_Header *) log_data(offset, sizeof(Record_Header));
+	return sizeof *hdr + padded(hdr->length);
+}
+
+void Envelope_Store::append(int type, uint32_t uid, const std::string &payload)
+{
+	std::string rec = encode_record(type, uid, payload);
+	uint64_t offset = m_log_size;
+	m_pending += rec;
+	m_log_size += rec.size();
+	apply(type, uid, offset, rec.size(), payload.data(), payload.size());
+	if (m_pending.size() >= COMMIT_SIZE) {
+		commit();
+	}
+}
+
+void Envelope_Store::apply(int type, uint32_t uid, uint64_t offset,
+			   uint32_t size, const char *payload, size_t length)
+{
+	Record_Reader reader(payload, length);
+	Index_Entry *entry = NULL;
+
+	switch (type) {
+	case REC_ENVELOPE:
+		entry = find(uid);
+		if (entry != NULL) {
+			m_header->live_bytes -= record_size(entry->offset);
+		} else {
+			entry = insert_entry(uid);
+		}
+		entry->flags = reader.u32();
+		entry->offset = offset;
+		m_header->live_bytes += size;
+		break;
+
+	case REC_FLAGS:
+		entry = find(uid);
+		if (entry != NULL) {
+			entry->flags = reader.u32();
+		}
+		break;
+
+	case REC_REMOVE:
+		merge_entries();
+		entry = find(uid);
+		if (entry != NULL) {
+			m_header->live_bytes -= record_size(entry->offset);
+			Index_Entry *end = m_entries + m_header->count;
+			memmove(entry, entry + 1,
+				(end - entry - 1) * sizeof(Index_Entry));
+			m_header->count--;
+		}
+		break;
+
+	case REC_STATE:
+		m_header->uidvalidity = reader.u32();
+		m_header->last_uid = reader.u32();
+		m_header->highestmodseq = reader.u32();
+		m_header->highestmodseq |= uint64_t(reader.u32()) << 32;
+		break;
+
+	default:
+		debug("unknown record type %d in %s.log\n", type,
+		      m_path.c_str());
+		break;
+	}
+}
+
+void Envelope_Store::load_addresses()
+{
+	std::string name = m_path + ".addr";
+	m_addr_fd = ::open(name.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (m_addr_fd < 0) {
+		throw store_error("Can not open " + name);
+	}
+	std::string data;
+	char buf[65536];
+	while (1) {
+		ssize_t got = read(m_addr_fd, buf, sizeof buf);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+		data.append(buf, got);
+	}
+
+	/* each entry is a checksum and two strings */
+	Record_Reader reader(data.data(), data.size());
+	size_t valid = 0;
+	try {
+		while (!reader.at_end()) {
+			uint32_t sum = reader.u32();
+			size_t begin = reader.offset(data.data());
+			Header_Address addr;
+			addr.name = reader.string();
+			addr.email = reader.string();
+			size_t end = reader.offset(data.data());
+			if (checksum(&data[begin], end - begin) != sum) {
+				break;
+			}
+			ins(m_address_ids, addr.name + '\0' + addr.email,
+			    uint32_t(m_addresses.size()));
+			m_addresses.push_back(addr);
+			valid = end;
+		}
+	} catch (const store_error &) {
+		/* cut short by a crash */
+	}
+	if (valid < data.size()) {
+		printf("%s: dropping %lu bytes of a broken entry\n",
+		       name.c_str(), (unsigned long) (data.size() - valid));
+		if (ftruncate(m_addr_fd, valid)) {
+			throw store_error(strf("Unable to truncate: %s",
+					       strerror(errno)));
+		}
+	}
+}
+
+uint32_t Envelope_Store::intern(const Header_Address &addr)
+{
+	std::string key = addr.name + '\0' + addr.email;
+	std::map<std::string, uint32_t>::const_iterator i =
+		m_address_ids.find(key);
+	if (i != m_address_ids.end()) {
+		return i->second;
+	}
+
+	/* committed before any envelope that refers to it */
+	std::string entry;
+	put_string(entry, addr.name);
+	put_string(entry, addr.email);
+	put_u32(m_pending_addresses, checksum(entry.data(), entry.size()));
+	m_pending_addresses += entry;
+
+	uint32_t id = m_addresses.size();
+	ins(m_address_ids, key, id);
+	m_addresses.push_back(addr);
+	return id;
+}
+
+void Envelope_Store::put_addresses(std::string &buf, const Address_List &list)
+{
+	put_u32(buf, list.size());
+	for (size_t i = 0; i < list.size(); ++i) {
+		put_u32(buf, intern(list[i]));
+	}
+}
+
+/*
+ * The flags must come first, compact() updates them in place. The
+ * addresses are stored as IDs to the address table. The body structure
+ * comes last, the records written before it was stored end without it.
+ */
+std::string Envelope_Store::encode(const Envelope *env)
+{
+	std::string buf;
+	put_u32(buf, env->flags);
+	put_string(buf, env->date);
+	put_string(buf, env->subject);
+	put_string(buf, env->parent_id);
+	put_string(buf, env->message_id);
+	put_addresses(buf, env->from);
+	put_addresses(buf, env->sender);
+	put_addresses(buf, env->reply_to);
+	put_addresses(buf, env->to);
+	put_addresses(buf, env->cc);
+	put_addresses(buf, env->bcc);
+
+	put_u32(buf, env->parts.size());
+	for (size_t i = 0; i < env->parts.size(); ++i) {
+		const Body_Part &part = env->parts[i];
+		put_string(buf, part.section);
+		put_string(buf, part.type);
+		put_string(buf, part.subtype);
+		put_string(buf, part.charset);
+		put_string(buf, part.encoding);
+		put_string(buf, part.name);
+		put_u32(buf, part.size);
+		put_u32(buf, part.depth);
+	}
+	return buf;
+}
+
+void Envelope_Store::get_addresses(Record_Reader &reader, Address_List *list)
+{
+	uint32_t count = reader.u32();
+	list->clear();
+	list->reserve(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		uint32_t id = reader.u32();
+		if (id < m_addresses.size()) {
+			list->push_back(m_addresses[id]);
+		}
+	}
+}
+
+void Envelope_Store::decode(uint64_t offset, Envelope *env)
+{
+	const Record_Header *hdr =
+		(const Record_Header *) log_data(offset, sizeof(Record_Header));
+	Record_Reader reader(log_data(offset + sizeof *hdr, hdr->length),
+			     hdr->length);
+	env->flags = reader.u32();
+	env->date = reader.string();
+	env->subject = reader.string();
+	env->parent_id = reader.string();
+	env->message_id = reader.string();
+	get_addresses(reader, &env->from);
+	get_addresses(reader, &env->sender);
+	get_addresses(reader, &env->reply_to);
+	get_addresses(reader, &env->to);
+	get_addresses(reader, &env->cc);
+	get_addresses(reader, &env->bcc);
+
+	env->parts.clear();
+	if (reader.at_end()) {
+		return;
+	}
+	uint32_t count = reader.u32();
+	env->parts.resize(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		Body_Part &part = env->parts[i];
+		part.section = reader.string();
+		part.type = reader.string();
+		part.subtype = reader.string();
+		part.charset = reader.string();
+		part.encoding = reader.string();
+		part.name = reader.string();
+		part.size = reader.u32();
+		part.depth = reader.u32();
+	}
+}
@@ -0,0 +1,127 @@
+/*
+ * Persistent storage of message envelopes
+ */
+#ifndef _STORE_H
+#define _STORE_H
+
+#include "imap_parser.h"
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class store_error: public std::runtime_error {
+public:
+	store_error(const std::string &what) :
+		std::runtime_error(what)
+	{}
+};
+
+/*
+ * The envelopes of one account are kept in a single append-only log file.
+ * Every change (a new envelope, changed flags, a removal) is appended as a
+ * checksummed record. The records are collected in memory and committed
+ * in batches with one write and one fdatasync() each, so a crash loses at
+ * most the batch that was not committed yet. The log is indexed by a
+ * separate file of fixed-width entries sorted by UID, which is
+ * memory-mapped while the store is open. The entries that do not go to
+ * the end of the index are kept in a sorted run after it until the next
+ * commit, when the run is merged in.
+ * The index is trusted only if the store was closed cleanly, otherwise it
+ * is rebuilt by replaying the log.
+ *
+ * The text is kept in UTF-8, and the addresses are interned in a separate
+ * append-only table so that an envelope only refers to them by their IDs.
+ */
+class Envelope_Store {
+public:
+	Envelope_Store(const std::string &path);
+	~Envelope_Store();
+
+	/* Open or create the store, recovering from a crash if needed */
+	void open();
+	void close();
+
+	/* The envelopes are ordered by their UID */
+	size_t size();
+	uint32_t uid_at(size_t i);
+	unsigned int flags_at(size_t i);
+	void get_at(size_t i, Envelope *env);
+	bool get(uint32_t uid, Envelope *env);
+	bool contains(uint32_t uid);
+
+	Sync_State sync_state() const;
+	void set_sync_state(const Sync_State &state);
+
+	void add(const Envelope *env);
+	void set_flags(uint32_t uid, unsigned int flags);
+	void remove(uint32_t uid);
+	/* The index is compacted once for all of them */
+	void remove(const std::vector<uint32_t> &uids);
+	void clear();
+
+	/*
+	 * Write the records that are waiting. This happens by itself when
+	 * enough of them have been collected, and when the store is closed.
+	 */
+	void commit();
+	bool has_pending() const { return !m_pending.empty(); }
+
+	/* Rewrite the log without the records that have been superseded */
+	void compact();
+
+private:
+	struct Index_Header;
+	struct Index_Entry;
+	class Record_Reader;
+
+	std::string m_path;
+	int m_log_fd;
+	int m_index_fd;
+	/* including the records that have not been committed */
+	uint64_t m_log_size;
+	/* the size of the log file */
+	uint64_t m_committed;
+	std::string m_pending;
+	char *m_log_map;
+	size_t m_log_map_size;
+	char *m_index_map;
+	size_t m_index_map_size;
+	Index_Header *m_header;
+	Index_Entry *m_entries;
+	/* the number of entries in the run after the index */
+	uint32_t m_unmerged;
+
+	/* the address table, the same addresses repeat in many envelopes */
+	int m_addr_fd;
+	std::vector<Header_Address> m_addresses;
+	std::map<std::string, uint32_t> m_address_ids;
+	std::string m_pending_addresses;
+
+	void map_log();
+	void unmap_log();
+	const char *log_data(uint64_t offset, size_t length);
+	void map_index(size_t capacity);
+	void reset_index();
+	void rebuild_index();
+	void discard_pending();
+	static bool entry_less(const Index_Entry &entry, uint32_t uid);
+	static bool entry_before(const Index_Entry &a, const Index_Entry &b);
+	Index_Entry *find(uint32_t uid);
+	Index_Entry *insert_entry(uint32_t uid);
+	void merge_entries();
+	uint32_t record_size(uint64_t offset);
+	void append(int type, uint32_t uid, const std::string &payload);
+	void apply(int type, uint32_t uid, uint64_t offset, uint32_t size,
+		   const char *payload, size_t length);
+	void load_addresses();
+	uint32_t intern(const Header_Address &addr);
+	void put_addresses(std::string &buf, const Address_List &list);
+	void get_addresses(Record_Reader &reader, Address_List *list);
+	std::string encode(const Envelope *env);
+	void decode(uint64_t offset, Envelope *env);
+
+	DISABLE_COPY_AND_ASSIGN(Envelope_Store);
+};
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "thread_index.h"
+#include "utils.h"
+#include <algorithm>
+
+namespace {
+
+/*
+ * The Message-ID between the angle brackets. The In-Reply-To header may
+ * contain several, and comments, of which only the first ID is used.
+ */
+std::string normalize_id(const std::string &s)
+{
+	size_t begin = s.find('<');
+	if (begin != std::string::npos) {
+		size_t end = s.find('>', begin);
+		if (end != std::string::npos) {
+			return s.substr(begin + 1, end - begin - 1);
+		}
+	}
+	size_t first = s.find_first_not_of(" \t");
+	if (first == std::string::npos) {
+		return std::string();
+	}
+	size_t last = s.find_last_not_of(" \t");
+	return s.substr(first, last - first + 1);
+}
+
+typedef std::pair<uint32_t, size_t> Thread_Order;
+
+}
+
+Thread_Index::Thread_Index()
+{
+}
+
+void Thread_Index::add(const Envelope *env)
+{
+	std::string id = normalize_id(env->message_id);
+	Container *c = id.empty() ? new_container() : container(id);
+	if (c->uid != 0) {
+		/* the same Message-ID twice, the copy goes on its own */
+		c = new_container();
+	}
+	c->uid = env->uid;
+	ins(m_by_uid, env->uid, c);
+
+	std::string parent = normalize_id(env->parent_id);
+	if (!parent.empty() && parent != id) {
+		link(c, container(parent));
+	}
+}
+
+void Thread_Index::remove(uint32_t uid)
+{
+	std::map<uint32_t, Container *>::iterator i = m_by_uid.find(uid);
+	if (i == m_by_uid.end()) {
+		return;
+	}
+	/* the replies stay where they are */
+	i->second->uid = 0;
+	m_by_uid.erase(i);
+}
+
+void Thread_Index::clear()
+{
+	m_by_id.clear();
+	m_by_uid.clear();
+	m_containers.clear();
+}
+
+void Thread_Index::set_parent(uint32_t uid, uint32_t parent)
+{
+	std::map<uint32_t, Container *>::iterator i = m_by_uid.find(uid);
+	if (i == m_by_uid.end()) {
+		return;
+	}
+	if (parent == 0) {
+		unlink(i->second);
+		return;
+	}
+	std::map<uint32_t, Container *>::iterator p = m_by_uid.find(parent);
+	if (p != m_by_uid.end()) {
+		link(i->second, p->second);
+	}
+}
+
+std::vector<Thread_Entry> Thread_Index::sequence() const
+{
+	std::vector<std::vector<Thread_Entry> > threads;
+	std::vector<Thread_Order> order;
+
+	typedef std::pair<const Container *, unsigned int> Item;
+	std::vector<Item> stack;
+	for (std::list<Container>::const_iterator i = m_containers.begin();
+	     i != m_containers.end(); ++i) {
+		if (i->parent != NULL) {
+			continue;
+		}
+		std::vector<Thread_Entry> thread;
+		uint32_t latest = 0;
+		/* depth first, the children in order */
+		stack.push_back(Item(&*i, 0));
+		while (!stack.empty()) {
+			const Container *c = stack.back().first;
+			unsigned int depth = stack.back().second;
+			stack.pop_back();
+			if (c->uid != 0) {
+				thread.push_back(Thread_Entry(c->uid, depth));
+				latest = std::max(latest, c->uid);
+				/* an empty container does not indent its children */
+				depth++;
+			}
+			for (size_t j = c->children.size(); j-- > 0;) {
+				stack.push_back(Item(c->children[j], depth));
+			}
+		}
+		if (!thread.empty()) {
+			order.push_back(Thread_Order(latest, threads.size()));
+			threads.push_back(std::vector<Thread_Entry>());
+			threads.back().swap(thread);
+		}
+	}
+	std::sort(order.begin(), order.end());
+
+	std::vector<Thread_Entry> out;
+	out.reserve(m_by_uid.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		const std::vector<Thread_Entry> &thread =
+			threads[order[i].second];
+		out.insert(out.end(), thread.begin(), thread.end());
+	}
+	return out;
+}
+
+Thread_Index::Container *Thread_Index::new_container()
+{
+	m_containers.push_back(Container());
+	return &m_containers.back();
+}
+
+Thread_Index::Container *Thread_Index::container(const std::string &message_id)
+{
+	std::map<std::string, Container *>::iterator i =
+		m_by_id.find(message_id);
+	if (i != m_by_id.end()) {
+		return i->second;
+	}
+	Container *c = new_container();
+	ins(m_by_id, message_id, c);
+	return c;
+}
+
+void Thread_Index::link(Container *child, Container *parent)
+{
+	/* a reply to itself, through other messages */
+	for (Container *c = parent; c != NULL; c = c->parent) {
+		if (c == child) {
+			return;
+		}
+	}
+	unlink(child);
+	child->parent = parent;
+
+	std::vector<Container *>::iterator pos = parent->children.end();
+	while (pos != parent->children.begin() &&
+	       (*(pos - 1))->uid > child->uid) {
+		--pos;
+	}
+	parent->children.insert(pos, child);
+}
+
+void Thread_Index::unlink(Container *child)
+{
+	if (child->parent == NULL) {
+		return;
+	}
+	std::vector<Container *> &siblings = child->parent->children;
+	siblings.erase(std::find(siblings.begin(), siblings.end(), child));
+	child->parent = NULL;
+}
@@ -0,0 +1,82 @@
+/*
+ * Conversations, built from the Message-IDs of the messages
+ */
+#ifndef _THREAD_INDEX_H
+#define _THREAD_INDEX_H
+
+#include "imap_parser.h"
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+/* a message in the order of the conversations */
+struct Thread_Entry {
+	uint32_t uid;
+	/* how many replies deep it is */
+	unsigned int depth;
+
+	Thread_Entry(uint32_t u, unsigned int d) :
+		uid(u),
+		depth(d)
+	{}
+};
+
+/*
+ * The messages of one mailbox as trees of replies, as described by Jamie
+ * Zawinski. Each Message-ID has a container, which is linked under the
+ * container of the message it replies to. A reply may arrive before the
+ * message it replies to, in which case the parent is an empty container
+ * until the message itself is added. Adding a message only touches its own
+ * container and the parent, so the index is kept up to date as messages
+ * arrive instead of being rebuilt.
+ *
+ * An envelope only tells the In-Reply-To of a message, not the whole chain
+ * of References. When the server can thread the mailbox itself, its result
+ * replaces the links between the messages it knows.
+ */
+class Thread_Index {
+public:
+	Thread_Index();
+
+	void add(const Envelope *env);
+	void remove(uint32_t uid);
+	void clear();
+	/* Link a message under another one, or make it a root with zero */
+	void set_parent(uint32_t uid, uint32_t parent);
+
+	/*
+	 * All the messages, each conversation after the next. The replies
+	 * follow the messages they reply to, and the conversations are in
+	 * the order of their latest messages.
+	 */
+	std::vector<Thread_Entry> sequence() const;
+
+private:
+	struct Container {
+		/* zero until the message is known */
+		uint32_t uid;
+		Container *parent;
+		/* ordered by UID */
+		std::vector<Container *> children;
+
+		Container() :
+			uid(0),
+			parent(NULL)
+		{}
+	};
+
+	/* the containers never move */
+	std::list<Container> m_containers;
+	std::map<std::string, Container *> m_by_id;
+	std::map<uint32_t, Container *> m_by_uid;
+
+	Container *new_container();
+	Container *container(const std::string &message_id);
+	void link(Container *child, Container *parent);
+	void unlink(Container *child);
+
+	DISABLE_COPY_AND_ASSIGN(Thread_Index);
+};
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * jamail - Just another mail client
+ *
+ * Copyright 2011 Janne Kulmala <janne.t.kulmala@iki.fi>
+ *
+ * Program code is licensed with GNU LGPL 2.1. See COPYING.LGPL file.
+ */
+#include "tls.h"
+#include "utils.h"
+#include <glib.h>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+struct Server_Session {
+	SSL_SESSION *session;
+	std::string path;
+	bool loaded;
+
+	Server_Session() :
+		session(NULL),
+		loaded(false)
+	{}
+};
+
+SSL_CTX *context = NULL;
+/* the handshakes happen on the network threads */
+GMutex sessions_lock;
+std::map<std::string, Server_Session> sessions;
+
+void load_session(Server_Session *s)
+{
+	s->loaded = true;
+	if (s->path.empty()) {
+		return;
+	}
+	FILE *f = fopen(s->path.c_str(), "rb");
+	if (f == NULL) {
+		return;
+	}
+	std::string data;
+	char buf[4096];
+	while (1) {
+		size_t got = fread(buf, 1, sizeof buf, f);
+		if (got == 0)
+			break;
+		data.append(buf, got);
+	}
+	fclose(f);
+
+	const unsigned char *p = (const unsigned char *) data.data();
+	s->session = d2i_SSL_SESSION(NULL, &p, data.size());
+	if (s->session == NULL) {
+		debug("Ignoring an invalid TLS session in %s\n",
+		      s->path.c_str());
+	}
+}
+
+/* a partially written file is never seen under the real name */
+void save_session(const Server_Session *s)
+{
+	int length = i2d_SSL_SESSION(s->session, NULL);
+	if (s->path.empty() || length <= 0) {
+		return;
+	}
+	std::string data(length, 0);
+	unsigned char *p = (unsigned char *) &data[0];
+	i2d_SSL_SESSION(s->session, &p);
+
+	/* it contains the keys of the session */
+	std::string tmp = s->path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	FILE *f = fd >= 0 ? fdopen(fd, "wb") : NULL;
+	if (f == NULL) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		debug("Can not create %s: %s\n", tmp.c_str(), strerror(errno));
+		return;
+	}
+	size_t written = fwrite(data.data(), 1, data.size(), f);
+	if (fclose(f) != 0 || written != data.size() ||
+	    rename(tmp.c_str(), s->path.c_str()) < 0) {
+		debug("Unable to save the TLS session to %s\n",
+		      s->path.c_str());
+		unlink(tmp.c_str());
+	}
+}
+
+/*
+ * Called by OpenSSL when the server gives a session. With TLS 1.3, this
+ * happens after the handshake.
+ */
+int new_session(SSL *ssl, SSL_SESSION *session)
+{
+	const char *server = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+	if (server == NULL) {
+		return 0;
+	}
+	g_mutex_lock(&sessions_lock);
+	Server_Session &s = sessions[server];
+	if (s.session != NULL) {
+		SSL_SESSION_free(s.session);
+	}
+	/* we keep the reference */
+	s.session = session;
+	s.loaded = true;
+	save_session(&s);
+	g_mutex_unlock(&sessions_lock);
+	return 1;
+}
+
+}
+
+SSL_CTX *tls_context()
+{
+	if (context != NULL) {
+		return context;
+	}
+	context = SSL_CTX_new(SSLv23_client_method());
+	if (context == NULL) {
+		throw std::runtime_error("Can not create SSL context");
+	}
+	SSL_CTX_set_options(context, SSL_OP_ALL | SSL_OP_NO_SSLv2 |
+			    SSL_OP_NO_SSLv3);
+	SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE|
+			 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	/* the certificate is not enforced, but it can be checked */
+	SSL_CTX_set_default_verify_paths(context);
+	SSL_CTX_set_verify(context, SSL_VERIFY_NONE, NULL);
+
+	/* the sessions are kept in our own cache, by server */
+	SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT |
+				       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(context, new_session);
+	return context;
+}
+
+void tls_set_session_file(const std::string &server, const std::string &path)
+{
+	g_mutex_lock(&sessions_lock);
+	Server_Session &s = sessions[server];
+	s.path = path;
+	g_mutex_unlock(&sessions_lock);
+}
+
+void tls_prepare(SSL *ssl, const std::string &server)
+{
+	/* several servers share an address, and need the name to choose */
+	SSL_set_tlsext_host_name(ssl, server.c_str());
+
+	g_mutex_lock(&sessions_lock);
+	Server_Session &s = sessions[server];
+	if (!s.loaded) {
+		load_session(&s);
+	}
+	if (s.session != NULL) {
+		/* takes a reference of its own */
+		SSL_set_session(ssl, s.session);
+	}
+	g_mutex_unlock(&sessions_lock);
+}
@@ -0,0 +1,24 @@
+/*
+ * TLS setup shared by all connections
+ */
+#ifndef _TLS_H
+#define _TLS_H
+
+#include <openssl/ssl.h>
+#include <string>
+
+/* The process-wide context, created when it is first needed */
+SSL_CTX *tls_context();
+
+/*
+ * The sessions are remembered by server, so that the next connection to
+ * the same server can resume the session instead of doing a full
+ * handshake. If a file is given for a server, its session is also kept
+ * over restarts.
+ */
+void tls_set_session_file(const std::string &server, const std::string &path);
+
+/* Prepare a new connection to the server, before the handshake */
+void tls_prepare(SSL *ssl, const std::string &server);
+
+#endif
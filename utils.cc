@@ -1,14 +1,144 @@
 #include "utils.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+size_t ascii_prefix(const char *s, size_t length)
+{
+	size_t i = 0;
+#ifdef __SSE2__
+	/* the high bits of 16 chars at a time */
+	for (; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) &s[i]);
+		int mask = _mm_movemask_epi8(v);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	while (i < length && (unsigned char) s[i] < 0x80) {
+		i++;
+	}
+	return i;
+}
+
+bool is_utf8(const char *s, size_t length)
+{
+	size_t i = 0;
+	while (1) {
+		i += ascii_prefix(&s[i], length - i);
+		if (i == length) {
+			return true;
+		}
+
+		unsigned char c = s[i];
+		size_t extra;
+		uint32_t value;
+		if (c >= 0xc2 && c <= 0xdf) {
+			extra = 1;
+			value = c & 0x1f;
+		} else if ((c & 0xf0) == 0xe0) {
+			extra = 2;
+			value = c & 0x0f;
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			extra = 3;
+			value = c & 0x07;
+		} else {
+			return false;
+		}
+		if (length - i <= extra) {
+			return false;
+		}
+		for (size_t j = 1; j <= extra; ++j) {
+			c = s[i + j];
+			if ((c & 0xc0) != 0x80) {
+				return false;
+			}
+			value = (value << 6) | (c & 0x3f);
+		}
+		/* overlong sequences, surrogates and too large values */
+		if ((extra == 2 && value < 0x800) ||
+		    (value >= 0xd800 && value < 0xe000) ||
+		    (extra == 3 && (value < 0x10000 || value > 0x10ffff))) {
+			return false;
+		}
+		i += extra + 1;
+	}
+}
 
 ustring to_unicode(const std::string &in)
 {
-	ustring out(in.size(), 0);
-	for (size_t i = 0; i < in.size(); ++i) {
+	return to_unicode(in.data(), in.size());
+}
+
+ustring to_unicode(const char *in, size_t length)
+{
+	ustring out(length, 0);
+	uint32_t *dest = &out[0];
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i invalid = _mm_set1_epi8('?');
+	for (; i + 16 <= length; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) &in[i]);
+		/* the chars >= 128 are negative */
+		__m128i high = _mm_cmplt_epi8(v, zero);
+		v = _mm_or_si128(_mm_andnot_si128(high, v),
+				 _mm_and_si128(high, invalid));
+
+		/* widen to 16 bits and then to 32 bits */
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i *p = (__m128i *) &dest[i];
+		_mm_storeu_si128(p, _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128(p + 1, _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128(p + 2, _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128(p + 3, _mm_unpackhi_epi16(hi, zero));
+	}
+#endif
+	for (; i < length; ++i) {
 		unsigned char c = in[i];
 		if (c >= 128) {
 			c = '?';
 		}
-		out[i] = c;
+		dest[i] = c;
 	}
 	return out;
 }
+
+bool to_ascii(const ustring &in, std::string *out)
+{
+	size_t length = in.size();
+	out->resize(length);
+	char *dest = &(*out)[0];
+	const uint32_t *src = in.data();
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i non_ascii = _mm_set1_epi32(~0x7f);
+	for (; i + 16 <= length; i += 16) {
+		const __m128i *p = (const __m128i *) &src[i];
+		__m128i a = _mm_loadu_si128(p);
+		__m128i b = _mm_loadu_si128(p + 1);
+		__m128i c = _mm_loadu_si128(p + 2);
+		__m128i d = _mm_loadu_si128(p + 3);
+		__m128i all = _mm_or_si128(_mm_or_si128(a, b),
+					   _mm_or_si128(c, d));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+				_mm_and_si128(all, non_ascii),
+				_mm_setzero_si128())) != 0xffff) {
+			return false;
+		}
+		/* all of the values fit, so saturation does nothing */
+		__m128i v = _mm_packus_epi16(_mm_packs_epi32(a, b),
+					     _mm_packs_epi32(c, d));
+		_mm_storeu_si128((__m128i *) &dest[i], v);
+	}
+#endif
+	for (; i < length; ++i) {
+		if (src[i] >= 0x80) {
+			return false;
+		}
+		dest[i] = src[i];
+	}
+	return true;
+}
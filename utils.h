@@ -325,5 +325,18 @@ Value getdefault(const std::map<Key, Value> &map, const Key &key,
  * with '?'.
  */
 ustring to_unicode(const std::string &s);
+ustring to_unicode(const char *s, size_t length);
+
+/*
+ * FAST conversion from unicode to ASCII. Returns false (and leaves the
+ * output undefined) if there are characters that are not ASCII.
+ */
+bool to_ascii(const ustring &in, std::string *out);
+
+/* The length of the initial part of the string that is plain ASCII */
+size_t ascii_prefix(const char *s, size_t length);
+
+/* Check whether the string is valid UTF-8 */
+bool is_utf8(const char *s, size_t length);
 
 #endif